@@ -13,6 +13,8 @@ function love.conf(t)
     -- set the window size
     t.window.width = canvasWidth
     t.window.height = canvasHeight
+    -- the text area follows the window, see love.resize
+    t.window.resizable = true
 
     -- disable unused modules for performance
     t.modules.joystick = false
@@ -0,0 +1,93 @@
+--- ed9core.lua - the editor core, libed9core, loaded through the LuaJIT FFI
+--
+-- author: Abhishek Mishra
+-- date: 15/10/2026
+
+local ffi = require'ffi'
+
+-- ed9core.h is plain C once its preprocessor lines and ED9_API are gone
+local header = love.filesystem.read('ed9core/ed9core.h')
+header = header:gsub('#[^\n]*', ''):gsub('ED9_API ', '')
+ffi.cdef(header)
+
+-- built with `make lib` in ed9core
+local lib = ffi.load(love.filesystem.getSource() .. '/ed9core/libed9core.so')
+
+-- filled in place by view and lines, so drawing a frame allocates nothing
+local view = ffi.new('ed9_view')
+local spans = ffi.new('ed9_span[256]')
+
+local core = {
+    lib = lib,
+    -- the spans of the last call to lines, from 0, pointing into the core
+    spans = spans,
+    -- love key names of the keys that ed9_key takes
+    keys = {
+        ['return'] = 13,
+        tab = 9,
+        backspace = lib.ED9_KEY_BACKSPACE,
+        delete = lib.ED9_KEY_DELETE,
+        left = lib.ED9_KEY_LEFT,
+        right = lib.ED9_KEY_RIGHT,
+        up = lib.ED9_KEY_UP,
+        down = lib.ED9_KEY_DOWN,
+        home = lib.ED9_KEY_HOME,
+        ['end'] = lib.ED9_KEY_END,
+        pageup = lib.ED9_KEY_PAGE_UP,
+        pagedown = lib.ED9_KEY_PAGE_DOWN,
+    },
+}
+
+function core.init(rows, cols)
+    return lib.ed9_init(rows, cols) == 0
+end
+
+function core.resize(rows, cols)
+    lib.ed9_resize(rows, cols)
+end
+
+function core.open(path)
+    return lib.ed9_open(path) == 0
+end
+
+function core.save()
+    return lib.ed9_save() == 0
+end
+
+function core.update()
+    return lib.ed9_update() ~= 0
+end
+
+function core.key(key)
+    lib.ed9_key(key)
+end
+
+function core.insert(text)
+    lib.ed9_insert(text, #text)
+end
+
+function core.click(rx, y)
+    lib.ed9_click(rx, y)
+end
+
+--- the cursor and what is shown, valid until the next call to view
+function core.view()
+    lib.ed9_get_view(view)
+    return view
+end
+
+--- point core.spans at up to n lines from first (both from 0), over the
+-- columns col to col + width, and return how many lines there are
+function core.lines(first, n, col, width)
+    return lib.ed9_lines(first, n, col, width, spans)
+end
+
+function core.status()
+    return ffi.string(lib.ed9_status())
+end
+
+function core.quit()
+    lib.ed9_quit()
+end
+
+return core
@@ -0,0 +1,121 @@
+/**
+ * @file ed9core.h
+ * @brief C API of libed9core, the editor core of ed9t without the terminal,
+ * for the LÖVE frontend
+ *
+ * main.lua loads the library through the LuaJIT FFI, which is handed this
+ * file with the preprocessor lines and ED9_API taken out, so everything
+ * declared here must stay plain C.
+ *
+ * The core edits the buffer shown, with a screen of the size set by
+ * ed9_init and ed9_resize. Lines are handed out as spans pointing into the
+ * core, all the spans of one ed9_lines call together, which stay valid
+ * until the next call into the API.
+ */
+#ifndef ED9CORE_H
+#define ED9CORE_H
+
+#if defined(__GNUC__)
+#define ED9_API __attribute__((visibility("default")))
+#else
+#define ED9_API
+#endif
+
+/* keys besides characters that ed9_key takes, Ctrl-Z and Ctrl-Y undo and redo */
+enum
+{
+  ED9_KEY_BACKSPACE = 127,
+  ED9_KEY_LEFT = 1000,
+  ED9_KEY_RIGHT,
+  ED9_KEY_UP,
+  ED9_KEY_DOWN,
+  ED9_KEY_DELETE,
+  ED9_KEY_HOME,
+  ED9_KEY_END,
+  ED9_KEY_PAGE_UP,
+  ED9_KEY_PAGE_DOWN
+};
+
+/* highlight classes of ed9_span.hl */
+enum
+{
+  ED9_HL_NORMAL = 0,
+  ED9_HL_COMMENT,
+  ED9_HL_MLCOMMENT,
+  ED9_HL_KEYWORD1,
+  ED9_HL_KEYWORD2,
+  ED9_HL_STRING,
+  ED9_HL_NUMBER,
+  ED9_HL_MATCH
+};
+
+/*
+the columns of a line that are shown, tabs expanded, with their classes.
+hash is of both, so a frontend can keep what it drew for a span and draw
+it again for as long as a span of the same hash comes back
+*/
+typedef struct
+{
+  const char *text;
+  const unsigned char *hl;
+  int len;
+  unsigned int hash;
+} ed9_span;
+
+/* the cursor and the part of the buffer that is shown */
+typedef struct
+{
+  /* cursor, as a column of the line and as a column on screen */
+  int cx;
+  int cy;
+  int rx;
+  /* first line and first column shown */
+  int rowoff;
+  int coloff;
+  int numrows;
+  int dirty;
+  /* percent of the file loaded, lines come in until it is 100 */
+  int loaded;
+  /* buffer shown, and the number of buffers */
+  int buffer;
+  int nbuffers;
+} ed9_view;
+
+/* start the core with a screen of rows lines of cols columns, 0 or -1 */
+ED9_API int ed9_init(int rows, int cols);
+ED9_API void ed9_resize(int rows, int cols);
+/* open a file, in a new buffer unless the one shown is empty, 0 or -1 */
+ED9_API int ed9_open(const char *path);
+ED9_API int ed9_switch(int buffer);
+/* save the buffer shown to its file, 0 or -1 */
+ED9_API int ed9_save(void);
+/* run background work a step, 1 while there is more of it */
+ED9_API int ed9_update(void);
+
+ED9_API void ed9_key(int key);
+ED9_API void ed9_insert(const char *text, int len);
+/* move the cursor to a column on screen of a line */
+ED9_API void ed9_click(int rx, int y);
+/*
+search for query, as a regex if regex is set. key is 0 for a new query,
+ED9_KEY_DOWN or ED9_KEY_UP to move to the next or previous match, and '\r'
+to end the search. returns the number of matches found so far, or -1 for
+a bad regex. the search is forgotten by every call that edits the buffer,
+ed9_insert, ed9_replace and ed9_key but for the keys that only move the
+cursor, and the next ed9_find starts it over from the first match
+*/
+ED9_API long long ed9_find(const char *query, int regex, int key);
+ED9_API void ed9_replace(const char *query, const char *with, int regex);
+
+ED9_API void ed9_get_view(ed9_view *view);
+/*
+fill out with the columns col to col + width of up to n lines from first,
+at most 256. returns the number of lines filled
+*/
+ED9_API int ed9_lines(int first, int n, int col, int width, ed9_span *out);
+/* the status message, as the terminal shows it */
+ED9_API const char *ed9_status(void);
+/* end the session, dropping the journals of changes that weren't saved */
+ED9_API void ed9_quit(void);
+
+#endif
@@ -17,15 +17,29 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ed9core.h"
 
 /*** DEFINES ***/
 
@@ -40,41 +54,243 @@ that sets the first 3 bits to 0
 #define ED9T_VERSION "0.1.0"
 
 #define ED9T_TAB_STOP 8
+/* rows with tabs from this length on get a column map with their render */
+#define ED9T_COLUMN_MAP_MIN 256
+/* rows from this length on are handled in segments, see ROW SEGMENTS */
+#define ED9T_SEGMENT_MIN (1 << 16)
+/* length from which a segment is cut at the next separator, at most twice it */
+#define ED9T_SEGMENT_SIZE 4096
 
 #define ED9T_QUIT_TIMES 3
 
-/* special editor keys enum */
+/* number of rows that keep their render and hl arrays around */
+#define ED9T_RENDER_CACHE_ROWS 1024
+/* bytes of render and hl the rows of all buffers may hold between them */
+#ifndef ED9T_RENDER_CACHE_BYTES
+#define ED9T_RENDER_CACHE_BYTES (64 << 20)
+#endif
+
+/* rows past the end of the screen that an edit re-highlights right away */
+#define ED9T_SYNTAX_LOOKAHEAD 16
+
+/* scan the comment states of the file on a worker thread, 0 to scan inline */
+#ifndef ED9T_HL_WORKER
+#define ED9T_HL_WORKER 1
+#endif
+/* most rows, and bytes of them, the worker takes in one slice */
+#define ED9T_HL_SLICE_ROWS 4096
+#define ED9T_HL_SLICE_BYTES (256 << 10)
+
+/* files of at least this many bytes are opened in large-file mode */
+#ifndef ED9T_LARGE_FILE
+#define ED9T_LARGE_FILE (256LL << 20)
+#endif
+/* most lines, and bytes, of a span made when a large file is opened */
+#define ED9T_SPAN_LINES 4096
+#define ED9T_SPAN_BYTES (1 << 20)
+/* rows loaded out of spans before the ones far from the screen are folded */
+#define ED9T_LARGE_ROWS (1 << 16)
+/* read the rest of a large file on a thread once its first screen is in */
+#ifndef ED9T_LOAD_ASYNC
+#define ED9T_LOAD_ASYNC 1
+#endif
+/* bytes of a large file that the reader indexes and hands over at a time */
+#define ED9T_LOAD_PIECE (64 << 20)
+/* pack the edited rows far from the screen, see COLD STORAGE */
+#ifndef ED9T_PACK
+#define ED9T_PACK 1
+#endif
+/* least heap a run of rows must hold to be packed, most bytes in one span */
+#define ED9T_PACK_MIN (4 << 10)
+#define ED9T_PACK_BYTES (64 << 10)
+/* packed spans kept unpacked, for searching and saving through them */
+#define ED9T_PACK_CACHE 8
+/* bits of the hash of the match finder of pack_compress */
+#define ED9T_PACK_HASH_BITS 12
+
+/* most threads that index the newlines of a file when it is opened */
+#ifndef ED9T_INDEX_THREADS
+#define ED9T_INDEX_THREADS 16
+#endif
+/* fewest bytes of a file given to each of the indexing threads */
+#define ED9T_INDEX_CHUNK (8 << 20)
+
+/* iovecs handed to a single writev by editor_save */
+#define ED9T_SAVE_IOV 1024
+
+/* most matches a search keeps a list of, the rest are only counted */
+#define ED9T_SEARCH_MAX_MATCHES (1 << 20)
+/* bytes searched per step of a search */
+#define ED9T_SEARCH_STEP (1 << 20)
+/* bytes searched for the first match before the prompt is redrawn */
+#define ED9T_SEARCH_BUDGET (16 << 20)
+/* fewest bytes of rows given to each of the threads counting matches */
+#define ED9T_SEARCH_CHUNK (256 << 10)
+
+/* bytes of lazily built DFA states a regex keeps before starting over */
+#define ED9T_REGEX_DFA_BYTES (1 << 20)
+/* most instructions a regex compiles to, and largest count of a {m,n} */
+#define ED9T_REGEX_PROGRAM (1 << 16)
+#define ED9T_REGEX_REPEAT 1000
+/* deepest nesting of groups in a regex, and longest pattern */
+#define ED9T_REGEX_DEPTH 256
+#define ED9T_REGEX_PATTERN 4096
+
+/* how often the screen is redrawn while background work runs */
+#define ED9T_IDLE_REFRESH_MS 50
+
+/* bytes of input read with one read call */
+#define ED9T_INPUT_BUF (1 << 16)
+/* shortest time between two frames, a cap of about 60 frames per second */
+#define ED9T_FRAME_MS 16
+/* how long to wait for the rest of an escape sequence */
+#define ED9T_ESC_TIMEOUT_MS 100
+/* how long a bracketed paste may stall before it is taken as finished */
+#define ED9T_PASTE_TIMEOUT_MS 1000
+
+/* bytes of edit history kept for undo, older edits are dropped beyond it */
+#ifndef ED9T_UNDO_LIMIT
+#define ED9T_UNDO_LIMIT (64 << 20)
+#endif
+/* longest run of typing that is merged into one undo record */
+#define ED9T_UNDO_MERGE 256
+
+/* keep a crash-recovery journal of the edits next to the file, see JOURNAL */
+#ifndef ED9T_JOURNAL
+#define ED9T_JOURNAL 1
+#endif
+/* bytes of journal records buffered before they are written out as a frame */
+#define ED9T_JOURNAL_BATCH (1 << 20)
+/* longest time a journaled edit waits for fdatasync */
+#define ED9T_JOURNAL_MS 1000
+
+/* reload the files of the buffers that other programs change, see WATCH */
+#ifndef ED9T_WATCH
+#define ED9T_WATCH 1
+#endif
+/* bytes at either end of a file compared to tell an append from a rewrite */
+#define ED9T_WATCH_PROBE 4096
+
+/* time the hot paths and count their work, see PERF, 0 to leave it out */
+#ifndef ED9T_PERF
+#define ED9T_PERF 1
+#endif
+
+/* most lines ed9_lines hands out at once, their renders must all fit the cache */
+#define ED9T_LIBRARY_LINES (ED9T_RENDER_CACHE_ROWS / 4)
+
+/* fixed screen size of a headless run, the status bar lines included */
+#define ED9T_BENCH_ROWS 50
+#define ED9T_BENCH_COLS 160
+/* every how many lines of a benchmark corpus the search term is put */
+#define ED9T_BENCH_NEEDLE 1000
+
+/* row storage size classes, 16 bytes up to 16 KiB, carved from 64 KiB chunks */
+#define ED9T_SLAB_MIN 16
+#define ED9T_SLAB_CLASSES 11
+#define ED9T_SLAB_CHUNK (1 << 16)
+
+/* special editor keys enum, the ones of the library API share its values */
 typedef enum
 {
-  BACKSPACE = 127,
-  ARROW_LEFT = 1000,
-  ARROW_RIGHT,
-  ARROW_UP,
-  ARROW_DOWN,
-  DEL_KEY,
-  HOME_KEY,
-  END_KEY,
-  PAGE_UP,
-  PAGE_DOWN
+  BACKSPACE = ED9_KEY_BACKSPACE,
+  ARROW_LEFT = ED9_KEY_LEFT,
+  ARROW_RIGHT = ED9_KEY_RIGHT,
+  ARROW_UP = ED9_KEY_UP,
+  ARROW_DOWN = ED9_KEY_DOWN,
+  DEL_KEY = ED9_KEY_DELETE,
+  HOME_KEY = ED9_KEY_HOME,
+  END_KEY = ED9_KEY_END,
+  PAGE_UP = ED9_KEY_PAGE_UP,
+  PAGE_DOWN = ED9_KEY_PAGE_DOWN,
+  /* a bracketed paste, the pasted text is in E.paste */
+  PASTE_KEY
 } EditorKey;
 
 typedef enum
 {
-  HL_NORMAL = 0,
-  HL_COMMENT,
-  HL_MLCOMMENT,
-  HL_KEYWORD1,
-  HL_KEYWORD2,
-  HL_STRING,
-  HL_NUMBER,
-  HL_MATCH
+  HL_NORMAL = ED9_HL_NORMAL,
+  HL_COMMENT = ED9_HL_COMMENT,
+  HL_MLCOMMENT = ED9_HL_MLCOMMENT,
+  HL_KEYWORD1 = ED9_HL_KEYWORD1,
+  HL_KEYWORD2 = ED9_HL_KEYWORD2,
+  HL_STRING = ED9_HL_STRING,
+  HL_NUMBER = ED9_HL_NUMBER,
+  HL_MATCH = ED9_HL_MATCH
 } EditorHighlight;
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+/* row flags */
+/* chars points into the file mapping, it is read-only and not NUL terminated */
+#define ROW_MAPPED (1 << 0)
+/* the row's hl was filled plain while the worker had not reached it */
+#define ROW_HL_PLAIN (1 << 1)
+/*
+the node is a span: a run of lines of the file mapping that have not been
+loaded as rows. chars and size cover the lines joined by their newlines,
+without the newline after the last one
+*/
+#define ROW_SPAN (1 << 2)
+/*
+a span of edited rows and the lines between them, packed when they were far
+from the screen. chars is a block of ccap bytes holding the lines compressed,
+see COLD STORAGE, size and lines are those of the lines unpacked
+*/
+#define ROW_PACKED (1 << 3)
+
 /*** DATA ***/
 
+/* states of the lexer, see editor_syntax_highlight_piece */
+enum EditorLexStateKind
+{
+  LEX_NORMAL = 0,
+  LEX_COMMENT,
+  LEX_STRING,
+  LEX_STATES
+};
+
+/* classes the lexer sorts bytes into, per syntax */
+enum EditorLexClass
+{
+  LEX_WORD = 0,
+  LEX_SEP,
+  LEX_DIGIT,
+  LEX_DOT,
+  LEX_QUOTE,
+  LEX_ESCAPE,
+  LEX_CLASSES
+};
+
+/* flags of the bytes that may start a keyword or a comment marker */
+#define LEX_KW_FIRST (1 << 0)
+#define LEX_SCS_FIRST (1 << 1)
+#define LEX_MCS_FIRST (1 << 2)
+
+/*
+lookup tables built from an EditorSyntax entry by editor_syntax_compile,
+the keywords go into an open addressing hash table keyed on the whole word
+*/
+typedef struct EditorSyntaxCompiled
+{
+  int scs_len;
+  int mcs_len;
+  int mce_len;
+  /* class and flags of every byte, with the syntax's flags folded in */
+  unsigned char lex_class[256];
+  unsigned char lex_flags[256];
+
+  /* number of keyword slots - 1, the number of slots is a power of two */
+  unsigned int kw_mask;
+  int kw_maxlen;
+  const char **kw_words;
+  unsigned char *kw_lens;
+  unsigned char *kw_types;
+  /* set for every byte that some keyword starts with */
+  unsigned char kw_first[256];
+} EditorSyntaxCompiled;
+
 typedef struct
 {
   char *filetype;
@@ -84,20 +300,510 @@ typedef struct
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  EditorSyntaxCompiled *compiled;
 } EditorSyntax;
 
-/* type for one row of data */
 typedef struct
 {
-  int idx;
+  char *b;
+  int len;
+  int cap;
+} AppendBuffer;
+
+#define ABUF_INIT {NULL, 0, 0}
+
+/* kinds of records in the undo log */
+typedef enum
+{
+  UNDO_INSERT = 1,
+  UNDO_DELETE,
+  UNDO_INSERT_ROWS,
+  UNDO_DELETE_ROWS
+} EditorUndoKind;
+
+/* set on the first record of a group, which is undone or redone as a whole */
+#define UNDO_GROUP (1 << 3)
+
+/* a record of the undo log, decoded */
+typedef struct
+{
+  int kind;
+  int group;
+  int y;
+  int x;
+  int len;
+  const char *text;
+  /* offsets of the record in the log */
+  int start;
+  int end;
+} EditorUndoRecord;
+
+/* undo state, the log format is described in UNDO */
+typedef struct
+{
+  AppendBuffer log;
+  /* records before pos are applied, the ones after it can be redone */
+  int pos;
+  /* line number of the record that ends at pos */
+  int pos_y;
+  /* 0 when the next record starts a new group */
+  int open;
+  /* set while undoing or redoing, so the edits aren't recorded again */
+  int replaying;
+} EditorUndo;
+
+/* crash-recovery journal of a buffer, the format is described in JOURNAL */
+typedef struct
+{
+  /* path of the journal, NULL while the buffer keeps none */
+  char *path;
+  /* descriptor of the journal, -1 until an edit creates it */
+  int fd;
+  /* records not written yet */
+  AppendBuffer pending;
+  /* when the oldest record that is not synced was added, in ms, 0 if none */
+  long long since;
+  /* the version of the file the journal applies to */
+  long long size;
+  long long mtime;
+  long long ino;
+  /* set while the journal is replayed, so its edits aren't journaled again */
+  int replaying;
+} EditorJournal;
+
+/* the file of a buffer as the buffer holds it, see WATCH */
+typedef struct
+{
+  /* watch of the directory of the file, and the name of the file in it */
+  int wd;
+  char *name;
+  /* set when an event named the file, until it is looked at */
+  int changed;
+  /* the version of the file the rows were read from or written to */
+  long long size;
+  long long mtime;
+  long long ino;
+  /* hash of the ends of that version, see editor_watch_probe */
+  unsigned long long probe;
+} EditorWatch;
+
+/*
+state of the highlight worker. the input thread holds lock at all times
+except while it waits for input, the worker takes it only to copy a slice
+of rows and to store the states it computed for them
+*/
+typedef struct
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int running;
+  /* the text of the slice, one row after the other */
+  char *text;
+  int text_size;
+  int lens[ED9T_HL_SLICE_ROWS];
+  unsigned char states[ED9T_HL_SLICE_ROWS];
+  unsigned char *hl;
+  int hl_size;
+} EditorHlWorker;
+
+/* a free block of row storage, linked into the free list of its class */
+typedef struct SlabBlock
+{
+  struct SlabBlock *next;
+} SlabBlock;
+
+/*
+type for one row of data
+
+rows are kept as nodes of an implicit treap (see ROW TREE) ordered by
+their position in the file, so a row's line number is not stored but
+computed from the subtree sizes when it is needed.
+*/
+typedef struct EditorRow
+{
   int size;
   int rsize;
+  int flags;
+  /* tabs in chars, only known while the row has a render */
+  int ntabs;
   char *chars;
+  /* size of the block holding chars, 0 while chars is in the file mapping */
+  int ccap;
+  /* render and hl share one block, hl starts rcap bytes after render */
   char *render;
   unsigned char *hl;
+  int rcap;
+  /*
+  column map built with the render of a long row with tabs, for each tab its
+  index in chars and the render column after it
+  */
+  int *colmap;
+  /* segment table of a very long row, see ROW SEGMENTS */
+  struct EditorSegments *segs;
   int hl_open_comment;
+
+  /* links in the render cache, only for rows that have a render */
+  struct EditorRow *cache_prev;
+  struct EditorRow *cache_next;
+
+  /* row tree links */
+  struct EditorRow *left;
+  struct EditorRow *right;
+  struct EditorRow *parent;
+  /* number of lines the node stands for, more than 1 only for spans */
+  int lines;
+  /* number of lines in the subtree rooted at this row */
+  int count;
+  unsigned int prio;
 } EditorRow;
 
+/* state of the highlighter between two pieces of a row, see ROW SEGMENTS */
+typedef struct
+{
+  int in_comment;
+  int in_string;
+  int line_comment;
+  int prev_sep;
+  unsigned char prev_hl;
+} EditorLexState;
+
+/* a piece of a very long row */
+typedef struct
+{
+  int len;
+  int tabs;
+  /* render columns, when it starts at a column of phase modulo the tab stop */
+  int width;
+  int phase;
+  /* highlighter state at the start of the segment */
+  EditorLexState state;
+} EditorSegment;
+
+typedef struct EditorSegments
+{
+  EditorSegment *seg;
+  int n;
+  int cap;
+  /*
+  number of known states, those at the start of the first segments and the
+  one at the end of the row as the last, found with the syntax in syntax
+  */
+  int nstates;
+  EditorLexState end;
+  EditorSyntax *syntax;
+  /* segments covered by the row's render, and the char and column it starts at */
+  int first;
+  int last;
+  int cx;
+  int rx;
+} EditorSegments;
+
+/* a run of nodes that editor_span_reclaim folds, or packs, into one span */
+typedef struct
+{
+  int at;
+  int lines;
+  int nodes;
+  char *chars;
+  int size;
+} EditorSpanRun;
+
+/* a packed span unpacked lately, see editor_span_chars */
+typedef struct
+{
+  EditorRow *span;
+  char *text;
+  int cap;
+  unsigned long long used;
+} EditorPackCache;
+
+/*
+a chunk of the mapping indexed by one thread at file open, it starts on a line
+and holds every line that starts in it
+*/
+typedef struct
+{
+  pthread_t thread;
+  char *start;
+  char *end;
+  /* lines in the chunk, and lines in the chunks before it */
+  int lines;
+  int first;
+  /* rows or spans of the chunk */
+  EditorRow *rows;
+  int nrows;
+} EditorIndexChunk;
+
+/* spans of a piece of a large file indexed by the reader, see FILE I/O */
+typedef struct EditorLoadPiece
+{
+  EditorRow *spans;
+  int nspans;
+  int lines;
+  size_t bytes;
+  struct EditorLoadPiece *next;
+} EditorLoadPiece;
+
+/* the reader of a large file that is still being loaded */
+typedef struct
+{
+  pthread_t thread;
+  /* the rest of the mapping, that the reader indexes */
+  char *start;
+  char *end;
+  /* pieces indexed and not joined to the rows yet, signaled as they come */
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  EditorLoadPiece *head;
+  EditorLoadPiece *tail;
+  /* set by the reader once it queued its last piece */
+  int done;
+  /* bytes of the file joined to the rows */
+  size_t loaded;
+} EditorLoad;
+
+/* instructions of a compiled regex, see REGEX */
+enum EditorRegexOp
+{
+  /* take a byte of set x */
+  RE_SET = 0,
+  /* go on at both x and y */
+  RE_SPLIT,
+  /* go on at x */
+  RE_JMP,
+  /* only at the start, or the end, of a line */
+  RE_BOL,
+  RE_EOL,
+  RE_MATCH
+};
+
+typedef struct
+{
+  int op;
+  int x, y;
+} EditorRegexInst;
+
+/* nodes of a parsed regex */
+enum EditorRegexNodeType
+{
+  RE_NODE_EMPTY = 0,
+  RE_NODE_SET,
+  RE_NODE_CAT,
+  RE_NODE_ALT,
+  RE_NODE_REPEAT,
+  RE_NODE_BOL,
+  RE_NODE_EOL
+};
+
+typedef struct
+{
+  int type;
+  /* operands, as node indexes */
+  int a, b;
+  /* bounds of a repeat, max is -1 when there is none */
+  int min, max;
+  /* the set of a set node, and its byte when it holds only one, or -1 */
+  int set;
+  int c;
+} EditorRegexNode;
+
+/* flags of a DFA state */
+#define RE_DFA_MATCH (1 << 0)
+/* matches if the line ends here */
+#define RE_DFA_EOL (1 << 1)
+/* no instruction left, nothing can match from here */
+#define RE_DFA_DEAD (1 << 2)
+/* the state at the start of a line, where ^ holds */
+#define RE_DFA_BOL (1 << 3)
+
+/*
+states of the DFA of a regex, built as the text needs them. a state is the
+sorted set of instructions the NFA can be at. unless the DFA is anchored, the
+regex is started over at every byte
+*/
+typedef struct
+{
+  int anchored;
+  int nstates;
+  int cap;
+  /* ncls transitions per state, -1 until first taken */
+  int *trans;
+  unsigned char *flags;
+  /* the instructions of state i are pcs[off[i]..off[i + 1]) */
+  int *pcs;
+  int npcs;
+  int pcscap;
+  int *off;
+  /* open hash of the states by their instructions */
+  int *table;
+  int tablecap;
+  /* start states at the start of a line and past it, -1 until built */
+  int start[2];
+  long long bytes;
+  /* scratch of the closures */
+  int *list;
+  int nlist;
+  int *stack;
+  unsigned int *mark;
+  unsigned int gen;
+} EditorRegexDfa;
+
+/* a compiled regex */
+typedef struct
+{
+  EditorRegexInst *prog;
+  int len;
+  /* bitmaps of the byte sets RE_SET instructions take */
+  unsigned char (*sets)[32];
+  int nsets;
+  /* bytes no set tells apart share a class, rep is a byte of each class */
+  unsigned char cls[256];
+  unsigned char rep[256];
+  int ncls;
+  /* bytes a match can start with, all of them if a match can be empty */
+  unsigned char first[256];
+  int nullable;
+  /* longest run of bytes found in every match, for the prefilter */
+  char *lit;
+  int litlen;
+  /* the DFAs of the main thread, to find a match and then its extent */
+  EditorRegexDfa dfa[2];
+} EditorRegex;
+
+/* state of the parse of a pattern */
+typedef struct
+{
+  const char *p;
+  /* what is wrong with the pattern, NULL while nothing is */
+  const char *err;
+  int depth;
+  EditorRegex *re;
+  int setcap;
+  int progcap;
+  EditorRegexNode *nodes;
+  int nnodes;
+  int nodecap;
+} EditorRegexParser;
+
+typedef struct
+{
+  EditorRow *row;
+  int col;
+} EditorMatch;
+
+/* rows whose matches one of the searching threads counts */
+typedef struct
+{
+  pthread_t thread;
+  EditorRow **rows;
+  int *hits;
+  int nrows;
+  /* the DFAs used for a regex, the thread's own or the main thread's */
+  EditorRegexDfa *dfa;
+  EditorRegexDfa own[2];
+} EditorSearchChunk;
+
+/*
+state of the search in progress, rows are scanned from the top and every
+match is counted, the matches in rows before list_rows are kept in matches
+*/
+typedef struct
+{
+  char *query;
+  int querylen;
+  /* the query compiled, when searching for a regex */
+  EditorRegex *re;
+  EditorMatch *matches;
+  int nmatches;
+  int cap;
+  /* rows before scan_idx have been scanned, scan_row is the row at scan_idx */
+  EditorRow *scan_row;
+  int scan_idx;
+  int list_rows;
+  long long total;
+  /* the current match, current is its index in matches or -1 if unlisted */
+  EditorRow *row;
+  int col;
+  int len;
+  int current;
+  long long ordinal;
+  /* row whose hl shows the current match */
+  EditorRow *hl_row;
+} EditorSearch;
+
+/* what the perf counters measure, units are what each counts besides time */
+enum EditorPerfTimer
+{
+  /* frames drawn, units are the bytes appended to buffers meanwhile */
+  PERF_REFRESH = 0,
+  /* comment state updates after edits, units count every row highlighted */
+  PERF_SYNTAX,
+  /* rows whose chars changed */
+  PERF_UPDATE_ROW,
+  /* search prompt callbacks, units are rows scanned by the search */
+  PERF_FIND,
+  /* file opens and saves, units are bytes */
+  PERF_OPEN,
+  PERF_SAVE,
+  /* journal frames written and synced, units are bytes */
+  PERF_JOURNAL,
+  /* keys processed, counted only */
+  PERF_KEYS,
+  /* cold rows packed and spans unpacked, see COLD STORAGE, units are lines */
+  PERF_PACK,
+  PERF_TIMERS
+};
+
+typedef struct
+{
+  long long calls;
+  long long ns;
+  long long units;
+} EditorPerfCounter;
+
+typedef struct
+{
+  /* totals since start, at the start of the last frame, and over it */
+  EditorPerfCounter total[PERF_TIMERS];
+  EditorPerfCounter mark[PERF_TIMERS];
+  EditorPerfCounter frame[PERF_TIMERS];
+  /* show the counters in the status bar */
+  int hud;
+  /* per frame trace written with --perf-trace, NULL when not tracing */
+  FILE *trace;
+  long long start;
+} EditorPerf;
+
+/*
+the fields of the editor state that belong to one open file, stored here
+while another buffer is shown, see BUFFERS
+*/
+typedef struct
+{
+  int cx, cy;
+  int rowoff;
+  int coloff;
+  int numrows;
+  EditorRow *rowroot;
+  char *map;
+  size_t maplen;
+  int mapfd;
+  int large;
+  int span_rows;
+  int span_limit;
+  EditorLoad *load;
+  int syntax_rows;
+  int syntax_resume;
+  int dirty;
+  char *filename;
+  EditorSyntax *syntax;
+  EditorSearch search;
+  EditorUndo undo;
+  EditorJournal journal;
+  EditorWatch watch;
+} EditorBuffer;
+
 /* type for global state of the editor */
 typedef struct
 {
@@ -108,18 +814,118 @@ typedef struct
   int screenrows;
   int screencols;
   int numrows;
-  EditorRow *row;
+  /* root of the row tree */
+  EditorRow *rowroot;
+  /* row nodes released by editor_del_row, linked through their right pointer */
+  EditorRow *freerows;
+  /* read-only mapping of the opened file, rows point into it until edited */
+  char *map;
+  size_t maplen;
+  /* descriptor of the mapped file, kept open so saves can copy from it */
+  int mapfd;
+  /* set in large-file mode, where most of the file is held in spans */
+  int large;
+  /* rows loaded out of spans, and how many may be before folding them */
+  int span_rows;
+  int span_limit;
+  /* the reader of a large file while the rest of it loads, else NULL */
+  EditorLoad *load;
+  /* packed spans unpacked lately, of every buffer, and the last use stamp */
+  EditorPackCache pack_cache[ED9T_PACK_CACHE];
+  unsigned long long pack_clock;
+  /* the lines of a run being packed, and room for the block they make */
+  char *pack_text;
+  int pack_text_size;
+  char *pack_block;
+  /* free lists of the row storage size classes */
+  SlabBlock *slab_free[ED9T_SLAB_CLASSES];
+  /*
+  rows with a render, most recently used first. the cache is shared by the
+  rows of every buffer, with the bytes they hold in cache_bytes
+  */
+  EditorRow *cache_head;
+  EditorRow *cache_tail;
+  int cache_rows;
+  long long cache_bytes;
+  /* rows at the head, besides the one added, that the bytes can't push out */
+  int cache_pinned;
+  /* number of leading rows whose hl_open_comment is known */
+  int syntax_rows;
+  /* rows after syntax_rows up to here hold checkpoints from an earlier scan */
+  int syntax_resume;
+  /* bumped by every edit, a worker slice copied before it is thrown away */
+  unsigned int syntax_gen;
+  unsigned char *hlscratch;
+  int hlscratch_size;
   int dirty;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   EditorSyntax *syntax;
   struct termios orig_termios;
+  /*
+  the lines last written to the terminal (E.screenrows text rows, the status
+  bar and the message bar), so a refresh only sends the lines that changed
+  */
+  AppendBuffer *shadow;
+  int shadow_lines;
+  int shadow_rowoff;
+  int shadow_coloff;
+  /* the lines being drawn and the output of a refresh, reused every frame */
+  AppendBuffer *lines;
+  AppendBuffer frame;
+  /* when the last frame was written, see ED9T_FRAME_MS */
+  long long last_frame;
+  /* input read from the terminal, keys are decoded from inbuf[inpos..inlen) */
+  char inbuf[ED9T_INPUT_BUF];
+  int inpos;
+  int inlen;
+  /* text of the last bracketed paste, newlines normalized to \n */
+  AppendBuffer paste;
+  /*
+  set in headless mode, see BENCH, where keys come from feed[feedpos..feedlen)
+  instead of the terminal, and frames go to outfd
+  */
+  int headless;
+  const char *feed;
+  int feedpos;
+  int feedlen;
+  int outfd;
+  EditorSearch search;
+  /* set when the find prompt takes regexes, and the prompt it shows */
+  int find_regex;
+  char find_prompt[80];
+  /* rows of the search step being counted, and the matches of each */
+  EditorRow **search_rows;
+  int *search_hits;
+  int search_cap;
+  EditorUndo undo;
+  EditorJournal journal;
+  EditorWatch watch;
+  /* inotify instance holding the watches of every buffer, -1 until needed */
+  int watchfd;
+  EditorHlWorker hlworker;
+  EditorPerf perf;
+  /* the open buffers, the one at curbuf is the one shown */
+  EditorBuffer *buffers;
+  int nbuffers;
+  int curbuf;
 } EditorConfig;
 
 /* global editor configuration */
 EditorConfig E;
 
+/* latencies of one benchmarked operation, in ns */
+typedef struct
+{
+  const char *name;
+  long long *ns;
+  int n;
+  int cap;
+  /* bytes handled, for operations measured in MB/s */
+  long long bytes;
+} BenchStat;
+
 /*** FILETYPES ***/
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
 char *C_HL_keywords[] = {
@@ -133,7 +939,8 @@ EditorSyntax HLDB[] = {
      C_HL_extensions,
      C_HL_keywords,
      "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     NULL},
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
@@ -141,7 +948,40 @@ EditorSyntax HLDB[] = {
 /*** PROTOTYPES ***/
 void editor_set_status_message(const char *fmt, ...);
 void editor_refresh_screen();
-char *editor_prompt(char *prompt, void (*callback)(char *, int));
+void editor_invalidate_screen();
+void editor_wait_input();
+void editor_hl_worker_release();
+void editor_hl_worker_acquire();
+EditorRow *editor_span_take(EditorRow *span, int off);
+char *editor_span_chars(EditorRow *span);
+EditorRow *editor_pack_take(EditorRow *span, int off);
+void editor_pack_forget(EditorRow *span);
+void editor_pack_reclaim(int lo, int hi, int end);
+EditorSegments *editor_row_segments(EditorRow *row);
+int editor_segments_row_state(EditorRow *row, EditorSegments *t,
+                              int in_comment);
+void editor_row_drop_render(EditorRow *row);
+void editor_row_cache_touch(EditorRow *row);
+void editor_row_cache_add(EditorRow *row);
+void editor_read_paste();
+void editor_undo_record(int kind, int y, int x, const char *s, int len);
+void editor_undo_record_rows(int kind, int y, int n);
+void editor_undo_reset();
+void editor_undo_boundary();
+void editor_journal_record(int kind, int y, int x, const char *s, int len);
+void editor_journal_record_rows(int kind, int y, int n);
+void editor_journal_sync();
+void editor_journal_open(struct stat *st);
+int editor_load_step();
+void editor_load_finish();
+void editor_journal_saved(struct stat *st);
+void editor_watch_open(struct stat *st);
+void editor_watch_poll();
+void ab_append(AppendBuffer *ab, const char *s, int len);
+void ab_reset(AppendBuffer *ab);
+void ab_free(AppendBuffer *ab);
+char *editor_prompt(char *prompt, int empty, void (*callback)(char *, int));
+void init_editor();
 
 /*** TERMINAL ***/
 void die(const char *s)
@@ -152,6 +992,8 @@ void die(const char *s)
   write(STDOUT_FILENO, "\x1b[H", 3);
 
   perror(s);
+  /* a lost terminal is the usual reason, keep what the journal has */
+  editor_journal_sync();
   exit(1);
 }
 
@@ -160,6 +1002,8 @@ void die(const char *s)
  */
 void disable_raw_mode()
 {
+  /* turn bracketed paste off again */
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
   {
     die("tcsetattr");
@@ -203,24 +1047,176 @@ void enable_raw_mode()
   {
     die("tcsetattr");
   }
+
+  /*
+  turn on bracketed paste, the terminal then sends pasted text between
+  ESC[200~ and ESC[201~ so that it can be inserted in one go
+  */
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/**
+ * @brief Get the time from a monotonic clock in ms
+ */
+long long editor_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Get the time from a monotonic clock in ns
+ */
+long long editor_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 /**
- * @brief low-level keypress reading
+ * @brief Get the time left before the next frame may be drawn
  *
- * @return char character read from the keypress
+ * @return ms to wait, 0 if a frame can be drawn now
  */
-int editor_read_key()
+int editor_frame_wait()
 {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+  long long left = E.last_frame + ED9T_FRAME_MS - editor_now_ms();
+  return left > 0 ? left : 0;
+}
+
+/**
+ * @brief Move the keys of a headless run from E.feed into E.inbuf
+ *
+ * Once the feed is used up this only sleeps out the timeout, so background
+ * work still gets its time. Waiting for a key that will never come ends the
+ * run, as it means a script stopped inside a prompt or an escape sequence.
+ *
+ * @param timeout ms to wait when the feed is empty, -1 to wait for a key
+ * @return number of bytes moved
+ */
+int editor_fill_feed(int timeout)
+{
+  int n = E.feedlen - E.feedpos;
+  if (n > ED9T_INPUT_BUF - E.inlen)
+  {
+    n = ED9T_INPUT_BUF - E.inlen;
+  }
+  if (n > 0)
+  {
+    memcpy(E.inbuf + E.inlen, E.feed + E.feedpos, n);
+    E.feedpos += n;
+    E.inlen += n;
+    return n;
+  }
+  if (timeout == -1)
+  {
+    fprintf(stderr, "ed9t: headless input ran out\n");
+    exit(1);
+  }
+  editor_hl_worker_release();
+  poll(NULL, 0, timeout);
+  editor_hl_worker_acquire();
+  return 0;
+}
+
+/**
+ * @brief Wait for input with poll and read all of it that is pending into
+ * E.inbuf
+ *
+ * @param timeout ms to wait for input, -1 to wait until it arrives
+ * @return number of bytes read
+ */
+int editor_fill_input(int timeout)
+{
+  if (E.inpos == E.inlen)
+  {
+    E.inpos = 0;
+    E.inlen = 0;
+  }
+  else if (E.inlen == ED9T_INPUT_BUF)
+  {
+    memmove(E.inbuf, E.inbuf + E.inpos, E.inlen - E.inpos);
+    E.inlen -= E.inpos;
+    E.inpos = 0;
+  }
+
+  if (E.headless)
+  {
+    return editor_fill_feed(timeout);
+  }
+
+  struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {E.watchfd, POLLIN, 0}};
+  editor_hl_worker_release();
+  int ready = poll(pfd, E.watchfd == -1 ? 1 : 2, timeout);
+  editor_hl_worker_acquire();
+  if (ready == -1)
   {
-    if (nread == -1 && errno != EAGAIN)
+    if (errno == EINTR)
     {
-      die("read");
+      return 0;
     }
+    die("poll");
+  }
+  if (pfd[1].revents)
+  {
+    /* a watched file changed, editor_watch_check reads it again */
+    editor_watch_poll();
+  }
+  if (ready == 0 || pfd[0].revents == 0)
+  {
+    return 0;
+  }
+  ssize_t n = read(STDIN_FILENO, E.inbuf + E.inlen, ED9T_INPUT_BUF - E.inlen);
+  if (n == -1 && errno != EAGAIN && errno != EINTR)
+  {
+    die("read");
+  }
+  if (n == 0 && (pfd[0].revents & POLLHUP))
+  {
+    /* the terminal is gone */
+    die("read");
+  }
+  if (n <= 0)
+  {
+    return 0;
+  }
+  E.inlen += n;
+  return n;
+}
+
+/**
+ * @brief Check if there is input to decode, waiting up to timeout ms
+ */
+int editor_input_pending(int timeout)
+{
+  return E.inpos < E.inlen || editor_fill_input(timeout) > 0;
+}
+
+/**
+ * @brief Get the next byte of an escape sequence
+ *
+ * @return 1 if a byte arrived within ED9T_ESC_TIMEOUT_MS, 0 otherwise
+ */
+int editor_read_seq_byte(char *c)
+{
+  if (!editor_input_pending(ED9T_ESC_TIMEOUT_MS))
+  {
+    return 0;
   }
+  *c = E.inbuf[E.inpos++];
+  return 1;
+}
+
+/**
+ * @brief Decode the next key from the input buffer, waiting for input if it
+ * is empty
+ */
+int editor_read_key()
+{
+  editor_wait_input();
+  char c = E.inbuf[E.inpos++];
 
   /*
   read the arrow keys in the form of '\x1b[ABCD]'
@@ -235,11 +1231,11 @@ int editor_read_key()
   if (c == '\x1b')
   {
     char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
+    if (!editor_read_seq_byte(&seq[0]))
     {
       return '\x1b';
     }
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
+    if (!editor_read_seq_byte(&seq[1]))
     {
       return '\x1b';
     }
@@ -247,28 +1243,41 @@ int editor_read_key()
     {
       if (seq[1] >= '0' && seq[1] <= '9')
       {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
+        /* a number terminated by ~, such as 3 for <esc>[3~ */
+        int num = seq[1] - '0';
+        while (1)
         {
-          return '\x1b';
+          if (!editor_read_seq_byte(&seq[2]))
+          {
+            return '\x1b';
+          }
+          if (seq[2] < '0' || seq[2] > '9' || num > 1000)
+          {
+            break;
+          }
+          num = num * 10 + (seq[2] - '0');
         }
         if (seq[2] == '~')
         {
-          switch (seq[1])
+          switch (num)
           {
-          case '1':
+          case 1:
             return HOME_KEY;
-          case '3':
+          case 3:
             return DEL_KEY;
-          case '4':
+          case 4:
             return END_KEY;
-          case '5':
+          case 5:
             return PAGE_UP;
-          case '6':
+          case 6:
             return PAGE_DOWN;
-          case '7':
+          case 7:
             return HOME_KEY;
-          case '8':
+          case 8:
             return END_KEY;
+          case 200:
+            editor_read_paste();
+            return PASTE_KEY;
           }
         }
       }
@@ -399,1112 +1408,10162 @@ int get_window_size(int *rows, int *cols)
   }
 }
 
-/*** SYNTAX HIGHLIGHTING ***/
+/*** PERF ***/
 
-int is_separator(int c)
+/*
+the hot paths add their time and work to E.perf.total as they run. at the
+end of every frame the totals are compared with those at the end of the
+frame before, which gives the numbers of the last frame that Ctrl-P shows
+in the status bar and --perf-trace writes out. building with ED9T_PERF 0
+leaves every timer a no-op.
+*/
+
+const char *perf_names[PERF_TIMERS] = {"refresh", "syntax", "update_row",
+                                       "find",    "open",   "save",
+                                       "journal", "keys",   "pack"};
+
+/**
+ * @brief Start a perf timer
+ *
+ * @return long long the start time to pass to perf_stop
+ */
+long long perf_start()
 {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  return ED9T_PERF ? editor_now_ns() : 0;
 }
 
-void editor_update_syntax(EditorRow *row)
+/**
+ * @brief Add a call that took ns and did units of work to a perf counter
+ */
+void perf_add(int timer, long long ns, long long units)
 {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if (E.syntax == NULL)
+  if (!ED9T_PERF)
   {
     return;
   }
+  EditorPerfCounter *c = &E.perf.total[timer];
+  c->calls++;
+  c->ns += ns;
+  c->units += units;
+}
 
-  char **keywords = E.syntax->keywords;
-
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
-
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+/**
+ * @brief Stop a perf timer started with perf_start
+ */
+void perf_stop(int timer, long long start, long long units)
+{
+  if (ED9T_PERF)
+  {
+    perf_add(timer, editor_now_ns() - start, units);
+  }
+}
 
-  int i = 0;
-  while (i < row->rsize)
+/**
+ * @brief Add work to a perf counter without timing it
+ */
+void perf_count(int timer, long long units)
+{
+  if (ED9T_PERF)
   {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    E.perf.total[timer].units += units;
+  }
+}
 
-    if (scs_len && !in_string && !in_comment)
-    {
-      if (!strncmp(&row->render[i], scs, scs_len))
-      {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
-
-    if (mcs_len && mce_len && !in_string)
-    {
-      if (in_comment)
-      {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len))
-        {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        }
-        else
-        {
-          i++;
-          continue;
-        }
-      }
-      else if (!strncmp(&row->render[i], mcs, mcs_len))
-      {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
-    }
-
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
-    {
-      if (in_string)
-      {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize)
-        {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string)
-        {
-          in_string = 0;
-        }
-        i++;
-        prev_sep = 1;
-        continue;
-      }
-      else
-      {
-        if (c == '"' || c == '\'')
-        {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
-    }
-
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
-    {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER))
-      {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
-    }
-
-    if (prev_sep)
+/**
+ * @brief Write one line of the trace per counter that moved
+ *
+ * @param scope "frame" or "total"
+ * @param c the counters
+ */
+void perf_trace_rows(const char *scope, EditorPerfCounter *c)
+{
+  double t = (editor_now_ns() - E.perf.start) / 1e6;
+  int i;
+  for (i = 0; i < PERF_TIMERS; i++)
+  {
+    if (c[i].calls || c[i].units)
     {
-      int j;
-      for (j = 0; keywords[j]; j++)
-      {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-        {
-          klen--;
-        }
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen]))
-        {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL)
-      {
-        prev_sep = 0;
-        continue;
-      }
+      fprintf(E.perf.trace, "%.3f,%s,%s,%lld,%.1f,%lld\n", t, scope,
+              perf_names[i], c[i].calls, c[i].ns / 1e3, c[i].units);
     }
-
-    prev_sep = is_separator(c);
-    i++;
   }
+}
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
+/**
+ * @brief Take the counters of the frame that just ended
+ */
+void perf_frame()
+{
+  if (!ED9T_PERF)
+  {
+    return;
+  }
+  int i;
+  for (i = 0; i < PERF_TIMERS; i++)
   {
-    editor_update_syntax(&E.row[row->idx + 1]);
+    EditorPerfCounter *t = &E.perf.total[i];
+    EditorPerfCounter *m = &E.perf.mark[i];
+    EditorPerfCounter *f = &E.perf.frame[i];
+    f->calls = t->calls - m->calls;
+    f->ns = t->ns - m->ns;
+    f->units = t->units - m->units;
+    *m = *t;
+  }
+  if (E.perf.trace)
+  {
+    perf_trace_rows("frame", E.perf.frame);
   }
 }
 
-int editor_syntax_to_color(int hl)
+/**
+ * @brief Write the totals to the trace and close it, run at exit
+ */
+void perf_trace_close()
 {
-  switch (hl)
+  if (E.perf.trace)
   {
-  case HL_COMMENT:
-  case HL_MLCOMMENT:
-    return 36;
-  case HL_KEYWORD1:
-    return 33;
-  case HL_KEYWORD2:
-    return 32;
-  case HL_STRING:
-    return 35;
-  case HL_NUMBER:
-    return 31;
-  case HL_MATCH:
-    return 34;
-  default:
-    return 37;
+    perf_trace_rows("total", E.perf.total);
+    fclose(E.perf.trace);
+    E.perf.trace = NULL;
   }
 }
 
-void editor_select_syntax_highlight()
+/**
+ * @brief Start a CSV trace of the perf counters, a line per counter that
+ * moved in each frame and the totals when the editor exits
+ *
+ * @param path the file to write
+ */
+void perf_trace_open(const char *path)
 {
-  E.syntax = NULL;
-  if (E.filename == NULL)
+  E.perf.trace = fopen(path, "w");
+  if (E.perf.trace == NULL)
   {
-    return;
+    die("fopen");
   }
-  char *ext = strrchr(E.filename, '.');
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
-  {
-    EditorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i])
-    {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i])))
-      {
-        E.syntax = s;
-
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++)
-        {
-          editor_update_syntax(&E.row[filerow]);
-        }
+  fprintf(E.perf.trace, "ms,scope,counter,calls,us,units\n");
+  atexit(perf_trace_close);
+}
 
-        return;
-      }
-      i++;
-    }
-  }
+/**
+ * @brief Format the counters of the last frame, and the open and save
+ * throughput so far, for the status bar
+ *
+ * @param buf the buffer to format into
+ * @param size size of the buffer
+ * @return int length of the text
+ */
+int perf_hud(char *buf, int size)
+{
+  EditorPerfCounter *f = E.perf.frame;
+  EditorPerfCounter *t = E.perf.total;
+  double open = t[PERF_OPEN].ns ? t[PERF_OPEN].units * 1e3 / t[PERF_OPEN].ns : 0;
+  double save = t[PERF_SAVE].ns ? t[PERF_SAVE].units * 1e3 / t[PERF_SAVE].ns : 0;
+  int len = snprintf(
+      buf, size,
+      "frame %.2fms %lldB | keys %lld | hl %lld rows %.2fms | upd %lld "
+      "%.2fms | find %lld rows | open %.0f save %.0f MB/s",
+      f[PERF_REFRESH].ns / 1e6, f[PERF_REFRESH].units, f[PERF_KEYS].units,
+      f[PERF_SYNTAX].units, f[PERF_SYNTAX].ns / 1e6, f[PERF_UPDATE_ROW].calls,
+      f[PERF_UPDATE_ROW].ns / 1e6, f[PERF_FIND].units, open, save);
+  return len < size ? len : size - 1;
 }
 
-/*** ROW OPERATIONS ***/
+/*** ROW STORAGE ***/
 
-int editor_row_cx_to_rx(EditorRow *row, int cx)
+/*
+the chars, render and hl of rows come from size classed slabs, blocks of
+16 << class bytes carved out of ED9T_SLAB_CHUNK sized chunks. Freed blocks
+go back on the free list of their class and are reused by the next row that
+needs one, so editing and redrawing rows doesn't go through malloc. Blocks
+too large for a class get a chunk of their own, which is freed with them.
+The chunks of the classes are kept for as long as the editor runs, the
+blocks of every buffer share them.
+*/
+
+/**
+ * @brief Get the size class for a block of at least size bytes
+ *
+ * @return the class, or -1 if size is larger than the largest class
+ */
+int slab_class(int size)
 {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++)
+  int class = 0;
+  while ((ED9T_SLAB_MIN << class) < size)
   {
-    if (row->chars[j] == '\t')
+    class++;
+    if (class == ED9T_SLAB_CLASSES)
     {
-      rx += (ED9T_TAB_STOP - 1) - (rx % ED9T_TAB_STOP);
+      return -1;
     }
-    rx++;
   }
-  return rx;
+  return class;
 }
 
-int editor_row_rx_to_cx(EditorRow *row, int rx)
+/**
+ * @brief Allocate a chunk
+ */
+void *slab_new_chunk(size_t size)
 {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++)
+  void *chunk = malloc(size);
+  if (chunk == NULL)
   {
-    if (row->chars[cx] == '\t')
-    {
-      cur_rx += (ED9T_TAB_STOP - 1) - (cur_rx % ED9T_TAB_STOP);
-    }
-    cur_rx++;
-    if (cur_rx > rx)
-    {
-      return cx;
-    }
+    die("malloc");
   }
-  return cx;
+  return chunk;
 }
 
-void editor_update_row(EditorRow *row)
+/**
+ * @brief Allocate a block of at least size bytes
+ *
+ * @param size bytes needed
+ * @param cap set to the size of the block, which slab_free needs back
+ * @return the block
+ */
+void *slab_alloc(int size, int *cap)
 {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
+  int class = slab_class(size);
+  if (class == -1)
   {
-    if (row->chars[j] == '\t')
-      tabs++;
+    /* leave room to grow, as for the classes */
+    *cap = size + size / 2;
+    return slab_new_chunk(*cap);
   }
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (ED9T_TAB_STOP - 1) + 1);
-
-  int idx = 0;
-  for (j = 0; j < row->size; j++)
+  int bsize = ED9T_SLAB_MIN << class;
+  if (E.slab_free[class] == NULL)
   {
-    if (row->chars[j] == '\t')
-    {
-      row->render[idx++] = ' ';
-      while (idx % ED9T_TAB_STOP != 0)
-      {
-        row->render[idx++] = ' ';
-      }
-    }
-    else
+    char *p = slab_new_chunk(ED9T_SLAB_CHUNK);
+    int i;
+    for (i = ED9T_SLAB_CHUNK / bsize - 1; i >= 0; i--)
     {
-      row->render[idx++] = row->chars[j];
+      SlabBlock *b = (SlabBlock *)(p + i * bsize);
+      b->next = E.slab_free[class];
+      E.slab_free[class] = b;
     }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-
-  editor_update_syntax(row);
+  SlabBlock *b = E.slab_free[class];
+  E.slab_free[class] = b->next;
+  *cap = bsize;
+  return b;
 }
 
-void editor_insert_row(int at, char *s, size_t len)
+/**
+ * @brief Give a block back
+ *
+ * @param p the block, may be NULL
+ * @param cap the size slab_alloc returned for the block
+ */
+void slab_free(void *p, int cap)
 {
-  if (at < 0 || at > E.numrows)
+  if (p == NULL)
+  {
+    return;
+  }
+  int class = slab_class(cap);
+  if (class == -1)
   {
+    free(p);
     return;
   }
+  SlabBlock *b = p;
+  b->next = E.slab_free[class];
+  E.slab_free[class] = b;
+}
 
-  E.row = realloc(E.row, sizeof(EditorRow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(EditorRow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++)
+/**
+ * @brief Make sure a block holds at least size bytes, moving it to a larger
+ * block if it doesn't
+ *
+ * @param p the block, may be NULL
+ * @param cap size of the block, updated when it moves
+ * @param used bytes at the start of the block to keep
+ * @param size bytes needed
+ * @return the block
+ */
+void *slab_grow(void *p, int *cap, int used, int size)
+{
+  if (p && size <= *cap)
+  {
+    return p;
+  }
+  int newcap;
+  void *q = slab_alloc(size, &newcap);
+  if (p)
   {
-    E.row[j].idx++;
+    memcpy(q, p, used);
+    slab_free(p, *cap);
   }
+  *cap = newcap;
+  return q;
+}
 
-  E.row[at].idx = at;
+/*** ROW TREE ***/
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+/*
+The rows of the file are stored in an implicit treap: a binary tree ordered
+by row position where every node also carries a random priority and the
+count of rows in its subtree. Looking a row up by its line number, inserting
+and deleting rows are all O(log n) expected, and the line number of a row is
+computed on demand by walking up to the root.
+*/
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editor_update_row(&E.row[at]);
+unsigned int row_tree_seed = 2463534242u;
 
-  E.numrows++;
-  E.dirty++;
+/*
+bulk built trees get priorities from their depth so that they form a valid
+heap without sorting, the low bits are kept random to keep later inserts
+balanced
+*/
+#define ROW_TREE_DEPTH_SHIFT 26
+#define ROW_TREE_MAX_DEPTH 40
+
+/**
+ * @brief Generate the priority of a new row tree node (xorshift32)
+ *
+ * @return unsigned int random priority
+ */
+unsigned int row_tree_random()
+{
+  row_tree_seed ^= row_tree_seed << 13;
+  row_tree_seed ^= row_tree_seed >> 17;
+  row_tree_seed ^= row_tree_seed << 5;
+  return row_tree_seed;
 }
 
-void editor_row_insert_char(EditorRow *row, int at, int c)
+int row_tree_count(EditorRow *t)
 {
-  if (at < 0 || at > row->size)
-  {
-    at = row->size;
-  }
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editor_update_row(row);
-  E.dirty++;
+  return t ? t->count : 0;
 }
 
-void editor_row_del_char(EditorRow *row, int at)
+/**
+ * @brief Recompute the subtree count of a node and fix up the parent
+ * links of its children after they have been changed
+ *
+ * @param t the node to update
+ */
+void row_tree_pull(EditorRow *t)
 {
-  if (at < 0 || at >= row->size)
+  t->count = t->lines + row_tree_count(t->left) + row_tree_count(t->right);
+  if (t->left)
   {
-    return;
+    t->left->parent = t;
+  }
+  if (t->right)
+  {
+    t->right->parent = t;
   }
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editor_update_row(row);
-  E.dirty++;
 }
 
-void editor_free_row(EditorRow *row)
+/**
+ * @brief Recompute the counts from a node up to the root, after the
+ * number of lines of the node changed
+ */
+void row_tree_update(EditorRow *t)
 {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  for (; t; t = t->parent)
+  {
+    row_tree_pull(t);
+  }
 }
 
-void editor_del_row(int at)
+/**
+ * @brief Join two trees, all rows of a are placed before all rows of b
+ *
+ * @param a tree holding the leading rows
+ * @param b tree holding the trailing rows
+ * @return EditorRow* root of the joined tree
+ */
+EditorRow *row_tree_merge(EditorRow *a, EditorRow *b)
 {
-  if (at < 0 || at >= E.numrows)
+  if (a == NULL)
   {
-    return;
+    return b;
   }
-  editor_free_row(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(EditorRow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++)
+  if (b == NULL)
   {
-    E.row[j].idx--;
+    return a;
+  }
+  if (a->prio > b->prio)
+  {
+    a->right = row_tree_merge(a->right, b);
+    row_tree_pull(a);
+    return a;
+  }
+  else
+  {
+    b->left = row_tree_merge(a, b->left);
+    row_tree_pull(b);
+    return b;
   }
-  E.numrows--;
-  E.dirty++;
 }
 
-void editor_row_append_string(EditorRow *row, char *s, size_t len)
+/**
+ * @brief Split a tree so that the first k rows go into *a and the
+ * remaining rows go into *b
+ *
+ * Line k must start a node, it can't be inside a span. Callers look line k
+ * up with editor_row_at first, which loads it out of its span.
+ *
+ * @param t tree to split
+ * @param k number of rows to put in the first tree
+ * @param a out: tree of the first k rows
+ * @param b out: tree of the remaining rows
+ */
+void row_tree_split(EditorRow *t, int k, EditorRow **a, EditorRow **b)
 {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editor_update_row(row);
-  E.dirty++;
+  if (t == NULL)
+  {
+    *a = NULL;
+    *b = NULL;
+    return;
+  }
+  int lcount = row_tree_count(t->left);
+  if (k <= lcount)
+  {
+    row_tree_split(t->left, k, a, &t->left);
+    row_tree_pull(t);
+    *b = t;
+  }
+  else
+  {
+    row_tree_split(t->right, k - lcount - t->lines, &t->right, b);
+    row_tree_pull(t);
+    *a = t;
+  }
+  if (*a)
+  {
+    (*a)->parent = NULL;
+  }
+  if (*b)
+  {
+    (*b)->parent = NULL;
+  }
 }
 
-/*** EDITOR OPERATIONS ***/
-
-void editor_insert_char(int c)
+/**
+ * @brief Get an unlinked row node, reusing a released node if possible
+ *
+ * @return EditorRow* the node
+ */
+EditorRow *row_tree_alloc()
 {
-  if (E.cy == E.numrows)
+  EditorRow *row = E.freerows;
+  if (row)
   {
-    editor_insert_row(E.numrows, "", 0);
+    E.freerows = row->right;
+    return row;
   }
-  editor_row_insert_char(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  row = malloc(sizeof(EditorRow));
+  if (row == NULL)
+  {
+    die("malloc");
+  }
+  return row;
 }
 
-void editor_insert_newline()
+/**
+ * @brief Release a row node that has been unlinked from the tree
+ *
+ * @param row the node
+ */
+void row_tree_free(EditorRow *row)
 {
-  if (E.cx == 0)
+  row->right = E.freerows;
+  E.freerows = row;
+}
+
+/**
+ * @brief Build a balanced tree out of an array of row nodes in O(n)
+ *
+ * @param rows the nodes, in file order
+ * @param n number of nodes
+ * @param depth depth of the subtree root, 0 for the whole tree
+ * @return EditorRow* root of the tree
+ */
+EditorRow *row_tree_build(EditorRow *rows, int n, int depth)
+{
+  if (n <= 0)
   {
-    editor_insert_row(E.cy, "", 0);
+    return NULL;
   }
-  else
+  int mid = n / 2;
+  EditorRow *t = &rows[mid];
+  t->prio = ((unsigned int)(ROW_TREE_MAX_DEPTH - depth) << ROW_TREE_DEPTH_SHIFT) |
+            (row_tree_random() & ((1u << ROW_TREE_DEPTH_SHIFT) - 1));
+  t->parent = NULL;
+  t->left = row_tree_build(rows, mid, depth + 1);
+  t->right = row_tree_build(&rows[mid + 1], n - mid - 1, depth + 1);
+  row_tree_pull(t);
+  return t;
+}
+
+/**
+ * @brief Link a row node into the row tree at the given position
+ *
+ * @param at position of the new row
+ * @param row the row node with its lines set, its links are initialized here
+ */
+void row_tree_insert(int at, EditorRow *row)
+{
+  EditorRow *a, *b;
+  row->left = row->right = row->parent = NULL;
+  row->count = row->lines;
+  row->prio = row_tree_random();
+  row_tree_split(E.rowroot, at, &a, &b);
+  E.rowroot = row_tree_merge(row_tree_merge(a, row), b);
+  E.rowroot->parent = NULL;
+}
+
+/**
+ * @brief Unlink the row at the given position from the row tree
+ *
+ * @param at position of the row to remove
+ * @return EditorRow* the unlinked row node
+ */
+EditorRow *row_tree_remove(int at)
+{
+  EditorRow *a, *mid, *b;
+  row_tree_split(E.rowroot, at, &a, &b);
+  row_tree_split(b, 1, &mid, &b);
+  E.rowroot = row_tree_merge(a, b);
+  if (E.rowroot)
   {
-    EditorRow *row = &E.row[E.cy];
-    editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
+    E.rowroot->parent = NULL;
   }
-  E.cy++;
-  E.cx = 0;
+  return mid;
 }
 
-void editor_del_char()
+/**
+ * @brief Find the node holding the given line, without loading it out of
+ * its span
+ *
+ * @param at line number
+ * @param off set to the position of the line within the node
+ * @return EditorRow* the node, or NULL if at is out of range
+ */
+EditorRow *row_tree_find(int at, int *off)
 {
-  if (E.cy == E.numrows)
+  EditorRow *t = E.rowroot;
+  if (at < 0 || at >= row_tree_count(t))
   {
-    return;
+    return NULL;
   }
-  if (E.cx == 0 && E.cy == 0)
+  while (t)
   {
-    return;
+    int lcount = row_tree_count(t->left);
+    if (at < lcount)
+    {
+      t = t->left;
+    }
+    else if (at < lcount + t->lines)
+    {
+      *off = at - lcount;
+      return t;
+    }
+    else
+    {
+      at -= lcount + t->lines;
+      t = t->right;
+    }
   }
+  return NULL;
+}
 
-  EditorRow *row = &E.row[E.cy];
-
-  if (E.cx > 0)
+/**
+ * @brief Get the node following the given node in file order
+ */
+EditorRow *row_tree_next(EditorRow *row)
+{
+  if (row->right)
   {
-    editor_row_del_char(row, E.cx - 1);
-    E.cx--;
+    row = row->right;
+    while (row->left)
+    {
+      row = row->left;
+    }
+    return row;
   }
-  else
+  while (row->parent && row == row->parent->right)
   {
-    E.cx = E.row[E.cy - 1].size;
-    editor_row_append_string(&E.row[E.cy - 1], row->chars, row->size);
-    editor_del_row(E.cy);
-    E.cy--;
+    row = row->parent;
   }
+  return row->parent;
 }
 
-/*** FILE I/O ***/
-
-char *editor_rows_to_string(int *buflen)
+/**
+ * @brief Get the node preceding the given node in file order
+ */
+EditorRow *row_tree_prev(EditorRow *row)
 {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
+  if (row->left)
   {
-    totlen += E.row[j].size + 1;
+    row = row->left;
+    while (row->right)
+    {
+      row = row->right;
+    }
+    return row;
   }
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++)
+  while (row->parent && row == row->parent->left)
   {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+    row = row->parent;
   }
-  return buf;
+  return row->parent;
 }
 
 /**
- * @brief Open a file in the editor
- *
- * @param filename name of the file to open
+ * @brief Get the root of the tree holding a node, which is E.rowroot for
+ * the rows of the current buffer
  */
-void editor_open(char *filename)
+EditorRow *row_tree_root(EditorRow *row)
 {
-  free(E.filename);
-  E.filename = strdup(filename);
+  while (row->parent)
+  {
+    row = row->parent;
+  }
+  return row;
+}
 
-  editor_select_syntax_highlight();
+/**
+ * @brief Get the first node of the tree
+ */
+EditorRow *row_tree_first()
+{
+  EditorRow *t = E.rowroot;
+  while (t && t->left)
+  {
+    t = t->left;
+  }
+  return t;
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
+/**
+ * @brief Get the row at the given line number
+ *
+ * A line that is still part of a span is loaded as a row first.
+ *
+ * @param at line number of the row
+ * @return EditorRow* the row, or NULL if at is out of range
+ */
+EditorRow *editor_row_at(int at)
+{
+  int off;
+  EditorRow *t = row_tree_find(at, &off);
+  if (t && (t->flags & ROW_SPAN))
   {
-    die("fopen");
+    t = editor_span_take(t, off);
   }
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  return t;
+}
+
+/**
+ * @brief Compute the line number of a row
+ *
+ * @param row the row
+ * @return int line number of the row
+ */
+int editor_row_index(EditorRow *row)
+{
+  int idx = row_tree_count(row->left);
+  while (row->parent)
   {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
+    if (row == row->parent->right)
     {
-      linelen--;
+      idx += row_tree_count(row->parent->left) + row->parent->lines;
     }
-    editor_insert_row(E.numrows, line, linelen);
+    row = row->parent;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  return idx;
 }
 
-void editor_save()
+/**
+ * @brief Get the row following the given row
+ *
+ * @param row the row
+ * @return EditorRow* the next row, or NULL for the last row
+ */
+EditorRow *editor_row_next(EditorRow *row)
 {
-  if (E.filename == NULL)
+  row = row_tree_next(row);
+  if (row && (row->flags & ROW_SPAN))
   {
-    E.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL)
-    {
-      editor_set_status_message("Save aborted");
-      return;
-    }
-    editor_select_syntax_highlight();
+    row = editor_span_take(row, 0);
   }
-  int len;
-  char *buf = editor_rows_to_string(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1)
+  return row;
+}
+
+/**
+ * @brief Get the row preceding the given row
+ *
+ * @param row the row
+ * @return EditorRow* the previous row, or NULL for the first row
+ */
+EditorRow *editor_row_prev(EditorRow *row)
+{
+  row = row_tree_prev(row);
+  if (row && (row->flags & ROW_SPAN))
   {
-    if (ftruncate(fd, len) != -1)
-    {
-      if (write(fd, buf, len) == len)
-      {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editor_set_status_message("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+    row = editor_span_take(row, row->lines - 1);
   }
-  free(buf);
-  editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+  return row;
 }
 
-/*** FIND ***/
+/*** SYNTAX HIGHLIGHTING ***/
 
-void editor_find_callback(char *query, int key)
+/* whitespace, NUL and the punctuation that ends a word */
+const unsigned char separator_table[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1,
+    ['\r'] = 1, [','] = 1, ['.'] = 1, ['('] = 1, [')'] = 1, ['+'] = 1,
+    ['-'] = 1, ['/'] = 1, ['*'] = 1, ['='] = 1, ['~'] = 1, ['%'] = 1,
+    ['<'] = 1, ['>'] = 1, ['['] = 1, [']'] = 1, [';'] = 1};
+
+int is_separator(int c)
 {
-  static int last_match = -1;
-  static int direction = 1;
+  return separator_table[(unsigned char)c];
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl)
+unsigned int editor_keyword_hash(const char *s, int len)
+{
+  /* FNV-1a */
+  unsigned int h = 2166136261u;
+  for (int j = 0; j < len; j++)
   {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+    h = (h ^ (unsigned char)s[j]) * 16777619u;
   }
+  return h;
+}
 
-  if (key == '\r' || key == '\x1b')
+/**
+ * @brief Build the lookup tables for a syntax entry
+ *
+ * This happens once per HLDB entry, the first time a file of that type is
+ * opened, so the highlighter never has to strlen or walk the keyword list.
+ *
+ * @param syntax the syntax entry
+ * @return EditorSyntaxCompiled* the tables, also stored in syntax->compiled
+ */
+EditorSyntaxCompiled *editor_syntax_compile(EditorSyntax *syntax)
+{
+  if (syntax->compiled)
   {
-    last_match = -1;
-    direction = 1;
-    return;
+    return syntax->compiled;
+  }
+
+  EditorSyntaxCompiled *cs = calloc(1, sizeof(EditorSyntaxCompiled));
+  if (cs == NULL)
+  {
+    die("calloc");
   }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+  cs->scs_len = syntax->singleline_comment_start ? strlen(syntax->singleline_comment_start) : 0;
+  cs->mcs_len = syntax->multiline_comment_start ? strlen(syntax->multiline_comment_start) : 0;
+  cs->mce_len = syntax->multiline_comment_end ? strlen(syntax->multiline_comment_end) : 0;
+
+  int numbers = syntax->flags & HL_HIGHLIGHT_NUMBERS;
+  int strings = syntax->flags & HL_HIGHLIGHT_STRINGS;
+  int c;
+  for (c = 0; c < 256; c++)
   {
-    direction = 1;
+    int cls = is_separator(c) ? LEX_SEP : LEX_WORD;
+    if (numbers && c >= '0' && c <= '9')
+    {
+      cls = LEX_DIGIT;
+    }
+    else if (numbers && c == '.')
+    {
+      cls = LEX_DOT;
+    }
+    else if (strings && (c == '"' || c == '\''))
+    {
+      cls = LEX_QUOTE;
+    }
+    else if (c == '\\')
+    {
+      cls = LEX_ESCAPE;
+    }
+    cs->lex_class[c] = cls;
   }
-  else if (key == ARROW_LEFT || key == ARROW_UP)
+  if (cs->scs_len)
   {
-    direction = -1;
+    cs->lex_flags[(unsigned char)syntax->singleline_comment_start[0]] |= LEX_SCS_FIRST;
   }
-  else
+  if (cs->mcs_len && cs->mce_len)
   {
-    last_match = -1;
-    direction = 1;
+    cs->lex_flags[(unsigned char)syntax->multiline_comment_start[0]] |= LEX_MCS_FIRST;
   }
 
-  if (last_match == -1)
+  int n = 0;
+  while (syntax->keywords[n])
+  {
+    n++;
+  }
+  /* keep the table at most half full */
+  unsigned int slots = 8;
+  while (slots < 2u * n)
+  {
+    slots *= 2;
+  }
+  cs->kw_mask = slots - 1;
+  cs->kw_words = calloc(slots, sizeof(char *));
+  cs->kw_lens = calloc(slots, 1);
+  cs->kw_types = calloc(slots, 1);
+  if (!cs->kw_words || !cs->kw_lens || !cs->kw_types)
   {
-    direction = 1;
+    die("calloc");
   }
-  int current = last_match;
 
-  int i;
-  for (i = 0; i < E.numrows; i++)
+  for (int j = 0; j < n; j++)
   {
-    current += direction;
-    if (current == -1)
+    const char *word = syntax->keywords[j];
+    int klen = strlen(word);
+    int type = HL_KEYWORD1;
+    if (klen > 0 && word[klen - 1] == '|')
     {
-      current = E.numrows - 1;
+      klen--;
+      type = HL_KEYWORD2;
     }
-    else if (current == E.numrows)
+    if (klen == 0 || klen > 255)
     {
-      current = 0;
+      continue;
     }
-    EditorRow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match)
-    {
-      last_match = current;
-      E.cy = current;
-      E.cx = editor_row_rx_to_cx(row, match - row->render);
-      E.rowoff = E.numrows;
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+    unsigned int slot = editor_keyword_hash(word, klen) & cs->kw_mask;
+    while (cs->kw_words[slot] &&
+           !(cs->kw_lens[slot] == klen && !memcmp(cs->kw_words[slot], word, klen)))
+    {
+      slot = (slot + 1) & cs->kw_mask;
+    }
+    if (cs->kw_words[slot])
+    {
+      /* duplicate, the first entry wins */
+      continue;
+    }
+    cs->kw_words[slot] = word;
+    cs->kw_lens[slot] = klen;
+    cs->kw_types[slot] = type;
+    cs->kw_first[(unsigned char)word[0]] = 1;
+    cs->lex_flags[(unsigned char)word[0]] |= LEX_KW_FIRST;
+    if (klen > cs->kw_maxlen)
+    {
+      cs->kw_maxlen = klen;
     }
   }
+
+  syntax->compiled = cs;
+  return cs;
 }
 
-void editor_find()
+/**
+ * @brief Look up a whole word in the keyword table
+ *
+ * @param cs the compiled syntax
+ * @param s start of the word
+ * @param len length of the word
+ * @return int HL_KEYWORD1 or HL_KEYWORD2, HL_NORMAL if it is not a keyword
+ */
+int editor_keyword_lookup(EditorSyntaxCompiled *cs, const char *s, int len)
 {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
-
-  char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
-  if (query)
-  {
-    free(query);
-  }
-  else
+  unsigned int slot = editor_keyword_hash(s, len) & cs->kw_mask;
+  while (cs->kw_words[slot])
   {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    if (cs->kw_lens[slot] == len && !memcmp(cs->kw_words[slot], s, len))
+    {
+      return cs->kw_types[slot];
+    }
+    slot = (slot + 1) & cs->kw_mask;
   }
+  return HL_NORMAL;
 }
 
-/*** APPEND BUFFER ***/
-typedef struct
+/* what the lexer does with a byte of a class, in each state */
+enum EditorLexAction
 {
-  char *b;
-  int len;
-} AppendBuffer;
+  ACT_WORD = 0,
+  ACT_SEP,
+  ACT_DIGIT,
+  ACT_DOT,
+  ACT_OPEN,
+  ACT_COMMENT,
+  ACT_STRING,
+  ACT_STRING_QUOTE,
+  ACT_STRING_ESCAPE
+};
 
-#define ABUF_INIT {NULL, 0}
+const unsigned char lex_actions[LEX_STATES][LEX_CLASSES] = {
+    [LEX_NORMAL] = {[LEX_WORD] = ACT_WORD, [LEX_SEP] = ACT_SEP,
+                    [LEX_DIGIT] = ACT_DIGIT, [LEX_DOT] = ACT_DOT,
+                    [LEX_QUOTE] = ACT_OPEN, [LEX_ESCAPE] = ACT_WORD},
+    [LEX_COMMENT] = {[LEX_WORD] = ACT_COMMENT, [LEX_SEP] = ACT_COMMENT,
+                     [LEX_DIGIT] = ACT_COMMENT, [LEX_DOT] = ACT_COMMENT,
+                     [LEX_QUOTE] = ACT_COMMENT, [LEX_ESCAPE] = ACT_COMMENT},
+    [LEX_STRING] = {[LEX_WORD] = ACT_STRING, [LEX_SEP] = ACT_STRING,
+                    [LEX_DIGIT] = ACT_STRING, [LEX_DOT] = ACT_STRING,
+                    [LEX_QUOTE] = ACT_STRING_QUOTE,
+                    [LEX_ESCAPE] = ACT_STRING_ESCAPE}};
 
 /**
- * @brief Append a string to the append buffer
+ * @brief Highlight a piece of a row, carrying the state of the highlighter
+ * from the piece before it
  *
- * @param ab pointer to the append buffer
- * @param s string to append
- * @param len length of the string
+ * Highlighting a row piece by piece gives the same result as highlighting
+ * it whole, as long as no piece ends inside a word, a comment marker or an
+ * escape, see ROW SEGMENTS.
+ *
+ * The lexer is driven by the tables of the compiled syntax: each byte's
+ * class picks what to do in the current state from lex_actions, and only
+ * bytes flagged as the start of a comment marker or a keyword are looked
+ * at more closely. Runs of word bytes, strings and comments are skipped
+ * over in tight loops.
+ *
+ * @param syntax the syntax to highlight with
+ * @param text the text to highlight
+ * @param len length of the text
+ * @param hl highlight array of at least len bytes to fill
+ * @param st state at the start of the piece, updated to the state at its end
  */
-void ab_append(AppendBuffer *ab, const char *s, int len)
+void editor_syntax_highlight_piece(EditorSyntax *syntax, const char *text,
+                                   int len, unsigned char *hl,
+                                   EditorLexState *st)
 {
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL)
+  if (st->line_comment)
   {
+    /* a single line comment runs to the end of the row */
+    memset(hl, HL_COMMENT, len);
     return;
   }
+  memset(hl, HL_NORMAL, len);
 
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
-}
+  EditorSyntaxCompiled *cs = syntax->compiled;
+  const unsigned char *cls = cs->lex_class;
+  const unsigned char *flags = cs->lex_flags;
+  const unsigned char *s = (const unsigned char *)text;
 
-/**
- * @brief Free the memory used by the append buffer
- *
- * @param ab pointer to the append buffer
- */
-void ab_free(AppendBuffer *ab)
-{
-  free(ab->b);
-}
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
 
-/*** INPUT ***/
+  int scs_len = cs->scs_len;
+  int mcs_len = cs->mcs_len;
+  int mce_len = cs->mce_len;
 
-char *editor_prompt(char *prompt, void (*callback)(char *, int))
-{
-  size_t bufsize = 128;
-  char *buf = malloc(bufsize);
-  size_t buflen = 0;
-  buf[0] = '\0';
-  while (1)
+  int state = LEX_NORMAL;
+  if (st->in_string)
   {
-    editor_set_status_message(prompt, buf);
-    editor_refresh_screen();
-    int c = editor_read_key();
-    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
-    {
-      if (buflen != 0)
-        buf[--buflen] = '\0';
-    }
-    else if (c == '\x1b')
+    state = LEX_STRING;
+  }
+  else if (st->in_comment && mcs_len && mce_len)
+  {
+    state = LEX_COMMENT;
+  }
+  int in_string = st->in_string;
+  int prev_sep = st->prev_sep;
+
+  int i = 0;
+  while (i < len)
+  {
+    unsigned char c = s[i];
+    int f = flags[c];
+
+    if (state == LEX_NORMAL && (f & (LEX_SCS_FIRST | LEX_MCS_FIRST)))
     {
-      editor_set_status_message("");
-      if (callback)
+      if ((f & LEX_SCS_FIRST) && i + scs_len <= len &&
+          !memcmp(&text[i], scs, scs_len))
       {
-        callback(buf, c);
+        memset(&hl[i], HL_COMMENT, len - i);
+        st->line_comment = 1;
+        break;
+      }
+      if ((f & LEX_MCS_FIRST) && i + mcs_len <= len &&
+          !memcmp(&text[i], mcs, mcs_len))
+      {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        state = LEX_COMMENT;
+        continue;
       }
-      free(buf);
-      return NULL;
     }
-    else if (c == '\r')
+
+    switch (lex_actions[state][cls[c]])
     {
-      if (buflen != 0)
+    case ACT_COMMENT:
+    {
+      /* up to the next byte that could start the end marker */
+      const char *p = memchr(&text[i], mce[0], len - i);
+      int end = p ? p - text : len;
+      memset(&hl[i], HL_MLCOMMENT, end - i);
+      i = end;
+      if (i < len)
       {
-        editor_set_status_message("");
-        if (callback)
+        if (i + mce_len <= len && !memcmp(&text[i], mce, mce_len))
         {
-          callback(buf, c);
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          state = LEX_NORMAL;
+          prev_sep = 1;
+        }
+        else
+        {
+          hl[i++] = HL_MLCOMMENT;
         }
-        return buf;
       }
+      break;
     }
-    else if (!iscntrl(c) && c < 128)
+
+    case ACT_STRING:
+    case ACT_STRING_QUOTE:
+    case ACT_STRING_ESCAPE:
+      while (1)
+      {
+        int act = lex_actions[LEX_STRING][cls[s[i]]];
+        hl[i] = HL_STRING;
+        if (act == ACT_STRING_ESCAPE && i + 1 < len)
+        {
+          hl[i + 1] = HL_STRING;
+          i += 2;
+        }
+        else if (act == ACT_STRING_QUOTE && s[i] == in_string)
+        {
+          in_string = 0;
+          state = LEX_NORMAL;
+          prev_sep = 1;
+          i++;
+          break;
+        }
+        else
+        {
+          /* a byte of a string counts as a separator after it */
+          prev_sep = 1;
+          i++;
+        }
+        if (i >= len)
+        {
+          break;
+        }
+      }
+      break;
+
+    case ACT_OPEN:
+      in_string = c;
+      state = LEX_STRING;
+      hl[i++] = HL_STRING;
+      break;
+
+    case ACT_DIGIT:
     {
-      if (buflen == bufsize - 1)
+      unsigned char prev_hl = (i > 0) ? hl[i - 1] : st->prev_hl;
+      if (prev_sep || prev_hl == HL_NUMBER)
       {
-        bufsize *= 2;
-        buf = realloc(buf, bufsize);
+        hl[i] = HL_NUMBER;
       }
-      buf[buflen++] = c;
-      buf[buflen] = '\0';
+      prev_sep = 0;
+      i++;
+      break;
     }
-    if (callback)
+
+    case ACT_DOT:
     {
-      callback(buf, c);
+      unsigned char prev_hl = (i > 0) ? hl[i - 1] : st->prev_hl;
+      if (prev_hl == HL_NUMBER)
+      {
+        hl[i++] = HL_NUMBER;
+        prev_sep = 0;
+        break;
+      }
+    }
+      /* FALLTHROUGH */
+    case ACT_WORD:
+    case ACT_SEP:
+      if (prev_sep && (f & LEX_KW_FIRST))
+      {
+        /* a keyword has to be the whole word up to the next separator */
+        int klen = 1;
+        while (i + klen < len && klen <= cs->kw_maxlen &&
+               !is_separator(text[i + klen]))
+        {
+          klen++;
+        }
+        int type = (klen <= cs->kw_maxlen)
+                       ? editor_keyword_lookup(cs, &text[i], klen)
+                       : HL_NORMAL;
+        if (type != HL_NORMAL)
+        {
+          memset(&hl[i], type, klen);
+          i += klen;
+          prev_sep = 0;
+          break;
+        }
+      }
+      prev_sep = is_separator(c);
+      i++;
+      if (!prev_sep)
+      {
+        /* the rest of the word, digits included, stays normal */
+        while (i < len &&
+               (cls[s[i]] == LEX_WORD || cls[s[i]] == LEX_DIGIT ||
+                cls[s[i]] == LEX_ESCAPE) &&
+               !(flags[s[i]] & (LEX_SCS_FIRST | LEX_MCS_FIRST)))
+        {
+          i++;
+        }
+      }
+      else
+      {
+        /* and so does a run of separators that start nothing */
+        while (i < len && cls[s[i]] == LEX_SEP && !flags[s[i]])
+        {
+          i++;
+        }
+      }
+      break;
     }
   }
+
+  st->in_comment = state == LEX_COMMENT || (st->in_comment && !(mcs_len && mce_len));
+  st->prev_sep = prev_sep;
+  st->in_string = in_string;
+  if (len > 0)
+  {
+    st->prev_hl = hl[len - 1];
+  }
 }
 
 /**
- * @brief Move the cursor based on which key is pressed
+ * @brief Highlight a span of text with the current syntax
  *
- * @param
+ * This is run over the render of a row to build its hl array, or over the
+ * raw chars of a row (into scratch space) when only the multi-line comment
+ * state at the end of the row is needed. The text doesn't need to be NUL
+ * terminated.
+ *
+ * @param syntax the syntax to highlight with
+ * @param text the text to highlight
+ * @param len length of the text
+ * @param hl highlight array of at least len bytes to fill
+ * @param in_comment whether the text starts inside a multi-line comment
+ * @return int whether the text ends inside a multi-line comment
  */
-void editor_move_cursor(int key)
+int editor_syntax_highlight(EditorSyntax *syntax, const char *text, int len,
+                            unsigned char *hl, int in_comment)
 {
-  EditorRow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  EditorLexState st = {in_comment, 0, 0, 1, HL_NORMAL};
+  editor_syntax_highlight_piece(syntax, text, len, hl, &st);
+  return st.in_comment;
+}
 
-  switch (key)
+/**
+ * @brief Get scratch space for highlighting rows that have no hl array
+ *
+ * @param len number of bytes needed
+ * @return unsigned char* the scratch buffer
+ */
+unsigned char *editor_syntax_scratch(int len)
+{
+  if (len > E.hlscratch_size)
   {
-  case ARROW_UP:
-    if (E.cy != 0)
-    {
-      E.cy--;
-    }
-    break;
-  case ARROW_DOWN:
-    if (E.cy < E.numrows)
-    {
-      E.cy++;
-    }
-    break;
-  case ARROW_LEFT:
-    if (E.cx != 0)
-    {
-      E.cx--;
-    }
-    else if (E.cy > 0)
-    {
-      E.cy--;
-      E.cx = E.row[E.cy].size;
-    }
-    break;
-  case ARROW_RIGHT:
-    if (row && E.cx < row->size)
+    E.hlscratch = realloc(E.hlscratch, len);
+    if (E.hlscratch == NULL)
     {
-      E.cx++;
-    }
-    else if (row && E.cx == row->size)
-    {
-      E.cy++;
-      E.cx = 0;
+      die("realloc");
     }
-    break;
+    E.hlscratch_size = len;
   }
+  return E.hlscratch;
+}
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
-  if (E.cx > rowlen)
+/**
+ * @brief Compute the multi-line comment state at the end of a row
+ *
+ * @param row the row
+ * @param in_comment the state at the start of the row
+ * @return int the state at the end of the row
+ */
+int editor_syntax_row_state(EditorRow *row, int in_comment)
+{
+  perf_count(PERF_SYNTAX, 1);
+  EditorSegments *t = editor_row_segments(row);
+  if (t)
   {
-    E.cx = rowlen;
+    return editor_segments_row_state(row, t, in_comment);
+  }
+  if (row->hl)
+  {
+    return editor_syntax_highlight(E.syntax, row->render, row->rsize, row->hl,
+                                   in_comment);
   }
+  return editor_syntax_highlight(E.syntax, row->chars, row->size,
+                                 editor_syntax_scratch(row->size), in_comment);
 }
 
 /**
- * @brief read the editor keypress and process it
- * to convert it to editor commands
+ * @brief Record the comment state at the end of the first row whose
+ * state was not known yet
+ *
+ * If the new state is the one the row already had and the rows after it
+ * still hold checkpoints from an earlier scan (up to E.syntax_resume), the
+ * rest of those checkpoints are valid again and the scan skips over them.
+ *
+ * @param row the row at E.syntax_rows
+ * @param in_comment the state at the end of the row
  */
-void editor_process_keypress()
+void editor_syntax_checkpoint(EditorRow *row, int in_comment)
 {
-  static int quit_times = ED9T_QUIT_TIMES;
-  int c = editor_read_key();
+  int unchanged = (row->hl_open_comment == in_comment);
+  row->hl_open_comment = in_comment;
+  E.syntax_rows++;
+  if (unchanged && E.syntax_rows < E.syntax_resume)
+  {
+    E.syntax_rows = E.syntax_resume;
+  }
+}
 
-  switch (c)
+/**
+ * @brief Make the comment state of the first rows of the file known
+ *
+ * The comment state of a row depends on every row before it. Rather than
+ * highlighting the whole file when it is opened, E.syntax_rows tracks how
+ * many leading rows have a known state and the scan is only carried
+ * forward when a row further down is drawn.
+ *
+ * @param upto number of leading rows whose state is needed
+ */
+void editor_syntax_catch_up(int upto)
+{
+  while (E.syntax && E.syntax_rows < upto && E.syntax_rows < E.numrows)
   {
-  case '\r':
-    editor_insert_newline();
-    break;
-  case CTRL_KEY('q'):
-    if (E.dirty && quit_times > 0)
+    EditorRow *row = editor_row_at(E.syntax_rows);
+    EditorRow *prev = editor_row_prev(row);
+    int in_comment = prev ? prev->hl_open_comment : 0;
+    while (row && E.syntax_rows < upto)
     {
-      editor_set_status_message("WARNING!!! File has unsaved changes. "
-                                "Press Ctrl-Q %d more times to quit.",
-                                quit_times);
-      quit_times--;
-      return;
+      int resume = E.syntax_rows + 1;
+      in_comment = editor_syntax_row_state(row, in_comment);
+      editor_syntax_checkpoint(row, in_comment);
+      if (E.syntax_rows != resume)
+      {
+        /* skipped ahead, look up the row to continue from */
+        break;
+      }
+      row = editor_row_next(row);
     }
+  }
+}
 
-    /* clear the screen with the J command and argument 2 */
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    /* reposition the cursor to the top left with the H command */
-    write(STDOUT_FILENO, "\x1b[H", 3);
-
-    exit(0);
-    break;
-
-  case CTRL_KEY('s'):
-    editor_save();
-    break;
+/**
+ * @brief Re-run the highlighter over a row whose contents or starting
+ * state have changed, carrying a changed comment state into the rows
+ * below it
+ *
+ * The carried state stops as soon as a row ends in the same state it had
+ * before. Rows past the end of the screen (plus ED9T_SYNTAX_LOOKAHEAD) are
+ * not rescanned here: the known prefix is cut short and the rest is left
+ * to editor_syntax_catch_up, which picks up the old checkpoints again once
+ * the state matches.
+ *
+ * @param row the row
+ * @param idx line number of the row
+ */
+void editor_syntax_rescan(EditorRow *row, int idx)
+{
+  E.syntax_gen++;
+  if (idx > E.syntax_rows && idx < E.syntax_resume)
+  {
+    /* the checkpoints from here on no longer follow from this row */
+    E.syntax_resume = idx;
+  }
+  if (idx >= E.syntax_rows)
+  {
+    /* the state of this row is computed when the scan reaches it */
+    return;
+  }
 
-  case BACKSPACE:
-  case CTRL_KEY('h'):
-  case DEL_KEY:
-    /*
-    if it is the DEL key, then move forward one char
-    and then delete the previous character
-    */
-    if (c == DEL_KEY)
-    {
-      editor_move_cursor(ARROW_RIGHT);
-    }
-    editor_del_char();
-    break;
+  int limit = E.rowoff + E.screenrows + ED9T_SYNTAX_LOOKAHEAD;
+  if (limit < idx + ED9T_SYNTAX_LOOKAHEAD)
+  {
+    limit = idx + ED9T_SYNTAX_LOOKAHEAD;
+  }
 
-    /*
-    pageup and pagedown move the cursor to top and bottom
-    of the screen
-    */
-  case PAGE_UP:
-  case PAGE_DOWN:
+  EditorRow *prev = editor_row_prev(row);
+  int in_comment = prev && prev->hl_open_comment;
+  while (row && idx < E.syntax_rows)
   {
-    if (c == PAGE_UP)
-    {
-      E.cy = E.rowoff;
-    }
-    else if (c == PAGE_DOWN)
+    if (idx >= limit)
     {
-      E.cy = E.rowoff + E.screenrows - 1;
-      if (E.cy > E.numrows)
-      {
-        E.cy = E.numrows;
-      }
+      E.syntax_resume = E.syntax_rows;
+      E.syntax_rows = idx;
+      return;
     }
 
-    int times = E.screenrows;
-    while (times--)
+    in_comment = editor_syntax_row_state(row, in_comment);
+    int changed = (row->hl_open_comment != in_comment);
+    row->hl_open_comment = in_comment;
+    if (!changed)
     {
-      editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+      return;
     }
+    row = editor_row_next(row);
+    idx++;
   }
-  break;
+}
 
-  case HOME_KEY:
-    E.cx = 0;
-    break;
-  case END_KEY:
-    if (E.cy < E.numrows)
+/**
+ * @brief Update the comment states after count rows from first were
+ * changed, added of which are new
+ *
+ * Within the known prefix the states of the whole range are computed in
+ * one pass, as none of the new rows has a state to compare with, and the
+ * change is then carried into the rows below by editor_syntax_rescan.
+ * Past the known prefix only the old checkpoints from first on are
+ * dropped.
+ *
+ * @param first line number of the first changed row
+ * @param count number of rows changed or inserted
+ * @param added number of those rows that were inserted
+ */
+void editor_syntax_rows_changed(int first, int count, int added)
+{
+  E.syntax_gen++;
+  if (first >= E.syntax_rows)
+  {
+    if (first < E.syntax_resume)
     {
-      E.cx = E.row[E.cy].size;
+      E.syntax_resume = first;
     }
-    break;
-
-  case CTRL_KEY('f'):
-    editor_find();
-    break;
+    return;
+  }
 
-  case ARROW_UP:
-  case ARROW_DOWN:
-  case ARROW_LEFT:
-  case ARROW_RIGHT:
-    editor_move_cursor(c);
-    break;
+  E.syntax_rows += added;
+  if (E.syntax_resume > first)
+  {
+    E.syntax_resume += added;
+  }
+  if (E.syntax == NULL)
+  {
+    return;
+  }
+  EditorRow *row = editor_row_at(first);
+  EditorRow *prev = editor_row_prev(row);
+  int in_comment = prev && prev->hl_open_comment;
+  int i;
+  for (i = 0; i < count; i++)
+  {
+    in_comment = editor_syntax_row_state(row, in_comment);
+    row->hl_open_comment = in_comment;
+    row = editor_row_next(row);
+  }
+  if (row && first + count < E.syntax_rows)
+  {
+    editor_syntax_rescan(row, first + count);
+  }
+}
 
-  case CTRL_KEY('l'):
-  case '\x1b':
-    break;
+/**
+ * @brief Update the comment states after n rows from at were deleted
+ *
+ * @param at line number of the first deleted row
+ * @param n number of rows deleted
+ * @param in_comment the state at the end of the last deleted row
+ */
+void editor_syntax_rows_deleted(int at, int n, int in_comment)
+{
+  E.syntax_gen++;
+  if (at >= E.syntax_rows)
+  {
+    if (at < E.syntax_resume)
+    {
+      E.syntax_resume = at;
+    }
+    return;
+  }
+  if (at + n > E.syntax_rows)
+  {
+    /* the known prefix ended among the deleted rows */
+    E.syntax_rows = at;
+    E.syntax_resume = at;
+    return;
+  }
+
+  E.syntax_rows -= n;
+  E.syntax_resume -= n;
+  /* the next row now follows the row before the deleted ones */
+  EditorRow *next = editor_row_at(at);
+  EditorRow *prev = next ? editor_row_prev(next) : NULL;
+  if (E.syntax && next && (prev ? prev->hl_open_comment : 0) != in_comment)
+  {
+    editor_syntax_rescan(next, at);
+  }
+}
+
+void editor_update_syntax(EditorRow *row)
+{
+  if (E.syntax == NULL)
+  {
+    return;
+  }
+  long long start = perf_start();
+  editor_syntax_rescan(row, editor_row_index(row));
+  perf_stop(PERF_SYNTAX, start, 0);
+}
 
+int editor_syntax_to_color(int hl)
+{
+  switch (hl)
+  {
+  case HL_COMMENT:
+  case HL_MLCOMMENT:
+    return 36;
+  case HL_KEYWORD1:
+    return 33;
+  case HL_KEYWORD2:
+    return 32;
+  case HL_STRING:
+    return 35;
+  case HL_NUMBER:
+    return 31;
+  case HL_MATCH:
+    return 34;
   default:
-    editor_insert_char(c);
-    break;
+    return 37;
+  }
+}
+
+void editor_select_syntax_highlight()
+{
+  E.syntax = NULL;
+  if (E.filename == NULL || E.large)
+  {
+    return;
+  }
+  char *ext = strrchr(E.filename, '.');
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+  {
+    EditorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i])
+    {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i])))
+      {
+        E.syntax = s;
+        editor_syntax_compile(s);
+
+        /*
+        every row is highlighted again when it is next drawn. the cache is
+        shared, the rows of the other buffers keep their own syntax
+        */
+        EditorRow *row;
+        for (row = E.cache_head; row; row = row->cache_next)
+        {
+          if (row_tree_root(row) == E.rowroot)
+          {
+            row->hl = NULL;
+          }
+        }
+        E.syntax_rows = 0;
+        E.syntax_resume = 0;
+        E.syntax_gen++;
+
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+/*** SYNTAX WORKER ***/
+
+/*
+with the worker running, the input thread never scans ahead for comment
+states itself: rows past the known prefix are drawn plain and the worker
+extends the prefix in the background. it copies a slice of the rows after
+E.syntax_rows, highlights the copy without holding the lock, and then
+stores the states only if no edit happened meanwhile (E.syntax_gen is
+unchanged) and the prefix still ends where the slice starts.
+*/
+
+int editor_hl_worker_has_work()
+{
+  return E.syntax && E.syntax_rows < E.numrows;
+}
+
+/**
+ * @brief Copy the rows following the known prefix into the worker's slice
+ *
+ * @param in_comment set to the state at the start of the slice
+ * @return number of rows copied
+ */
+int editor_hl_worker_copy(int *in_comment)
+{
+  EditorHlWorker *w = &E.hlworker;
+  EditorRow *row = editor_row_at(E.syntax_rows);
+  EditorRow *prev = editor_row_prev(row);
+  *in_comment = prev ? prev->hl_open_comment : 0;
+
+  int n = 0;
+  int len = 0;
+  while (row && n < ED9T_HL_SLICE_ROWS &&
+         (n == 0 || len + row->size <= ED9T_HL_SLICE_BYTES))
+  {
+    if (len + row->size > w->text_size)
+    {
+      w->text_size = len + row->size > ED9T_HL_SLICE_BYTES ? len + row->size
+                                                             : ED9T_HL_SLICE_BYTES;
+      w->text = realloc(w->text, w->text_size);
+      if (w->text == NULL)
+      {
+        die("realloc");
+      }
+    }
+    memcpy(w->text + len, row->chars, row->size);
+    len += row->size;
+    w->lens[n++] = row->size;
+    row = editor_row_next(row);
+  }
+  return n;
+}
+
+/**
+ * @brief Compute the state at the end of each row of the slice
+ */
+void editor_hl_worker_scan(EditorSyntax *syntax, int n, int in_comment)
+{
+  EditorHlWorker *w = &E.hlworker;
+  const char *text = w->text;
+  int i;
+  for (i = 0; i < n; i++)
+  {
+    if (w->lens[i] > w->hl_size)
+    {
+      w->hl = realloc(w->hl, w->lens[i]);
+      if (w->hl == NULL)
+      {
+        die("realloc");
+      }
+      w->hl_size = w->lens[i];
+    }
+    in_comment = editor_syntax_highlight(syntax, text, w->lens[i], w->hl, in_comment);
+    w->states[i] = in_comment;
+    text += w->lens[i];
+  }
+}
+
+void *editor_hl_worker_main(void *arg)
+{
+  EditorHlWorker *w = &E.hlworker;
+  (void)arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (1)
+  {
+    while (!editor_hl_worker_has_work())
+    {
+      pthread_cond_wait(&w->wake, &w->lock);
+    }
+
+    EditorSyntax *syntax = E.syntax;
+    unsigned int gen = E.syntax_gen;
+    int first = E.syntax_rows;
+    int in_comment;
+    int n = editor_hl_worker_copy(&in_comment);
+
+    pthread_mutex_unlock(&w->lock);
+    editor_hl_worker_scan(syntax, n, in_comment);
+    pthread_mutex_lock(&w->lock);
+
+    if (gen != E.syntax_gen || first != E.syntax_rows)
+    {
+      /* the rows changed under the slice, start over from the new prefix */
+      continue;
+    }
+    EditorRow *row = editor_row_at(first);
+    int i;
+    for (i = 0; i < n && E.syntax_rows == first + i; i++)
+    {
+      editor_syntax_checkpoint(row, w->states[i]);
+      row = editor_row_next(row);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Start the worker, called with every row of the opened file loaded
+ *
+ * The input thread takes the lock here and keeps it, see
+ * editor_hl_worker_release.
+ */
+void editor_hl_worker_start()
+{
+  EditorHlWorker *w = &E.hlworker;
+  if (!ED9T_HL_WORKER)
+  {
+    return;
+  }
+  if (pthread_mutex_init(&w->lock, NULL) != 0 ||
+      pthread_cond_init(&w->wake, NULL) != 0)
+  {
+    die("pthread_mutex_init");
+  }
+  pthread_mutex_lock(&w->lock);
+  if (pthread_create(&w->thread, NULL, editor_hl_worker_main, NULL) != 0)
+  {
+    die("pthread_create");
+  }
+  w->running = 1;
+}
+
+/**
+ * @brief Let the worker run while the input thread waits for input,
+ * waking it if part of the file has no known state
+ */
+void editor_hl_worker_release()
+{
+  EditorHlWorker *w = &E.hlworker;
+  if (!w->running)
+  {
+    return;
+  }
+  if (editor_hl_worker_has_work())
+  {
+    pthread_cond_signal(&w->wake);
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+void editor_hl_worker_acquire()
+{
+  if (E.hlworker.running)
+  {
+    pthread_mutex_lock(&E.hlworker.lock);
+  }
+}
+
+/**
+ * @brief Check whether rows on screen are drawn plain, waiting for the
+ * worker
+ */
+int editor_hl_worker_pending()
+{
+  int end = E.rowoff + E.screenrows;
+  if (end > E.numrows)
+  {
+    end = E.numrows;
+  }
+  return E.hlworker.running && E.syntax && E.syntax_rows < end;
+}
+
+/*** ROW SEGMENTS ***/
+
+/*
+rows of ED9T_SEGMENT_MIN chars or more, such as the one line of a minified
+file, are handled as a table of segments of about ED9T_SEGMENT_SIZE chars.
+the chars stay in one block, but the render and hl of such a row only cover
+the segments on the screen, the highlighter state at the start of every
+segment is kept so that a segment can be highlighted on its own, and an edit
+only cuts the segments around it again.
+
+a segment ends after a separator, and never inside a comment marker or right
+after a backslash, so highlighting the segments one by one from their states
+gives the same result as highlighting the whole row.
+*/
+
+/**
+ * @brief Whether a segment may end before text[pos]
+ *
+ * The markers of every filetype are checked, as the syntax can change after
+ * the row has been cut.
+ *
+ * @param text the chars being cut
+ * @param len number of chars
+ * @param pos the place of the cut, at least 1
+ * @return int 1 if the cut is safe
+ */
+int editor_segment_cut_ok(const char *text, int len, int pos)
+{
+  if (text[pos - 1] == '\\')
+  {
+    return 0;
+  }
+  unsigned int j;
+  for (j = 0; j < HLDB_ENTRIES; j++)
+  {
+    char *markers[] = {HLDB[j].singleline_comment_start,
+                       HLDB[j].multiline_comment_start,
+                       HLDB[j].multiline_comment_end};
+    int m;
+    for (m = 0; m < 3; m++)
+    {
+      int mlen = markers[m] ? strlen(markers[m]) : 0;
+      int d;
+      for (d = 1; d < mlen && d <= pos; d++)
+      {
+        if (pos - d + mlen <= len && !memcmp(&text[pos - d], markers[m], mlen))
+        {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Find the length of the segment that starts at text
+ *
+ * @param text the chars from the start of the segment
+ * @param len number of chars left to cut
+ * @return int length of the segment
+ */
+int editor_segment_cut(const char *text, int len)
+{
+  if (len <= 2 * ED9T_SEGMENT_SIZE)
+  {
+    return len;
+  }
+  int pos;
+  for (pos = ED9T_SEGMENT_SIZE; pos < 2 * ED9T_SEGMENT_SIZE; pos++)
+  {
+    if (is_separator(text[pos - 1]) && editor_segment_cut_ok(text, len, pos))
+    {
+      return pos;
+    }
+  }
+  /* a word this long is cut inside, which only a keyword would notice */
+  for (pos = 2 * ED9T_SEGMENT_SIZE; pos > ED9T_SEGMENT_SIZE; pos--)
+  {
+    if (editor_segment_cut_ok(text, len, pos))
+    {
+      return pos;
+    }
+  }
+  return 2 * ED9T_SEGMENT_SIZE;
+}
+
+/**
+ * @brief Replace count segments from first with segments cut out of len
+ * chars of the row from start on
+ *
+ * The new segments have no known width or state.
+ *
+ * @param row the row
+ * @param t its segment table
+ * @param first index of the first segment to replace
+ * @param count number of segments to replace
+ * @param start index into chars of the first new segment
+ * @param len number of chars the new segments cover
+ * @return int number of new segments
+ */
+int editor_segments_cut(EditorRow *row, EditorSegments *t, int first,
+                        int count, int start, int len)
+{
+  /* the pieces are collected first, their number is only known at the end */
+  int cap = 16;
+  int n = 0;
+  EditorSegment *pieces = malloc(sizeof(EditorSegment) * cap);
+  if (pieces == NULL)
+  {
+    die("malloc");
+  }
+  int off = 0;
+  while (off < len)
+  {
+    if (n == cap)
+    {
+      cap *= 2;
+      pieces = realloc(pieces, sizeof(EditorSegment) * cap);
+      if (pieces == NULL)
+      {
+        die("realloc");
+      }
+    }
+    const char *text = row->chars + start + off;
+    EditorSegment *g = &pieces[n++];
+    memset(g, 0, sizeof(EditorSegment));
+    g->len = editor_segment_cut(text, len - off);
+    int j;
+    for (j = 0; j < g->len; j++)
+    {
+      g->tabs += (text[j] == '\t');
+    }
+    g->width = g->len;
+    g->phase = g->tabs ? -1 : 0;
+    off += g->len;
+  }
+
+  int size = t->n - count + n;
+  if (size > t->cap)
+  {
+    t->cap = size + size / 2;
+    t->seg = realloc(t->seg, sizeof(EditorSegment) * t->cap);
+    if (t->seg == NULL)
+    {
+      die("realloc");
+    }
+  }
+  memmove(&t->seg[first + n], &t->seg[first + count],
+          sizeof(EditorSegment) * (t->n - first - count));
+  memcpy(&t->seg[first], pieces, sizeof(EditorSegment) * n);
+  t->n = size;
+  free(pieces);
+  return n;
+}
+
+/**
+ * @brief Get the segment table of a row, cutting the row into segments if
+ * it is long enough to need them
+ *
+ * @param row the row
+ * @return EditorSegments* the table, NULL for a row handled whole
+ */
+EditorSegments *editor_row_segments(EditorRow *row)
+{
+  if (row->segs || row->size < ED9T_SEGMENT_MIN)
+  {
+    return row->segs;
+  }
+  EditorSegments *t = malloc(sizeof(EditorSegments));
+  if (t == NULL)
+  {
+    die("malloc");
+  }
+  t->seg = NULL;
+  t->n = 0;
+  t->cap = 0;
+  t->nstates = 0;
+  t->syntax = NULL;
+  t->first = -1;
+  t->last = -1;
+  row->segs = t;
+  editor_segments_cut(row, t, 0, 0, 0, row->size);
+  return t;
+}
+
+/**
+ * @brief Free the segment table of a row, along with the render that
+ * covers some of its segments
+ *
+ * @param row the row
+ */
+void editor_row_free_segments(EditorRow *row)
+{
+  if (row->segs == NULL)
+  {
+    return;
+  }
+  editor_row_drop_render(row);
+  free(row->segs->seg);
+  free(row->segs);
+  row->segs = NULL;
+}
+
+/**
+ * @brief Get the render width of a segment, starting at render column rx
+ *
+ * Only segments with tabs depend on where they start, and their width is
+ * only worked out again when that changes modulo the tab stop.
+ *
+ * @param row the row
+ * @param t its segment table
+ * @param k index of the segment
+ * @param start index into chars of the segment
+ * @param rx render column of the segment
+ * @return int the width
+ */
+int editor_segment_width(EditorRow *row, EditorSegments *t, int k, int start,
+                         int rx)
+{
+  EditorSegment *g = &t->seg[k];
+  if (g->tabs && g->phase != rx % ED9T_TAB_STOP)
+  {
+    int end = rx;
+    int j;
+    for (j = start; j < start + g->len; j++)
+    {
+      if (row->chars[j] == '\t')
+      {
+        end += (ED9T_TAB_STOP - 1) - (end % ED9T_TAB_STOP);
+      }
+      end++;
+    }
+    g->width = end - rx;
+    g->phase = rx % ED9T_TAB_STOP;
+  }
+  return g->width;
+}
+
+/**
+ * @brief Find the segment that holds a char, the last one for the end of
+ * the row
+ *
+ * @param row the row
+ * @param t its segment table
+ * @param cx index into chars
+ * @param start set to the index into chars of the segment
+ * @param rx set to the render column of the segment
+ * @return int index of the segment
+ */
+int editor_segments_at_cx(EditorRow *row, EditorSegments *t, int cx,
+                          int *start, int *rx)
+{
+  int k = 0;
+  *start = 0;
+  *rx = 0;
+  while (k < t->n - 1 && *start + t->seg[k].len <= cx)
+  {
+    *rx += editor_segment_width(row, t, k, *start, *rx);
+    *start += t->seg[k].len;
+    k++;
+  }
+  return k;
+}
+
+/**
+ * @brief Find the segment that covers a render column, the last one past
+ * the end of the row
+ *
+ * The width of every segment up to it is brought up to date.
+ *
+ * @param row the row
+ * @param t its segment table
+ * @param rx the render column
+ * @param start set to the index into chars of the segment
+ * @param srx set to the render column of the segment
+ * @return int index of the segment
+ */
+int editor_segments_at_rx(EditorRow *row, EditorSegments *t, int rx,
+                          int *start, int *srx)
+{
+  int k = 0;
+  *start = 0;
+  *srx = 0;
+  while (1)
+  {
+    int width = editor_segment_width(row, t, k, *start, *srx);
+    if (k == t->n - 1 || *srx + width > rx)
+    {
+      return k;
+    }
+    *srx += width;
+    *start += t->seg[k].len;
+    k++;
+  }
+}
+
+/**
+ * @brief Get the highlighter state at the start of a segment, the one at
+ * the end of the row for k == t->n
+ */
+EditorLexState *editor_segments_state(EditorSegments *t, int k)
+{
+  return k < t->n ? &t->seg[k].state : &t->end;
+}
+
+int editor_lex_state_equal(EditorLexState *a, EditorLexState *b)
+{
+  return a->in_comment == b->in_comment && a->in_string == b->in_string &&
+         a->line_comment == b->line_comment && a->prev_sep == b->prev_sep &&
+         a->prev_hl == b->prev_hl;
+}
+
+/**
+ * @brief Make the highlighter states of a row known up to the start of
+ * segment upto, up to the end of the row for t->n
+ *
+ * The states are found from the chars, which highlight like the render.
+ *
+ * @param row the row
+ * @param t its segment table
+ * @param upto index of the last state needed
+ * @param in_comment the comment state at the start of the row
+ */
+void editor_segments_lex(EditorRow *row, EditorSegments *t, int upto,
+                         int in_comment)
+{
+  if (t->syntax != E.syntax || t->nstates == 0 ||
+      t->seg[0].state.in_comment != in_comment)
+  {
+    EditorLexState st = {in_comment, 0, 0, 1, HL_NORMAL};
+    t->seg[0].state = st;
+    t->syntax = E.syntax;
+    t->nstates = 1;
+  }
+
+  int k = t->nstates - 1;
+  int start = 0;
+  int j;
+  for (j = 0; j < k && k < upto; j++)
+  {
+    start += t->seg[j].len;
+  }
+  while (k < upto)
+  {
+    EditorLexState st = t->seg[k].state;
+    int len = t->seg[k].len;
+    editor_syntax_highlight_piece(E.syntax, row->chars + start, len,
+                                  editor_syntax_scratch(len), &st);
+    start += len;
+    *editor_segments_state(t, ++k) = st;
+    t->nstates = k + 1;
+  }
+}
+
+/**
+ * @brief Compute the multi-line comment state at the end of a segmented
+ * row, from the states that are still known
+ */
+int editor_segments_row_state(EditorRow *row, EditorSegments *t,
+                              int in_comment)
+{
+  editor_segments_lex(row, t, t->n, in_comment);
+  return t->end.in_comment;
+}
+
+/**
+ * @brief Cut the segments around an edit of a row again
+ *
+ * Called once the chars have changed. The states of the new segments are
+ * found from the state before them, and if that gives the state the
+ * segment after them already had, the states of the rest of the row still
+ * hold. A row that got short is handled whole again.
+ *
+ * @param row the row
+ * @param at index into chars of the edit
+ * @param removed number of chars removed at at
+ * @param added number of chars put in their place
+ */
+void editor_row_segments_edit(EditorRow *row, int at, int removed, int added)
+{
+  EditorSegments *t = row->segs;
+  if (t == NULL)
+  {
+    return;
+  }
+  if (row->size < ED9T_SEGMENT_MIN / 2)
+  {
+    editor_row_free_segments(row);
+    return;
+  }
+
+  /* from the segment before the edit to the one after the removed chars */
+  int first = 0;
+  int start = 0;
+  while (first < t->n - 1 && start + t->seg[first].len <= at)
+  {
+    start += t->seg[first].len;
+    first++;
+  }
+  int last = first;
+  int end = start + t->seg[first].len;
+  while (last < t->n - 1 && end < at + removed)
+  {
+    last++;
+    end += t->seg[last].len;
+  }
+  if (first > 0)
+  {
+    first--;
+    start -= t->seg[first].len;
+  }
+  if (last < t->n - 1)
+  {
+    last++;
+    end += t->seg[last].len;
+  }
+
+  int relex = E.syntax && t->syntax == E.syntax && t->nstates > first;
+  int known = relex && t->nstates > last + 1;
+  EditorLexState st = t->seg[first].state;
+  EditorLexState next = *editor_segments_state(t, last + 1);
+  int nstates = t->nstates;
+
+  int count = editor_segments_cut(row, t, first, last - first + 1, start,
+                                  end - start - removed + added);
+  if (!relex)
+  {
+    t->seg[first].state = st;
+    if (t->nstates > first + 1)
+    {
+      t->nstates = first + 1;
+    }
+    return;
+  }
+
+  int k;
+  for (k = first; k < first + count; k++)
+  {
+    int len = t->seg[k].len;
+    t->seg[k].state = st;
+    editor_syntax_highlight_piece(E.syntax, row->chars + start, len,
+                                  editor_syntax_scratch(len), &st);
+    start += len;
+  }
+  *editor_segments_state(t, k) = st;
+  if (known && editor_lex_state_equal(&st, &next))
+  {
+    t->nstates = nstates + count - (last - first + 1);
+  }
+  else
+  {
+    t->nstates = k + 1;
+  }
+}
+
+/**
+ * @brief Build the render of a segmented row over the segments that hold
+ * the render columns from from up to to
+ *
+ * A render that already covers them is kept.
+ *
+ * @param row the row
+ * @param t its segment table
+ * @param from first render column needed
+ * @param to render column after the last one needed
+ * @return int render column the render starts at
+ */
+int editor_segments_render(EditorRow *row, EditorSegments *t, int from,
+                           int to)
+{
+  int cx0, rx0, cx1, rx1;
+  int first = editor_segments_at_rx(row, t, from, &cx0, &rx0);
+  int last = editor_segments_at_rx(row, t, to - 1, &cx1, &rx1);
+  if (row->render && first >= t->first && last <= t->last)
+  {
+    editor_row_cache_touch(row);
+    return t->rx;
+  }
+  editor_row_drop_render(row);
+
+  int width = rx1 + t->seg[last].width - rx0;
+  int cap;
+  row->render = slab_alloc(2 * (width + 1), &cap);
+  row->rcap = cap / 2;
+  /* a segmented render has no column map, its tabs are not counted */
+  row->ntabs = 0;
+
+  int idx = 0;
+  int j;
+  for (j = cx0; j < cx1 + t->seg[last].len; j++)
+  {
+    if (row->chars[j] == '\t')
+    {
+      row->render[idx++] = ' ';
+      while ((rx0 + idx) % ED9T_TAB_STOP != 0)
+      {
+        row->render[idx++] = ' ';
+      }
+    }
+    else
+    {
+      row->render[idx++] = row->chars[j];
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+
+  t->first = first;
+  t->last = last;
+  t->cx = cx0;
+  t->rx = rx0;
+  editor_row_cache_add(row);
+  return rx0;
+}
+
+/**
+ * @brief Highlight the render of a segmented row, each segment from its
+ * state
+ *
+ * @param row the row
+ * @param t its segment table
+ * @param in_comment the comment state at the start of the row
+ */
+void editor_segments_highlight(EditorRow *row, EditorSegments *t,
+                               int in_comment)
+{
+  editor_segments_lex(row, t, t->last, in_comment);
+  int idx = 0;
+  int k;
+  for (k = t->first; k <= t->last; k++)
+  {
+    EditorLexState st = t->seg[k].state;
+    int width = t->seg[k].width;
+    editor_syntax_highlight_piece(E.syntax, row->render + idx, width,
+                                  row->hl + idx, &st);
+    idx += width;
+  }
+}
+
+/*** ROW OPERATIONS ***/
+
+/**
+ * @brief Convert an index into the chars of a row to a render column
+ *
+ * A rendered row without tabs maps columns one to one, a row with a column
+ * map is looked up in it, a segmented row is only walked over the segment
+ * holding cx, and other rows are walked from the start.
+ *
+ * @param row the row
+ * @param cx index into chars
+ * @return int the render column
+ */
+int editor_row_cx_to_rx(EditorRow *row, int cx)
+{
+  EditorSegments *t = editor_row_segments(row);
+  if (t)
+  {
+    /* walk the segment holding cx */
+    int start, rx;
+    int k = editor_segments_at_cx(row, t, cx, &start, &rx);
+    int j;
+    for (j = start; j < cx && j < start + t->seg[k].len; j++)
+    {
+      if (row->chars[j] == '\t')
+      {
+        rx += (ED9T_TAB_STOP - 1) - (rx % ED9T_TAB_STOP);
+      }
+      rx++;
+    }
+    return rx + (cx - j);
+  }
+  if (row->render && row->ntabs == 0)
+  {
+    return cx;
+  }
+  if (row->colmap)
+  {
+    /* the last tab before cx */
+    int *map = row->colmap;
+    int lo = 0;
+    int hi = row->ntabs;
+    while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (map[2 * mid] < cx)
+      {
+        lo = mid + 1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+    if (lo == 0)
+    {
+      return cx;
+    }
+    return map[2 * lo - 1] + (cx - map[2 * lo - 2] - 1);
+  }
+
+  int rx = 0;
+  int j;
+  for (j = 0; j < cx; j++)
+  {
+    if (row->chars[j] == '\t')
+    {
+      rx += (ED9T_TAB_STOP - 1) - (rx % ED9T_TAB_STOP);
+    }
+    rx++;
+  }
+  return rx;
+}
+
+/**
+ * @brief Convert a render column to the index of the char of a row that
+ * covers it, the row size past the end of the row
+ *
+ * @param row the row
+ * @param rx the render column
+ * @return int index into chars
+ */
+int editor_row_rx_to_cx(EditorRow *row, int rx)
+{
+  EditorSegments *t = editor_row_segments(row);
+  if (t)
+  {
+    int start, cur_rx;
+    int k = editor_segments_at_rx(row, t, rx, &start, &cur_rx);
+    int cx;
+    for (cx = start; cx < start + t->seg[k].len; cx++)
+    {
+      if (row->chars[cx] == '\t')
+      {
+        cur_rx += (ED9T_TAB_STOP - 1) - (cur_rx % ED9T_TAB_STOP);
+      }
+      cur_rx++;
+      if (cur_rx > rx)
+      {
+        return cx;
+      }
+    }
+    return cx;
+  }
+  if (row->render && row->ntabs == 0)
+  {
+    return rx < row->size ? rx : row->size;
+  }
+  if (row->colmap)
+  {
+    /* the last tab that ends at or before rx */
+    int *map = row->colmap;
+    int lo = 0;
+    int hi = row->ntabs;
+    while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (map[2 * mid + 1] <= rx)
+      {
+        lo = mid + 1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+    int cx = lo ? map[2 * lo - 2] + 1 + (rx - map[2 * lo - 1]) : rx;
+    int limit = lo < row->ntabs ? map[2 * lo] : row->size;
+    return cx < limit ? cx : limit;
+  }
+
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++)
+  {
+    if (row->chars[cx] == '\t')
+    {
+      cur_rx += (ED9T_TAB_STOP - 1) - (cur_rx % ED9T_TAB_STOP);
+    }
+    cur_rx++;
+    if (cur_rx > rx)
+    {
+      return cx;
+    }
+  }
+  return cx;
+}
+
+/**
+ * @brief Get the bytes a row holds in the render cache
+ */
+long long editor_row_cache_size(EditorRow *row)
+{
+  return 2LL * row->rcap + (row->colmap ? 2LL * row->ntabs * sizeof(int) : 0);
+}
+
+/**
+ * @brief Unlink a row from the render cache and free its render and hl
+ *
+ * @param row the row
+ */
+void editor_row_drop_render(EditorRow *row)
+{
+  if (row->render == NULL)
+  {
+    return;
+  }
+  if (row->cache_prev)
+  {
+    row->cache_prev->cache_next = row->cache_next;
+  }
+  else
+  {
+    E.cache_head = row->cache_next;
+  }
+  if (row->cache_next)
+  {
+    row->cache_next->cache_prev = row->cache_prev;
+  }
+  else
+  {
+    E.cache_tail = row->cache_prev;
+  }
+  E.cache_rows--;
+  E.cache_bytes -= editor_row_cache_size(row);
+
+  slab_free(row->render, 2 * row->rcap);
+  /* a class is picked by size alone, so the asked size frees the block */
+  if (row->colmap)
+  {
+    slab_free(row->colmap, 2 * row->ntabs * sizeof(int));
+    row->colmap = NULL;
+  }
+  row->render = NULL;
+  row->hl = NULL;
+  row->rsize = 0;
+  row->rcap = 0;
+}
+
+/**
+ * @brief Mark a row that has a render as the most recently used row of the
+ * render cache
+ *
+ * @param row the row
+ */
+void editor_row_cache_touch(EditorRow *row)
+{
+  if (row != E.cache_head)
+  {
+    /* move to the front of the cache */
+    row->cache_prev->cache_next = row->cache_next;
+    if (row->cache_next)
+    {
+      row->cache_next->cache_prev = row->cache_prev;
+    }
+    else
+    {
+      E.cache_tail = row->cache_prev;
+    }
+    row->cache_prev = NULL;
+    row->cache_next = E.cache_head;
+    E.cache_head->cache_prev = row;
+    E.cache_head = row;
+  }
+}
+
+/**
+ * @brief Link a row whose render was just built into the render cache
+ *
+ * The least recently used rows are dropped again once more than
+ * ED9T_RENDER_CACHE_ROWS rows are cached, so memory follows the viewport
+ * rather than the size of the file. The rows of every buffer share
+ * ED9T_RENDER_CACHE_BYTES too, and as the rows of the buffers that aren't
+ * shown are the least recently used, theirs are the first thrown away.
+ * Only the row count drops the E.cache_pinned rows after the head.
+ *
+ * @param row the row
+ */
+void editor_row_cache_add(EditorRow *row)
+{
+  row->cache_prev = NULL;
+  row->cache_next = E.cache_head;
+  if (E.cache_head)
+  {
+    E.cache_head->cache_prev = row;
+  }
+  else
+  {
+    E.cache_tail = row;
+  }
+  E.cache_head = row;
+  E.cache_rows++;
+  E.cache_bytes += editor_row_cache_size(row);
+
+  int limit = ED9T_RENDER_CACHE_ROWS;
+  if (limit < 2 * E.screenrows)
+  {
+    limit = 2 * E.screenrows;
+  }
+  while (E.cache_rows > limit ||
+         (E.cache_bytes > ED9T_RENDER_CACHE_BYTES &&
+          E.cache_rows > E.cache_pinned + 1))
+  {
+    editor_row_drop_render(E.cache_tail);
+  }
+}
+
+/**
+ * @brief Make sure a row has its render built, and mark it as the most
+ * recently used row of the render cache
+ *
+ * Only rows that are drawn or searched get a render. Segmented rows are
+ * left alone, they are only rendered over the columns that are needed by
+ * editor_row_prepare_hl.
+ *
+ * @param row the row
+ */
+void editor_row_prepare_render(EditorRow *row)
+{
+  if (editor_row_segments(row))
+  {
+    return;
+  }
+  if (row->render)
+  {
+    editor_row_cache_touch(row);
+    return;
+  }
+
+  int tabs = 0;
+  int j;
+  for (j = 0; j < row->size; j++)
+  {
+    if (row->chars[j] == '\t')
+      tabs++;
+  }
+
+  int cap;
+  row->render = slab_alloc(2 * (row->size + tabs * (ED9T_TAB_STOP - 1) + 1), &cap);
+  row->rcap = cap / 2;
+  row->ntabs = tabs;
+  int *map = NULL;
+  if (tabs && row->size >= ED9T_COLUMN_MAP_MIN)
+  {
+    map = slab_alloc(2 * tabs * sizeof(int), &cap);
+  }
+  row->colmap = map;
+
+  int idx = 0;
+  for (j = 0; j < row->size; j++)
+  {
+    if (row->chars[j] == '\t')
+    {
+      row->render[idx++] = ' ';
+      while (idx % ED9T_TAB_STOP != 0)
+      {
+        row->render[idx++] = ' ';
+      }
+      if (map)
+      {
+        *map++ = j;
+        *map++ = idx;
+      }
+    }
+    else
+    {
+      row->render[idx++] = row->chars[j];
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+  editor_row_cache_add(row);
+}
+
+/**
+ * @brief Make sure a row has its render and hl arrays built, at least over
+ * the render columns from from up to to
+ *
+ * The render of a row handled whole covers the whole row, that of a
+ * segmented row the segments holding the columns.
+ *
+ * @param row the row
+ * @param from first render column needed
+ * @param to render column after the last one needed
+ * @return int render column that render[0] and hl[0] stand for
+ */
+int editor_row_prepare_hl(EditorRow *row, int from, int to)
+{
+  EditorSegments *t = editor_row_segments(row);
+  int base = 0;
+  if (t)
+  {
+    base = editor_segments_render(row, t, from < 0 ? 0 : from,
+                                  to > from + 1 ? to : from + 1);
+  }
+  else
+  {
+    editor_row_prepare_render(row);
+  }
+  if (E.syntax == NULL)
+  {
+    if (row->hl == NULL)
+    {
+      row->hl = (unsigned char *)row->render + row->rcap;
+      memset(row->hl, HL_NORMAL, row->rsize);
+    }
+    return base;
+  }
+
+  /* a cached hl is only up to date while the row's state is known */
+  int idx = editor_row_index(row);
+  if (row->hl && idx < E.syntax_rows && !(row->flags & ROW_HL_PLAIN))
+  {
+    return base;
+  }
+  if (row->hl == NULL)
+  {
+    row->hl = (unsigned char *)row->render + row->rcap;
+  }
+  if (idx > E.syntax_rows && E.hlworker.running)
+  {
+    /* drawn plain until the worker gets to it */
+    memset(row->hl, HL_NORMAL, row->rsize);
+    row->flags |= ROW_HL_PLAIN;
+    return base;
+  }
+  row->flags &= ~ROW_HL_PLAIN;
+
+  editor_syntax_catch_up(idx);
+  perf_count(PERF_SYNTAX, 1);
+  EditorRow *prev = editor_row_prev(row);
+  int in_comment = prev && prev->hl_open_comment;
+  if (t)
+  {
+    editor_segments_highlight(row, t, in_comment);
+    in_comment = E.syntax_rows == idx
+                     ? editor_segments_row_state(row, t, in_comment)
+                     : 0;
+  }
+  else
+  {
+    in_comment = editor_syntax_highlight(E.syntax, row->render, row->rsize,
+                                         row->hl, in_comment);
+  }
+  if (E.syntax_rows == idx)
+  {
+    editor_syntax_checkpoint(row, in_comment);
+  }
+  return base;
+}
+
+/**
+ * @brief Called whenever the chars of a row have changed
+ *
+ * The render and hl of the row are dropped and rebuilt when the row is
+ * drawn again, only the comment state is updated right away.
+ *
+ * @param row the row
+ */
+void editor_update_row(EditorRow *row)
+{
+  long long start = perf_start();
+  editor_row_drop_render(row);
+  editor_update_syntax(row);
+  perf_stop(PERF_UPDATE_ROW, start, 0);
+}
+
+void editor_insert_row(int at, char *s, size_t len)
+{
+  if (at < 0 || at > E.numrows)
+  {
+    return;
+  }
+
+  /* the tree is split at line at, which can't be inside a span */
+  editor_row_at(at);
+  EditorRow *row = row_tree_alloc();
+  row->lines = 1;
+  row_tree_insert(at, row);
+  EditorRow *prev = editor_row_prev(row);
+  if (at < E.syntax_rows)
+  {
+    E.syntax_rows++;
+    if (E.syntax_resume > at)
+    {
+      E.syntax_resume++;
+    }
+  }
+  else if (at < E.syntax_resume)
+  {
+    E.syntax_resume = at;
+  }
+
+  row->size = len;
+  row->flags = 0;
+  row->chars = slab_alloc(len + 1, &row->ccap);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->colmap = NULL;
+  row->segs = NULL;
+  row->hl = NULL;
+  row->rcap = 0;
+  /*
+  start with the state the next row currently sees so that the change
+  check in editor_update_syntax carries a different state forward
+  */
+  row->hl_open_comment = prev ? prev->hl_open_comment : 0;
+  editor_update_row(row);
+
+  E.numrows++;
+  E.dirty++;
+  editor_undo_record(UNDO_INSERT_ROWS, at, 1, s, len);
+}
+
+/**
+ * @brief Give a row its own copy of its characters before it is modified
+ *
+ * Rows loaded through editor_open_mapped point into the read-only file
+ * mapping, this is the copy-on-write step for those rows.
+ *
+ * @param row the row about to be modified
+ */
+void editor_row_make_writable(EditorRow *row)
+{
+  if (!(row->flags & ROW_MAPPED))
+  {
+    return;
+  }
+  char *chars = slab_alloc(row->size + 1, &row->ccap);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->flags &= ~ROW_MAPPED;
+}
+
+void editor_row_insert_char(EditorRow *row, int at, int c)
+{
+  if (at < 0 || at > row->size)
+  {
+    at = row->size;
+  }
+  char ch = c;
+  editor_undo_record(UNDO_INSERT, editor_row_index(row), at, &ch, 1);
+  editor_row_make_writable(row);
+  row->chars = slab_grow(row->chars, &row->ccap, row->size + 1, row->size + 2);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editor_row_segments_edit(row, at, 0, 1);
+  editor_update_row(row);
+  E.dirty++;
+}
+
+void editor_row_insert_string(EditorRow *row, int at, const char *s,
+                              size_t len)
+{
+  if (at < 0 || at > row->size)
+  {
+    at = row->size;
+  }
+  editor_undo_record(UNDO_INSERT, editor_row_index(row), at, s, len);
+  editor_row_make_writable(row);
+  row->chars = slab_grow(row->chars, &row->ccap, row->size + 1,
+                         row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editor_row_segments_edit(row, at, 0, len);
+  editor_update_row(row);
+  E.dirty++;
+}
+
+void editor_row_del_chars(EditorRow *row, int at, int len)
+{
+  if (at < 0 || len <= 0 || at + len > row->size)
+  {
+    return;
+  }
+  editor_undo_record(UNDO_DELETE, editor_row_index(row), at,
+                     &row->chars[at], len);
+  editor_row_make_writable(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editor_row_segments_edit(row, at, len, 0);
+  editor_update_row(row);
+  E.dirty++;
+}
+
+void editor_row_del_char(EditorRow *row, int at)
+{
+  editor_row_del_chars(row, at, 1);
+}
+
+void editor_free_row(EditorRow *row)
+{
+  editor_row_free_segments(row);
+  editor_row_drop_render(row);
+  if (row->flags & ROW_PACKED)
+  {
+    editor_pack_forget(row);
+    free(row->chars);
+  }
+  else if (!(row->flags & ROW_MAPPED))
+  {
+    slab_free(row->chars, row->ccap);
+  }
+}
+
+void editor_del_row(int at)
+{
+  if (at < 0 || at >= E.numrows)
+  {
+    return;
+  }
+  editor_undo_record_rows(UNDO_DELETE_ROWS, at, 1);
+  editor_row_at(at);
+  EditorRow *row = row_tree_remove(at);
+  int in_comment = row->hl_open_comment;
+  editor_free_row(row);
+  row_tree_free(row);
+  E.numrows--;
+  editor_syntax_rows_deleted(at, 1, in_comment);
+  E.dirty++;
+}
+
+/**
+ * @brief Delete n rows starting at at, unlinking them from the row tree
+ * with a single split
+ */
+void editor_del_rows(int at, int n)
+{
+  if (at < 0 || n <= 0 || at + n > E.numrows)
+  {
+    return;
+  }
+  editor_undo_record_rows(UNDO_DELETE_ROWS, at, n);
+  /* the splits below need the range to start and end at a node */
+  editor_row_at(at);
+  editor_row_at(at + n - 1);
+  EditorRow *a, *mid, *b;
+  row_tree_split(E.rowroot, at, &a, &b);
+  row_tree_split(b, n, &mid, &b);
+  E.rowroot = row_tree_merge(a, b);
+  if (E.rowroot)
+  {
+    E.rowroot->parent = NULL;
+  }
+
+  /* collect the rows first, freeing a node breaks the walk past it */
+  EditorRow **rows = malloc(sizeof(EditorRow *) * n);
+  if (rows == NULL)
+  {
+    die("malloc");
+  }
+  EditorRow *row = mid;
+  while (row->left)
+  {
+    row = row->left;
+  }
+  int i;
+  for (i = 0; i < n; i++, row = row_tree_next(row))
+  {
+    rows[i] = row;
+  }
+  int in_comment = rows[n - 1]->hl_open_comment;
+  for (i = 0; i < n; i++)
+  {
+    editor_free_row(rows[i]);
+    row_tree_free(rows[i]);
+  }
+  free(rows);
+
+  E.numrows -= n;
+  editor_syntax_rows_deleted(at, n, in_comment);
+  E.dirty++;
+}
+
+/**
+ * @brief Build unlinked rows out of the lines of text
+ *
+ * @param text the text, lines separated by \n
+ * @param len length of the text
+ * @param n set to the number of rows, one more than the number of newlines
+ * @return EditorRow* array of the rows, for editor_insert_rows
+ */
+EditorRow *editor_rows_from_text(const char *text, int len, int *n)
+{
+  const char *end = text + len;
+  const char *p;
+  int count = 1;
+  for (p = memchr(text, '\n', len); p; p = memchr(p + 1, '\n', end - p - 1))
+  {
+    count++;
+  }
+  EditorRow *rows = malloc(sizeof(EditorRow) * count);
+  if (rows == NULL)
+  {
+    die("malloc");
+  }
+
+  int i;
+  p = text;
+  for (i = 0; i < count; i++)
+  {
+    const char *eol = (i < count - 1) ? memchr(p, '\n', end - p) : end;
+    EditorRow *r = &rows[i];
+    r->size = eol - p;
+    r->flags = 0;
+    r->chars = slab_alloc(r->size + 1, &r->ccap);
+    memcpy(r->chars, p, r->size);
+    r->chars[r->size] = '\0';
+    r->rsize = 0;
+    r->render = NULL;
+    r->colmap = NULL;
+    r->segs = NULL;
+    r->hl = NULL;
+    r->rcap = 0;
+    r->hl_open_comment = 0;
+    r->lines = 1;
+    p = eol + 1;
+  }
+  *n = count;
+  return rows;
+}
+
+/**
+ * @brief Link an array of new rows into the row tree at at in one splice
+ *
+ * The rows are made into a balanced subtree by row_tree_build and merged
+ * in between the rows before and after at, so adding n rows costs O(n)
+ * rather than n separate inserts. Their comment states are left to
+ * editor_syntax_rows_changed.
+ *
+ * @param at position of the first new row
+ * @param rows the new rows, in file order
+ * @param n number of rows
+ */
+void editor_insert_rows(int at, EditorRow *rows, int n)
+{
+  EditorRow *a, *b;
+  editor_row_at(at);
+  row_tree_split(E.rowroot, at, &a, &b);
+  E.rowroot = row_tree_merge(row_tree_merge(a, row_tree_build(rows, n, 0)), b);
+  E.rowroot->parent = NULL;
+  E.numrows += n;
+  E.dirty++;
+  editor_undo_record_rows(UNDO_INSERT_ROWS, at, n);
+}
+
+void editor_row_append_string(EditorRow *row, char *s, size_t len)
+{
+  editor_row_insert_string(row, row->size, s, len);
+}
+
+/*** ROW SPANS ***/
+
+/*
+in large-file mode the rows are not all loaded when the file is opened.
+the tree is built out of spans instead, each standing for a run of lines of
+the file mapping, and a line is only turned into a row of its own when it
+is looked up. the rows that are not edited are folded back into spans once
+they are far from the screen, so memory follows what is being looked at
+rather than the size of the file. edited rows are never folded, they hold
+the changes until the file is saved.
+*/
+
+/**
+ * @brief Make a span node
+ */
+EditorRow *editor_span_new(char *chars, int size, int lines)
+{
+  EditorRow *span = row_tree_alloc();
+  span->size = size;
+  span->flags = ROW_MAPPED | ROW_SPAN;
+  span->chars = chars;
+  span->ccap = 0;
+  span->rsize = 0;
+  span->render = NULL;
+  span->colmap = NULL;
+  span->segs = NULL;
+  span->hl = NULL;
+  span->rcap = 0;
+  span->hl_open_comment = 0;
+  span->lines = lines;
+  return span;
+}
+
+/**
+ * @brief Load a line out of a span as a row
+ *
+ * The span is cut into the lines before it, the new row and the lines after
+ * it. The node of the span is kept for the lines before, or reused for the
+ * row when there are none, so a span pointer keeps its first line.
+ *
+ * @param span the span
+ * @param off position of the line in the span
+ * @return EditorRow* the row of the line
+ */
+EditorRow *editor_span_take(EditorRow *span, int off)
+{
+  if (span->flags & ROW_PACKED)
+  {
+    return editor_pack_take(span, off);
+  }
+  char *end = span->chars + span->size;
+  char *p = span->chars;
+  int i;
+  for (i = 0; i < off; i++)
+  {
+    p = (char *)memchr(p, '\n', end - p) + 1;
+  }
+  char *nl = memchr(p, '\n', end - p);
+  char *eol = nl ? nl : end;
+  int lines = span->lines;
+  int at = editor_row_index(span) + off;
+
+  EditorRow *row;
+  if (off > 0)
+  {
+    span->size = p - 1 - span->chars;
+    span->lines = off;
+    row_tree_update(span);
+    row = row_tree_alloc();
+  }
+  else
+  {
+    row = span;
+  }
+
+  row->flags = ROW_MAPPED;
+  row->chars = p;
+  while (eol > p && eol[-1] == '\r')
+  {
+    eol--;
+  }
+  row->size = eol - p;
+  row->ccap = 0;
+  row->rsize = 0;
+  row->render = NULL;
+  row->colmap = NULL;
+  row->segs = NULL;
+  row->hl = NULL;
+  row->rcap = 0;
+  row->hl_open_comment = 0;
+  row->lines = 1;
+  if (row == span)
+  {
+    row_tree_update(row);
+  }
+  else
+  {
+    row_tree_insert(at, row);
+  }
+
+  if (off + 1 < lines)
+  {
+    row_tree_insert(at + 1, editor_span_new(nl + 1, end - nl - 1, lines - off - 1));
+  }
+  E.span_rows++;
+  return row;
+}
+
+/**
+ * @brief Check whether a node can be folded into a span by
+ * editor_span_reclaim
+ */
+int editor_span_foldable(EditorRow *row, int at, int lo, int hi)
+{
+  if (row->flags & ROW_SPAN)
+  {
+    return !(row->flags & ROW_PACKED) && row != E.search.scan_row;
+  }
+  /* edited rows, rows near the screen and rows the search points at stay */
+  return (row->flags & ROW_MAPPED) && (at < lo || at >= hi) &&
+         row != E.search.row && row != E.search.hl_row &&
+         row != E.search.scan_row;
+}
+
+/**
+ * @brief Cut the nodes of a run out of the row tree
+ *
+ * @param a set to the tree of the rows before the run
+ * @param b set to the tree of the rows after it
+ * @return EditorRow** the nodes of the run in file order, to be freed
+ */
+EditorRow **editor_span_cut(EditorSpanRun *run, EditorRow **a, EditorRow **b)
+{
+  EditorRow *mid;
+  row_tree_split(E.rowroot, run->at, a, b);
+  row_tree_split(*b, run->lines, &mid, b);
+
+  /* collect the nodes first, freeing a node breaks the walk past it */
+  EditorRow **nodes = malloc(sizeof(EditorRow *) * run->nodes);
+  if (nodes == NULL)
+  {
+    die("malloc");
+  }
+  EditorRow *row = mid;
+  while (row->left)
+  {
+    row = row->left;
+  }
+  int i;
+  for (i = 0; i < run->nodes; i++, row = row_tree_next(row))
+  {
+    nodes[i] = row;
+  }
+  return nodes;
+}
+
+/**
+ * @brief Link a span in between the trees left by editor_span_cut
+ */
+void editor_span_join(EditorRow *a, EditorRow *span, EditorRow *b)
+{
+  span->left = span->right = span->parent = NULL;
+  span->count = span->lines;
+  span->prio = row_tree_random();
+  E.rowroot = row_tree_merge(row_tree_merge(a, span), b);
+  E.rowroot->parent = NULL;
+}
+
+/**
+ * @brief Fold a run of nodes into a single span
+ */
+void editor_span_fold(EditorSpanRun *run)
+{
+  EditorRow *a, *b;
+  EditorRow **nodes = editor_span_cut(run, &a, &b);
+  int i;
+  for (i = 0; i < run->nodes; i++)
+  {
+    if (!(nodes[i]->flags & ROW_SPAN))
+    {
+      E.span_rows--;
+    }
+    editor_free_row(nodes[i]);
+    row_tree_free(nodes[i]);
+  }
+  free(nodes);
+  editor_span_join(a, editor_span_new(run->chars, run->size, run->lines), b);
+}
+
+/**
+ * @brief Fold the unedited rows far from the screen back into spans, once
+ * more than E.span_limit rows have been loaded
+ *
+ * Runs of such rows, and the spans around them, are folded if they still
+ * lie back to back in the file mapping. The edited rows far from the screen
+ * are packed by editor_pack_reclaim.
+ */
+void editor_span_reclaim()
+{
+  if (!E.large || E.span_rows <= E.span_limit)
+  {
+    return;
+  }
+  int lo = E.rowoff - ED9T_LARGE_ROWS / 4;
+  int hi = E.rowoff + E.screenrows + ED9T_LARGE_ROWS / 4;
+  char *mapend = E.map + E.maplen;
+
+  EditorSpanRun *runs = NULL;
+  int nruns = 0;
+  int cap = 0;
+  EditorSpanRun run = {0, 0, 0, NULL, 0};
+  /* loaded rows in the run, and where the text after it starts */
+  int loaded = 0;
+  char *next = NULL;
+
+  int at = 0;
+  EditorRow *row = row_tree_first();
+  while (1)
+  {
+    int fold = row && editor_span_foldable(row, at, lo, hi);
+    if (run.nodes > 0 && (!fold || row->chars != next))
+    {
+      /* a run of one span is folded already */
+      if (run.nodes > 1 || loaded > 0)
+      {
+        if (nruns == cap)
+        {
+          cap = cap ? cap * 2 : 64;
+          runs = realloc(runs, sizeof(EditorSpanRun) * cap);
+          if (runs == NULL)
+          {
+            die("realloc");
+          }
+        }
+        runs[nruns++] = run;
+      }
+      run.nodes = 0;
+    }
+    if (row == NULL)
+    {
+      break;
+    }
+
+    if (fold)
+    {
+      if (run.nodes == 0)
+      {
+        run.at = at;
+        run.lines = 0;
+        run.chars = row->chars;
+        loaded = 0;
+      }
+      run.nodes++;
+      run.lines += row->lines;
+      char *tail = row->chars + row->size;
+      if (!(row->flags & ROW_SPAN))
+      {
+        loaded++;
+        /* the \r of a CRLF line is not part of the row */
+        while (tail < mapend && *tail == '\r')
+        {
+          tail++;
+        }
+      }
+      run.size = tail - run.chars;
+      next = (tail < mapend && *tail == '\n') ? tail + 1 : NULL;
+    }
+    at += row->lines;
+    row = row_tree_next(row);
+  }
+
+  /* from the last run back, so the line numbers of the others stay valid */
+  while (nruns > 0)
+  {
+    editor_span_fold(&runs[--nruns]);
+  }
+  free(runs);
+  editor_pack_reclaim(lo, hi, E.numrows);
+
+  E.span_limit = 2 * E.span_rows;
+  if (E.span_limit < ED9T_LARGE_ROWS)
+  {
+    E.span_limit = ED9T_LARGE_ROWS;
+  }
+}
+
+/*** COLD STORAGE ***/
+
+/*
+edited rows are never folded back into spans, so a replace over a large
+file would leave every line it touched loaded for good. runs of edited rows
+far from the screen are packed instead, with the unedited lines between
+them: their lines are joined by newlines as in a span and compressed into a
+block, held by a span flagged ROW_PACKED. unedited lines that end in \r are
+left out, their \r is only kept by the mapping. searching and saving read
+the block unpacked, from a cache of the last ED9T_PACK_CACHE blocks, and
+looking a line of it up unpacks the whole span back into rows.
+
+a block is in the LZ4 block format, written out here rather than taken as a
+dependency. it is a list of sequences, each a token byte whose high nibble
+is the number of literals and low nibble the match length less 4, then the
+literals, then the match as a 2-byte little-endian offset back into the
+output. a nibble of 15 goes on in the bytes after it, which are added to it
+up to the first one below 255, for the literals right after the token and
+for the match after its offset. the last sequence is literals only, and the
+last 5 bytes are always literals.
+*/
+
+/**
+ * @brief Most bytes pack_compress makes out of n bytes
+ */
+int pack_bound(int n)
+{
+  return n + n / 255 + 16;
+}
+
+/**
+ * @brief Hash the 4 bytes at p for the match finder of pack_compress
+ */
+unsigned int pack_hash(const unsigned char *p)
+{
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - ED9T_PACK_HASH_BITS);
+}
+
+/**
+ * @brief Write the bytes of a length past the 15 of its nibble
+ */
+unsigned char *pack_length(unsigned char *out, int len)
+{
+  while (len >= 255)
+  {
+    *out++ = 255;
+    len -= 255;
+  }
+  *out++ = len;
+  return out;
+}
+
+/**
+ * @brief Write a sequence, a match of 0 bytes for the last one
+ */
+unsigned char *pack_sequence(unsigned char *out, const unsigned char *lit,
+                             int litlen, int offset, int matchlen)
+{
+  int ml = matchlen ? matchlen - 4 : 0;
+  *out++ = (litlen < 15 ? litlen : 15) << 4 | (ml < 15 ? ml : 15);
+  if (litlen >= 15)
+  {
+    out = pack_length(out, litlen - 15);
+  }
+  memcpy(out, lit, litlen);
+  out += litlen;
+  if (matchlen)
+  {
+    *out++ = offset & 255;
+    *out++ = offset >> 8;
+    if (ml >= 15)
+    {
+      out = pack_length(out, ml - 15);
+    }
+  }
+  return out;
+}
+
+/**
+ * @brief Compress n bytes of src into a block
+ *
+ * Matches are found through a table of the last position of every hash of
+ * 4 bytes, and only looked for up to 12 bytes before the end.
+ *
+ * @param dst room for pack_bound(n) bytes
+ * @return int length of the block
+ */
+int pack_compress(const char *src, int n, char *dst)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *end = in + n;
+  const unsigned char *limit = n > 12 ? end - 12 : in;
+  const unsigned char *anchor = in;
+  const unsigned char *p = in;
+  unsigned char *out = (unsigned char *)dst;
+  int table[1 << ED9T_PACK_HASH_BITS];
+  memset(table, -1, sizeof(table));
+
+  while (p < limit)
+  {
+    unsigned int h = pack_hash(p);
+    int cand = table[h];
+    table[h] = p - in;
+    if (cand < 0 || p - in - cand > 65535 || memcmp(in + cand, p, 4) != 0)
+    {
+      p++;
+      continue;
+    }
+    const unsigned char *m = in + cand;
+    int len = 4;
+    while (p + len < end - 5 && m[len] == p[len])
+    {
+      len++;
+    }
+    out = pack_sequence(out, anchor, p - anchor, p - m, len);
+    p += len;
+    anchor = p;
+  }
+  out = pack_sequence(out, anchor, end - anchor, 0, 0);
+  return out - (unsigned char *)dst;
+}
+
+/**
+ * @brief Read the bytes of a length past the 15 of its nibble
+ *
+ * @return int the length, or -1 if the block ends first
+ */
+int pack_read_length(const unsigned char **in, const unsigned char *end,
+                     int len)
+{
+  int b;
+  do
+  {
+    if (*in >= end)
+    {
+      return -1;
+    }
+    b = *(*in)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+/**
+ * @brief Unpack a block of at most len bytes into the n bytes it was made of
+ *
+ * @return int 0, or -1 if the block is broken
+ */
+int pack_decompress(const char *src, int len, char *dst, int n)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *iend = in + len;
+  char *out = dst;
+  char *oend = dst + n;
+  while (in < iend)
+  {
+    int token = *in++;
+    int lit = token >> 4;
+    if (lit == 15 && (lit = pack_read_length(&in, iend, lit)) == -1)
+    {
+      return -1;
+    }
+    if (lit > iend - in || lit > oend - out)
+    {
+      return -1;
+    }
+    memcpy(out, in, lit);
+    in += lit;
+    out += lit;
+    /* the last sequence fills the output, and has no match */
+    if (out == oend)
+    {
+      return 0;
+    }
+
+    if (iend - in < 2)
+    {
+      return -1;
+    }
+    int offset = in[0] | in[1] << 8;
+    in += 2;
+    int ml = token & 15;
+    if (ml == 15 && (ml = pack_read_length(&in, iend, ml)) == -1)
+    {
+      return -1;
+    }
+    ml += 4;
+    if (offset == 0 || offset > out - dst || ml > oend - out)
+    {
+      return -1;
+    }
+    const char *m = out - offset;
+    if (offset >= ml)
+    {
+      memcpy(out, m, ml);
+      out += ml;
+    }
+    else
+    {
+      /* the match overlaps what it writes, a run of a short pattern */
+      while (ml--)
+      {
+        *out++ = *m++;
+      }
+    }
+  }
+  return out == oend ? 0 : -1;
+}
+
+/**
+ * @brief Get the text of a span, unpacking it if it is packed
+ *
+ * The text of a packed span is kept in the cache until ED9T_PACK_CACHE
+ * other spans have been unpacked after it was last asked for. Only the
+ * main thread may ask for the text of a packed span, the threads counting
+ * matches are only handed the other spans, see editor_search_batch.
+ *
+ * @return char* the lines of the span, joined by their newlines
+ */
+char *editor_span_chars(EditorRow *span)
+{
+  if (!(span->flags & ROW_PACKED))
+  {
+    return span->chars;
+  }
+  EditorPackCache *victim = &E.pack_cache[0];
+  int i;
+  for (i = 0; i < ED9T_PACK_CACHE; i++)
+  {
+    EditorPackCache *c = &E.pack_cache[i];
+    if (c->span == span)
+    {
+      c->used = ++E.pack_clock;
+      return c->text;
+    }
+    if (c->used < victim->used)
+    {
+      victim = c;
+    }
+  }
+
+  long long start = perf_start();
+  if (victim->cap < span->size + 1)
+  {
+    free(victim->text);
+    victim->cap = span->size + 1;
+    victim->text = malloc(victim->cap);
+    if (victim->text == NULL)
+    {
+      die("malloc");
+    }
+  }
+  if (pack_decompress(span->chars, span->ccap, victim->text, span->size) == -1)
+  {
+    die("pack_decompress");
+  }
+  victim->text[span->size] = '\0';
+  victim->span = span;
+  victim->used = ++E.pack_clock;
+  perf_stop(PERF_PACK, start, span->lines);
+  return victim->text;
+}
+
+/**
+ * @brief Drop the cached text of a packed span that is being freed
+ *
+ * The text itself stays in the cache, to be written over by the next span
+ * unpacked.
+ */
+void editor_pack_forget(EditorRow *span)
+{
+  int i;
+  for (i = 0; i < ED9T_PACK_CACHE; i++)
+  {
+    if (E.pack_cache[i].span == span)
+    {
+      E.pack_cache[i].span = NULL;
+      E.pack_cache[i].used = 0;
+    }
+  }
+}
+
+/**
+ * @brief Pack a run of edited rows into a packed span
+ */
+void editor_pack_run(EditorSpanRun *run)
+{
+  if (run->size > E.pack_text_size)
+  {
+    E.pack_text = realloc(E.pack_text, run->size);
+    E.pack_block = realloc(E.pack_block, pack_bound(run->size));
+    if (E.pack_text == NULL || E.pack_block == NULL)
+    {
+      die("realloc");
+    }
+    E.pack_text_size = run->size;
+  }
+
+  long long start = perf_start();
+  EditorRow *a, *b;
+  EditorRow **nodes = editor_span_cut(run, &a, &b);
+  char *p = E.pack_text;
+  int i;
+  for (i = 0; i < run->nodes; i++)
+  {
+    if (i > 0)
+    {
+      *p++ = '\n';
+    }
+    memcpy(p, nodes[i]->chars, nodes[i]->size);
+    p += nodes[i]->size;
+    if (!(nodes[i]->flags & ROW_SPAN))
+    {
+      E.span_rows--;
+    }
+    editor_free_row(nodes[i]);
+    row_tree_free(nodes[i]);
+  }
+  free(nodes);
+  int len = pack_compress(E.pack_text, run->size, E.pack_block);
+
+  EditorRow *span = editor_span_new(NULL, run->size, run->lines);
+  span->flags = ROW_SPAN | ROW_PACKED;
+  span->chars = malloc(len);
+  if (span->chars == NULL)
+  {
+    die("malloc");
+  }
+  memcpy(span->chars, E.pack_block, len);
+  span->ccap = len;
+  editor_span_join(a, span, b);
+
+  /* rows inserted rather than loaded out of a span were never counted */
+  if (E.span_rows < 0)
+  {
+    E.span_rows = 0;
+  }
+  perf_stop(PERF_PACK, start, run->lines);
+}
+
+/**
+ * @brief Check whether a node can go in a span packed by editor_pack_reclaim
+ */
+int editor_pack_packable(EditorRow *row, int at, int lo, int hi)
+{
+  if ((at + row->lines > lo && at < hi) || row == E.search.row ||
+      row == E.search.hl_row || row == E.search.scan_row)
+  {
+    return 0;
+  }
+  if (!(row->flags & ROW_MAPPED))
+  {
+    return !(row->flags & ROW_SPAN);
+  }
+  if (row->flags & ROW_SPAN)
+  {
+    return row->size < ED9T_PACK_BYTES &&
+           memchr(row->chars, '\r', row->size) == NULL;
+  }
+  return row->chars + row->size == E.map + E.maplen ||
+         row->chars[row->size] != '\r';
+}
+
+/**
+ * @brief Pack the runs of edited rows before line end, outside lines lo to
+ * hi
+ *
+ * A run starts and ends with an edited row and takes in the unedited lines
+ * between them. It is cut into spans of about ED9T_PACK_BYTES, and each is
+ * only packed if its nodes hold ED9T_PACK_MIN bytes of the heap.
+ */
+void editor_pack_reclaim(int lo, int hi, int end)
+{
+  if (!ED9T_PACK)
+  {
+    return;
+  }
+  EditorSpanRun *runs = NULL;
+  int nruns = 0;
+  int cap = 0;
+  EditorSpanRun run = {0, 0, 0, NULL, 0};
+  /* the run up to its last edited row, and the heap held by each */
+  EditorSpanRun kept = run;
+  long long held = 0;
+  long long kept_held = 0;
+
+  int at = 0;
+  EditorRow *row = row_tree_first();
+  while (1)
+  {
+    if (at >= end)
+    {
+      row = NULL;
+    }
+    int pack = row && editor_pack_packable(row, at, lo, hi);
+    if (run.nodes > 0 &&
+        (!pack || run.size + row->size + 1 > ED9T_PACK_BYTES))
+    {
+      if (kept.nodes > 0 && kept_held >= ED9T_PACK_MIN)
+      {
+        if (nruns == cap)
+        {
+          cap = cap ? cap * 2 : 64;
+          runs = realloc(runs, sizeof(EditorSpanRun) * cap);
+          if (runs == NULL)
+          {
+            die("realloc");
+          }
+        }
+        runs[nruns++] = kept;
+      }
+      run.nodes = 0;
+      kept.nodes = 0;
+    }
+    if (row == NULL)
+    {
+      break;
+    }
+
+    int edited = !(row->flags & ROW_MAPPED);
+    if (pack && (edited || run.nodes > 0))
+    {
+      if (run.nodes == 0)
+      {
+        run.at = at;
+        run.lines = 0;
+        /* no newline before the first line */
+        run.size = -1;
+        held = 0;
+      }
+      run.nodes++;
+      run.lines += row->lines;
+      run.size += row->size + 1;
+      held += sizeof(EditorRow) + row->ccap;
+      if (edited)
+      {
+        kept = run;
+        kept_held = held;
+      }
+    }
+    at += row->lines;
+    row = row_tree_next(row);
+  }
+
+  /* from the last run back, so the line numbers of the others stay valid */
+  while (nruns > 0)
+  {
+    editor_pack_run(&runs[--nruns]);
+  }
+  free(runs);
+}
+
+/**
+ * @brief Unpack a packed span back into rows, and get one of them
+ *
+ * The node of the span is reused for its first line, so a span pointer
+ * keeps its first line as with editor_span_take.
+ *
+ * @param span the packed span
+ * @param off position of the line wanted in the span
+ * @return EditorRow* the row of the line
+ */
+EditorRow *editor_pack_take(EditorRow *span, int off)
+{
+  const char *text = editor_span_chars(span);
+  const char *end = text + span->size;
+  int lines = span->lines;
+  EditorRow *a, *mid, *b;
+  row_tree_split(E.rowroot, editor_row_index(span), &a, &b);
+  row_tree_split(b, lines, &mid, &b);
+  /* the text stays in the cache after this, until the next span is unpacked */
+  editor_pack_forget(span);
+  free(span->chars);
+
+  EditorRow *want = NULL;
+  const char *p = text;
+  int i;
+  mid = NULL;
+  for (i = 0; i < lines; i++)
+  {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *eol = nl ? nl : end;
+    EditorRow *row = i == 0 ? span : row_tree_alloc();
+    row->size = eol - p;
+    row->flags = 0;
+    row->chars = slab_alloc(row->size + 1, &row->ccap);
+    memcpy(row->chars, p, row->size);
+    row->chars[row->size] = '\0';
+    row->rsize = 0;
+    row->render = NULL;
+    row->colmap = NULL;
+    row->segs = NULL;
+    row->hl = NULL;
+    row->rcap = 0;
+    row->hl_open_comment = 0;
+    row->lines = 1;
+    row->left = row->right = row->parent = NULL;
+    row->count = 1;
+    row->prio = row_tree_random();
+    mid = row_tree_merge(mid, row);
+    if (i == off)
+    {
+      want = row;
+    }
+    p = eol + 1;
+  }
+  E.rowroot = row_tree_merge(row_tree_merge(a, mid), b);
+  E.rowroot->parent = NULL;
+  E.span_rows += lines;
+  return want;
+}
+
+/*** EDITOR OPERATIONS ***/
+
+/**
+ * @brief Read the rest of a file still being loaded before text goes below
+ * its last line, which is the end of the file and not of the rows loaded
+ * so far, keeping the cursor below the last line
+ */
+void editor_load_to_cursor()
+{
+  if (E.load && E.cy == E.numrows)
+  {
+    editor_load_finish();
+    E.cy = E.numrows;
+  }
+}
+
+void editor_insert_char(int c)
+{
+  editor_load_to_cursor();
+  if (E.cy == E.numrows)
+  {
+    editor_insert_row(E.numrows, "", 0);
+  }
+  editor_row_insert_char(editor_row_at(E.cy), E.cx, c);
+  E.cx++;
+}
+
+/**
+ * @brief Insert text at the cursor, leaving the cursor after it
+ *
+ * Text with newlines is inserted as a whole: the lines after the first are
+ * built as new rows and spliced into the row tree at once, and the comment
+ * states of the changed range are computed in a single pass.
+ *
+ * @param s the text, lines separated by \n
+ * @param len length of the text
+ */
+void editor_insert_text(const char *s, int len)
+{
+  editor_load_to_cursor();
+  if (E.cy == E.numrows)
+  {
+    editor_insert_row(E.numrows, "", 0);
+  }
+  EditorRow *row = editor_row_at(E.cy);
+  const char *nl = memchr(s, '\n', len);
+  if (nl == NULL)
+  {
+    editor_row_insert_string(row, E.cx, s, len);
+    E.cx += len;
+    return;
+  }
+
+  /* the new rows, the last one ends with the text after the cursor */
+  int n;
+  EditorRow *rows = editor_rows_from_text(nl + 1, s + len - nl - 1, &n);
+  EditorRow *last = &rows[n - 1];
+  int lastlen = last->size;
+  int taillen = row->size - E.cx;
+  last->chars = slab_grow(last->chars, &last->ccap, last->size,
+                          last->size + taillen + 1);
+  memcpy(last->chars + last->size, row->chars + E.cx, taillen);
+  last->size += taillen;
+  last->chars[last->size] = '\0';
+
+  /* the current row keeps the text before the cursor and the first line */
+  editor_undo_record(UNDO_DELETE, E.cy, E.cx, row->chars + E.cx, taillen);
+  editor_undo_record(UNDO_INSERT, E.cy, E.cx, s, nl - s);
+  editor_row_make_writable(row);
+  row->chars = slab_grow(row->chars, &row->ccap, E.cx, E.cx + (nl - s) + 1);
+  memcpy(row->chars + E.cx, s, nl - s);
+  row->size = E.cx + (nl - s);
+  row->chars[row->size] = '\0';
+  editor_row_segments_edit(row, E.cx, taillen, nl - s);
+  editor_row_drop_render(row);
+
+  editor_insert_rows(E.cy + 1, rows, n);
+  editor_syntax_rows_changed(E.cy, n + 1, n);
+  E.cy += n;
+  E.cx = lastlen;
+}
+
+void editor_insert_newline()
+{
+  editor_load_to_cursor();
+  if (E.cx == 0)
+  {
+    editor_insert_row(E.cy, "", 0);
+  }
+  else
+  {
+    /* row nodes never move, so row stays valid across the insert */
+    EditorRow *row = editor_row_at(E.cy);
+    editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    editor_row_del_chars(row, E.cx, row->size - E.cx);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editor_del_char()
+{
+  if (E.cy == E.numrows)
+  {
+    return;
+  }
+  if (E.cx == 0 && E.cy == 0)
+  {
+    return;
+  }
+
+  EditorRow *row = editor_row_at(E.cy);
+
+  if (E.cx > 0)
+  {
+    editor_row_del_char(row, E.cx - 1);
+    E.cx--;
+  }
+  else
+  {
+    EditorRow *prev = editor_row_prev(row);
+    E.cx = prev->size;
+    editor_row_append_string(prev, row->chars, row->size);
+    editor_del_row(E.cy);
+    E.cy--;
+  }
+}
+
+/*** FILE I/O ***/
+
+/**
+ * @brief Count the newlines in a piece of the mapping
+ *
+ * With SSE2 the text is compared 64 bytes at a time and the bits of the
+ * match masks are counted, otherwise memchr finds each newline.
+ *
+ * @param p start of the text
+ * @param end end of the text
+ * @return int number of newlines
+ */
+int editor_count_newlines(const char *p, const char *end)
+{
+  int n = 0;
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  while (end - p >= 64)
+  {
+    const __m128i *v = (const __m128i *)p;
+    unsigned long long mask =
+        (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(v), nl)) |
+        (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(v + 1), nl)) << 16 |
+        (unsigned long long)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(v + 2), nl)) << 32 |
+        (unsigned long long)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(v + 3), nl)) << 48;
+    n += __builtin_popcountll(mask);
+    p += 64;
+  }
+#endif
+  while (p < end)
+  {
+    const char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL)
+    {
+      break;
+    }
+    n++;
+    p = nl + 1;
+  }
+  return n;
+}
+
+/**
+ * @brief Split a mapping into chunks for the indexing threads
+ *
+ * Every chunk but the first starts just after a newline, so a line is never
+ * split between two chunks. Small files get a single chunk.
+ *
+ * @param map the mapping
+ * @param len size of the mapping
+ * @param chunks ED9T_INDEX_THREADS chunks to fill in
+ * @return int number of chunks used
+ */
+int editor_index_split(char *map, size_t len, EditorIndexChunk *chunks)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t n = len / ED9T_INDEX_CHUNK;
+  if (cpus > 0 && n > (size_t)cpus)
+  {
+    n = cpus;
+  }
+  if (n > ED9T_INDEX_THREADS)
+  {
+    n = ED9T_INDEX_THREADS;
+  }
+  if (n < 1)
+  {
+    n = 1;
+  }
+
+  char *end = map + len;
+  char *p = map;
+  int used = 0;
+  for (size_t i = 0; i < n && p < end; i++)
+  {
+    char *next = end;
+    if (i + 1 < n)
+    {
+      char *cut = map + len / n * (i + 1);
+      if (cut <= p)
+      {
+        /* the line before took in the whole chunk */
+        continue;
+      }
+      char *nl = memchr(cut - 1, '\n', end - cut + 1);
+      next = nl ? nl + 1 : end;
+    }
+    EditorIndexChunk *c = &chunks[used++];
+    c->start = p;
+    c->end = next;
+    c->lines = 0;
+    c->first = 0;
+    c->rows = NULL;
+    c->nrows = 0;
+    p = next;
+  }
+  return used;
+}
+
+/**
+ * @brief Run a pass over the chunks of a mapping, a thread per chunk
+ *
+ * The first chunk is handled on the calling thread.
+ *
+ * @param chunks the chunks
+ * @param n number of chunks
+ * @param pass function run on each chunk
+ */
+void editor_index_run(EditorIndexChunk *chunks, int n, void *(*pass)(void *))
+{
+  for (int i = 1; i < n; i++)
+  {
+    if (pthread_create(&chunks[i].thread, NULL, pass, &chunks[i]) != 0)
+    {
+      die("pthread_create");
+    }
+  }
+  pass(&chunks[0]);
+  for (int i = 1; i < n; i++)
+  {
+    pthread_join(chunks[i].thread, NULL);
+  }
+}
+
+/**
+ * @brief Count the lines of a chunk, the last line of the file may have no
+ * newline
+ */
+void *editor_index_count(void *arg)
+{
+  EditorIndexChunk *c = arg;
+  c->lines = editor_count_newlines(c->start, c->end);
+  if (c->end > c->start && c->end[-1] != '\n')
+  {
+    c->lines++;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Fill in the rows of a chunk, at the place its line count left
+ * for them in the row array
+ *
+ * A chunk without a place gets an array of its own, grown as its lines are
+ * found, so a file indexed as one chunk is only scanned once.
+ */
+void *editor_index_rows(void *arg)
+{
+  EditorIndexChunk *c = arg;
+  int cap = c->rows ? c->lines : 1024;
+  if (c->rows == NULL && (c->rows = malloc(sizeof(EditorRow) * cap)) == NULL)
+  {
+    die("malloc");
+  }
+
+  int n = 0;
+  char *p = c->start;
+  char *end = c->end;
+  while (p < end)
+  {
+    char *nl = memchr(p, '\n', end - p);
+    char *eol = nl ? nl : end;
+    while (eol > p && eol[-1] == '\r')
+    {
+      eol--;
+    }
+
+    if (n == cap)
+    {
+      cap *= 2;
+      c->rows = realloc(c->rows, sizeof(EditorRow) * cap);
+      if (c->rows == NULL)
+      {
+        die("realloc");
+      }
+    }
+    EditorRow *row = &c->rows[n++];
+    row->size = eol - p;
+    row->flags = ROW_MAPPED;
+    row->chars = p;
+    row->ccap = 0;
+    row->rsize = 0;
+    row->render = NULL;
+    row->colmap = NULL;
+    row->segs = NULL;
+    row->hl = NULL;
+    row->rcap = 0;
+    row->hl_open_comment = 0;
+    row->lines = 1;
+
+    p = nl ? nl + 1 : end;
+  }
+  c->lines = n;
+  return NULL;
+}
+
+/**
+ * @brief Cut a chunk into spans of up to ED9T_SPAN_LINES lines, counting
+ * its lines on the way
+ */
+void *editor_index_spans(void *arg)
+{
+  EditorIndexChunk *c = arg;
+  int cap = 64;
+  c->rows = malloc(sizeof(EditorRow) * cap);
+  if (c->rows == NULL)
+  {
+    die("malloc");
+  }
+
+  char *p = c->start;
+  char *end = c->end;
+  while (p < end)
+  {
+    char *start = p;
+    char *last = p;
+    int lines = 0;
+    while (p < end && lines < ED9T_SPAN_LINES && p - start < ED9T_SPAN_BYTES)
+    {
+      char *nl = memchr(p, '\n', end - p);
+      last = nl ? nl : end;
+      p = nl ? nl + 1 : end;
+      lines++;
+    }
+
+    if (c->nrows == cap)
+    {
+      cap *= 2;
+      c->rows = realloc(c->rows, sizeof(EditorRow) * cap);
+      if (c->rows == NULL)
+      {
+        die("realloc");
+      }
+    }
+    EditorRow *span = &c->rows[c->nrows++];
+    span->size = last - start;
+    span->flags = ROW_MAPPED | ROW_SPAN;
+    span->chars = start;
+    span->ccap = 0;
+    span->rsize = 0;
+    span->render = NULL;
+    span->colmap = NULL;
+    span->segs = NULL;
+    span->hl = NULL;
+    span->rcap = 0;
+    span->hl_open_comment = 0;
+    span->lines = lines;
+    c->lines += lines;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Load the rows of a file by mapping it into memory
+ *
+ * The mapping is split into chunks whose newlines are counted in parallel,
+ * the counts are summed up into the place of each chunk in one row array,
+ * and a second parallel pass fills in the rows. A file too small to split
+ * is scanned once on this thread. No memory is allocated per
+ * line for the text. Every row is left pointing into the mapping and only
+ * the rows that get edited are copied out by editor_row_make_writable.
+ *
+ * @param fd descriptor of the opened file
+ * @param len size of the file in bytes
+ * @return int 0 if successful, -1 if the file could not be mapped
+ */
+int editor_open_mapped(int fd, size_t len)
+{
+  char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    return -1;
+  }
+
+  EditorIndexChunk chunks[ED9T_INDEX_THREADS];
+  int nchunks = editor_index_split(map, len, chunks);
+  EditorRow *rows;
+  int n = 0;
+  if (nchunks == 1)
+  {
+    editor_index_rows(&chunks[0]);
+    n = chunks[0].lines;
+    rows = realloc(chunks[0].rows, sizeof(EditorRow) * n);
+  }
+  else
+  {
+    editor_index_run(chunks, nchunks, editor_index_count);
+    for (int i = 0; i < nchunks; i++)
+    {
+      chunks[i].first = n;
+      n += chunks[i].lines;
+    }
+    rows = malloc(sizeof(EditorRow) * n);
+    if (rows == NULL)
+    {
+      die("malloc");
+    }
+    for (int i = 0; i < nchunks; i++)
+    {
+      chunks[i].rows = rows + chunks[i].first;
+    }
+    editor_index_run(chunks, nchunks, editor_index_rows);
+  }
+
+  E.map = map;
+  E.maplen = len;
+  E.mapfd = fd;
+  E.rowroot = row_tree_build(rows, n, 0);
+  E.numrows = n;
+  return 0;
+}
+
+/**
+ * @brief Join the spans of indexed chunks into one array, in order
+ *
+ * @param chunks the chunks, their arrays are freed
+ * @param n number of chunks
+ * @param nspans set to the number of spans
+ * @param lines set to the number of lines
+ * @return EditorRow* the spans
+ */
+EditorRow *editor_index_join(EditorIndexChunk *chunks, int n, int *nspans,
+                             int *lines)
+{
+  int total = 0;
+  *lines = 0;
+  for (int i = 0; i < n; i++)
+  {
+    total += chunks[i].nrows;
+    *lines += chunks[i].lines;
+  }
+  EditorRow *spans = malloc(sizeof(EditorRow) * (total ? total : 1));
+  if (spans == NULL)
+  {
+    die("malloc");
+  }
+  total = 0;
+  for (int i = 0; i < n; i++)
+  {
+    memcpy(spans + total, chunks[i].rows, sizeof(EditorRow) * chunks[i].nrows);
+    total += chunks[i].nrows;
+    free(chunks[i].rows);
+  }
+  *nspans = total;
+  return spans;
+}
+
+/**
+ * @brief Index the rest of a large file in pieces of ED9T_LOAD_PIECE bytes,
+ * each by a thread per chunk, and queue the spans of every piece for the
+ * main thread to join
+ *
+ * Only the mapping is read here, the rows are only ever touched by the main
+ * thread, in editor_load_step.
+ */
+void *editor_load_reader(void *arg)
+{
+  EditorLoad *l = arg;
+  char *p = l->start;
+  while (p < l->end)
+  {
+    char *next = l->end;
+    if (l->end - p > ED9T_LOAD_PIECE)
+    {
+      char *nl = memchr(p + ED9T_LOAD_PIECE - 1, '\n',
+                        l->end - p - ED9T_LOAD_PIECE + 1);
+      next = nl ? nl + 1 : l->end;
+    }
+    EditorIndexChunk chunks[ED9T_INDEX_THREADS];
+    int nchunks = editor_index_split(p, next - p, chunks);
+    editor_index_run(chunks, nchunks, editor_index_spans);
+
+    EditorLoadPiece *piece = malloc(sizeof(EditorLoadPiece));
+    if (piece == NULL)
+    {
+      die("malloc");
+    }
+    piece->spans = editor_index_join(chunks, nchunks, &piece->nspans,
+                                     &piece->lines);
+    piece->bytes = next - p;
+    piece->next = NULL;
+    pthread_mutex_lock(&l->lock);
+    if (l->tail)
+    {
+      l->tail->next = piece;
+    }
+    else
+    {
+      l->head = piece;
+    }
+    l->tail = piece;
+    pthread_cond_signal(&l->ready);
+    pthread_mutex_unlock(&l->lock);
+    p = next;
+  }
+  pthread_mutex_lock(&l->lock);
+  l->done = 1;
+  pthread_cond_signal(&l->ready);
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
+
+/**
+ * @brief Join the pieces the reader has indexed to the end of the rows
+ *
+ * Text typed below the last line loaded has the whole file read first, in
+ * editor_load_to_cursor. Once the last piece is in the reader is let go.
+ *
+ * @return int 1 while the file is still being loaded, else 0
+ */
+int editor_load_step()
+{
+  EditorLoad *l = E.load;
+  if (l == NULL)
+  {
+    return 0;
+  }
+  pthread_mutex_lock(&l->lock);
+  EditorLoadPiece *piece = l->head;
+  l->head = l->tail = NULL;
+  int done = l->done;
+  pthread_mutex_unlock(&l->lock);
+
+  while (piece)
+  {
+    EditorRow *t = row_tree_build(piece->spans, piece->nspans, 0);
+    E.rowroot = row_tree_merge(E.rowroot, t);
+    if (E.rowroot)
+    {
+      E.rowroot->parent = NULL;
+    }
+    E.numrows += piece->lines;
+    l->loaded += piece->bytes;
+    EditorLoadPiece *next = piece->next;
+    free(piece);
+    piece = next;
+  }
+  if (!done)
+  {
+    return 1;
+  }
+  pthread_join(l->thread, NULL);
+  pthread_cond_destroy(&l->ready);
+  pthread_mutex_destroy(&l->lock);
+  madvise(E.map, E.maplen, MADV_RANDOM);
+  free(l);
+  E.load = NULL;
+  return 0;
+}
+
+/**
+ * @brief Wait for the reader to load the rest of the file, for what needs
+ * every row of it
+ */
+void editor_load_finish()
+{
+  while (E.load)
+  {
+    EditorLoad *l = E.load;
+    pthread_mutex_lock(&l->lock);
+    while (l->head == NULL && !l->done)
+    {
+      pthread_cond_wait(&l->ready, &l->lock);
+    }
+    pthread_mutex_unlock(&l->lock);
+    editor_load_step();
+  }
+}
+
+/**
+ * @brief Load a large file as spans of its mapping
+ *
+ * Only the lines of the first screen are indexed here, so the file shows
+ * in the same time whatever its size. The rest is cut into spans of up to
+ * ED9T_SPAN_LINES lines by the reader (see editor_load_reader), while the
+ * lines already in can be scrolled and searched, and editor_load_step joins
+ * them to the rows as they come. Rows get loaded out of the spans as they
+ * are looked up.
+ *
+ * @param fd descriptor of the opened file
+ * @param len size of the file in bytes
+ * @return int 0 if successful, -1 if the file could not be mapped
+ */
+int editor_open_large(int fd, size_t len)
+{
+  char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    return -1;
+  }
+  madvise(map, len, MADV_SEQUENTIAL);
+
+  char *end = map + len;
+  char *first = end;
+  if (ED9T_LOAD_ASYNC)
+  {
+    first = map;
+    for (int i = 0; i < E.screenrows && first < end; i++)
+    {
+      char *nl = memchr(first, '\n', end - first);
+      first = nl ? nl + 1 : end;
+    }
+  }
+  EditorIndexChunk chunks[ED9T_INDEX_THREADS];
+  int nchunks = editor_index_split(map, first - map, chunks);
+  editor_index_run(chunks, nchunks, editor_index_spans);
+  int n, numrows;
+  EditorRow *spans = editor_index_join(chunks, nchunks, &n, &numrows);
+
+  E.map = map;
+  E.maplen = len;
+  E.mapfd = fd;
+  E.rowroot = row_tree_build(spans, n, 0);
+  E.numrows = numrows;
+  E.large = 1;
+  E.span_rows = 0;
+  E.span_limit = ED9T_LARGE_ROWS;
+  if (first == end)
+  {
+    madvise(map, len, MADV_RANDOM);
+    return 0;
+  }
+
+  EditorLoad *l = calloc(1, sizeof(EditorLoad));
+  if (l == NULL)
+  {
+    die("calloc");
+  }
+  l->start = first;
+  l->end = end;
+  l->loaded = first - map;
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->ready, NULL);
+  if (pthread_create(&l->thread, NULL, editor_load_reader, l) != 0)
+  {
+    die("pthread_create");
+  }
+  E.load = l;
+  return 0;
+}
+
+/**
+ * @brief Read a file that can't be mapped line by line, closing fd
+ */
+void editor_open_stream(int fd)
+{
+  FILE *fp = fdopen(fd, "r");
+  if (!fp)
+  {
+    die("fdopen");
+  }
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  {
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                           line[linelen - 1] == '\r'))
+    {
+      linelen--;
+    }
+    editor_insert_row(E.numrows, line, linelen);
+  }
+  free(line);
+  fclose(fp);
+}
+
+/**
+ * @brief Load the rows of an opened file into the buffer shown, which has
+ * none
+ *
+ * Regular files are memory mapped by editor_open_mapped, or by
+ * editor_open_large from ED9T_LARGE_FILE bytes on. Anything that can't be
+ * mapped (empty files, pipes) is read line by line. The descriptor of a
+ * mapped file stays open for editor_save, any other is closed.
+ *
+ * @param fd descriptor of the file
+ * @param st the file, as fstat found it
+ */
+void editor_open_fd(int fd, struct stat *st)
+{
+  int mappable = S_ISREG(st->st_mode) && st->st_size > 0;
+  if (mappable && st->st_size >= ED9T_LARGE_FILE &&
+      editor_open_large(fd, st->st_size) == 0)
+  {
+    /* highlighting would need every row above the screen */
+    E.syntax = NULL;
+  }
+  else if (!mappable || editor_open_mapped(fd, st->st_size) != 0)
+  {
+    editor_open_stream(fd);
+  }
+}
+
+/**
+ * @brief Open a file in the editor
+ *
+ * The rows are loaded by editor_open_fd, then the edits of a journal left
+ * behind by a crash are replayed and the file is watched for changes.
+ *
+ * @param filename name of the file to open
+ */
+void editor_open(char *filename)
+{
+  long long start = perf_start();
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editor_select_syntax_highlight();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+  {
+    die("open");
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+  {
+    memset(&st, 0, sizeof(st));
+  }
+  editor_open_fd(fd, &st);
+  E.dirty = 0;
+  editor_undo_reset();
+  perf_stop(PERF_OPEN, start, S_ISREG(st.st_mode) ? st.st_size : 0);
+  editor_journal_open(&st);
+  editor_watch_open(&st);
+}
+
+/**
+ * @brief Write out iovecs collected by editor_write_rows, retrying on short
+ * writes
+ *
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int editor_write_iov(int fd, struct iovec *iov, int niov)
+{
+  while (niov > 0)
+  {
+    ssize_t n = writev(fd, iov, niov);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    while (niov > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Copy a byte range of the mapped file to fd
+ *
+ * The copy is done by the kernel with copy_file_range, so the data never
+ * passes through user space. Filesystems that can't do that get a plain
+ * write straight out of the mapping instead.
+ *
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int editor_copy_mapped(int fd, size_t off, size_t len)
+{
+  loff_t inoff = off;
+  while (len > 0)
+  {
+    ssize_t n = copy_file_range(E.mapfd, &inoff, fd, NULL, len, 0);
+    if (n == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      if (n == -1 && errno != ENOSYS && errno != EXDEV &&
+          errno != EINVAL && errno != EOPNOTSUPP)
+      {
+        return -1;
+      }
+      struct iovec iov = {E.map + inoff, len};
+      return editor_write_iov(fd, &iov, 1);
+    }
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Stream every row to fd, each followed by a newline
+ *
+ * Rows are handed to writev in batches of up to ED9T_SAVE_IOV iovecs
+ * pointing at the row text, so no copy of the buffer is built. Runs of
+ * unedited rows that still lie back to back in the file mapping are copied
+ * as a single span by editor_copy_mapped.
+ *
+ * @param fd file to write to
+ * @param written set to the number of bytes written
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int editor_write_rows(int fd, long long *written)
+{
+  static char newline[] = "\n";
+  struct iovec iov[ED9T_SAVE_IOV];
+  int niov = 0;
+  char *mapend = E.map + E.maplen;
+
+  *written = 0;
+  /* spans are written as they are, like runs of unedited rows */
+  EditorRow *row = row_tree_first();
+  while (row)
+  {
+    if (row->flags & ROW_MAPPED)
+    {
+      char *start = row->chars;
+      char *end = start;
+      while (row && (row->flags & ROW_MAPPED) && row->chars == end &&
+             row->chars + row->size < mapend && row->chars[row->size] == '\n')
+      {
+        end = row->chars + row->size + 1;
+        row = row_tree_next(row);
+      }
+      if (end > start)
+      {
+        if (editor_write_iov(fd, iov, niov) == -1 ||
+            editor_copy_mapped(fd, start - E.map, end - start) == -1)
+        {
+          return -1;
+        }
+        niov = 0;
+        *written += end - start;
+        continue;
+      }
+    }
+
+    /* the text of a packed span only lasts until the next one is unpacked */
+    int packed = row->flags & ROW_PACKED;
+    if (niov + 2 > ED9T_SAVE_IOV || (packed && niov > 0))
+    {
+      if (editor_write_iov(fd, iov, niov) == -1)
+      {
+        return -1;
+      }
+      niov = 0;
+    }
+    iov[niov].iov_base = editor_span_chars(row);
+    iov[niov].iov_len = row->size;
+    niov++;
+    iov[niov].iov_base = newline;
+    iov[niov].iov_len = 1;
+    niov++;
+    *written += row->size + 1;
+    row = row_tree_next(row);
+  }
+  return editor_write_iov(fd, iov, niov);
+}
+
+/**
+ * @brief Save the buffer to E.filename
+ *
+ * The rows are written to a temporary file in the same directory, which is
+ * synced and then renamed over the original, so a crash half way through
+ * never leaves a truncated file behind. The old file stays alive as long as
+ * it is mapped, which keeps the mapped rows valid after the rename.
+ */
+void editor_save()
+{
+  /* the rows not loaded yet would be left out */
+  editor_load_finish();
+  if (E.filename == NULL)
+  {
+    E.filename = editor_prompt("Save as: %s (ESC to cancel)", 0, NULL);
+    if (E.filename == NULL)
+    {
+      editor_set_status_message("Save aborted");
+      return;
+    }
+    editor_select_syntax_highlight();
+  }
+
+  /* write through symlinks rather than replacing them */
+  char target[PATH_MAX];
+  if (realpath(E.filename, target) == NULL)
+  {
+    snprintf(target, sizeof(target), "%s", E.filename);
+  }
+  char dir[PATH_MAX];
+  char base[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", target);
+  snprintf(base, sizeof(base), "%s", target);
+  /* dirname may return a static "." rather than cut dir */
+  char *dirpath = dirname(dir);
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", dirpath, basename(base));
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+  {
+    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  struct stat st;
+  mode_t mode;
+  if (stat(target, &st) == 0)
+  {
+    mode = st.st_mode & 07777;
+    /*
+    keep the owner of the file, when allowed to. this comes before the
+    mode, as a change of owner clears the setuid and setgid bits
+    */
+    if (fchown(fd, st.st_uid, st.st_gid) == -1 &&
+        fchown(fd, -1, st.st_gid) == -1)
+    {
+      /* best effort, else the file is owned by whoever saved it */
+    }
+  }
+  else
+  {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0644 & ~mask;
+  }
+
+  long long len;
+  if (fchmod(fd, mode) != -1 && editor_write_rows(fd, &len) != -1 &&
+      fsync(fd) != -1 && close(fd) != -1)
+  {
+    fd = -1;
+    if (rename(tmp, target) != -1)
+    {
+      int dirfd = open(dirpath, O_RDONLY);
+      if (dirfd != -1)
+      {
+        fsync(dirfd);
+        close(dirfd);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+      perf_add(PERF_SAVE, secs * 1e9, len);
+      E.dirty = 0;
+      if (stat(target, &st) == 0)
+      {
+        editor_journal_saved(&st);
+        editor_watch_open(&st);
+      }
+      if (secs > 0)
+      {
+        editor_set_status_message("%lld bytes written to disk (%.1f MB/s)",
+                                  len, len / secs / (1024 * 1024));
+      }
+      else
+      {
+        editor_set_status_message("%lld bytes written to disk", len);
+      }
+      return;
+    }
+  }
+  int err = errno;
+  if (fd != -1)
+  {
+    close(fd);
+  }
+  unlink(tmp);
+  editor_set_status_message("Can't save! I/O error: %s", strerror(err));
+}
+
+/*** REGEX ***/
+
+/*
+regexes for the find prompt: literal bytes, ., [] classes with ranges and
+^ negation, the \d \w \s classes and their negations, groups, |, * + ? and
+{m,n} repeats, and ^ and $ for the start and end of a line. a pattern is
+parsed into nodes and compiled into NFA instructions, which are run as a
+DFA whose states are only built once the text leads to them, and thrown
+away when they take more than ED9T_REGEX_DFA_BYTES. matches are
+leftmost-longest and never span lines. rows without the longest run of
+bytes that every match holds are passed over by regex_find_literal without
+running the DFA at all.
+*/
+
+int regex_set_has(const unsigned char *set, int c)
+{
+  return set[c >> 3] >> (c & 7) & 1;
+}
+
+void regex_set_add(unsigned char *set, int lo, int hi)
+{
+  int c;
+  for (c = lo; c <= hi; c++)
+  {
+    set[c >> 3] |= 1 << (c & 7);
+  }
+}
+
+/**
+ * @brief Add a node to the parse
+ *
+ * @return int index of the node
+ */
+int regex_node(EditorRegexParser *ps, int type, int a, int b)
+{
+  if (ps->nnodes == ps->nodecap)
+  {
+    ps->nodecap = ps->nodecap ? 2 * ps->nodecap : 64;
+    ps->nodes = realloc(ps->nodes, sizeof(EditorRegexNode) * ps->nodecap);
+    if (ps->nodes == NULL)
+    {
+      die("realloc");
+    }
+  }
+  EditorRegexNode *n = &ps->nodes[ps->nnodes];
+  n->type = type;
+  n->a = a;
+  n->b = b;
+  n->min = 0;
+  n->max = 0;
+  n->set = -1;
+  n->c = -1;
+  return ps->nnodes++;
+}
+
+/**
+ * @brief Add an empty byte set to the regex
+ *
+ * @return int index of the set
+ */
+int regex_new_set(EditorRegexParser *ps)
+{
+  EditorRegex *re = ps->re;
+  if (re->nsets == ps->setcap)
+  {
+    ps->setcap = ps->setcap ? 2 * ps->setcap : 16;
+    re->sets = realloc(re->sets, sizeof(re->sets[0]) * ps->setcap);
+    if (re->sets == NULL)
+    {
+      die("realloc");
+    }
+  }
+  memset(re->sets[re->nsets], 0, sizeof(re->sets[0]));
+  return re->nsets++;
+}
+
+/**
+ * @brief Make a node of a set, with its byte if it only holds one
+ */
+int regex_set_node(EditorRegexParser *ps, int set)
+{
+  int n = regex_node(ps, RE_NODE_SET, -1, -1);
+  int count = 0;
+  int c;
+  ps->nodes[n].set = set;
+  for (c = 0; c < 256; c++)
+  {
+    if (regex_set_has(ps->re->sets[set], c))
+    {
+      count++;
+      ps->nodes[n].c = c;
+    }
+  }
+  if (count != 1)
+  {
+    ps->nodes[n].c = -1;
+  }
+  return n;
+}
+
+/**
+ * @brief Parse the escape after a backslash, adding its bytes to set
+ *
+ * @return int the byte escaped, -1 for a class such as \d, -2 if the
+ * escape is bad
+ */
+int regex_parse_escape(EditorRegexParser *ps, unsigned char *set)
+{
+  int c = (unsigned char)*ps->p;
+  if (c == '\0')
+  {
+    ps->err = "trailing backslash";
+    return -2;
+  }
+  ps->p++;
+  unsigned char cls[32] = {0};
+  switch (c)
+  {
+  case 'd':
+  case 'D':
+    regex_set_add(cls, '0', '9');
+    break;
+  case 'w':
+  case 'W':
+    regex_set_add(cls, '0', '9');
+    regex_set_add(cls, 'A', 'Z');
+    regex_set_add(cls, 'a', 'z');
+    regex_set_add(cls, '_', '_');
+    break;
+  case 's':
+  case 'S':
+    regex_set_add(cls, '\t', '\r');
+    regex_set_add(cls, ' ', ' ');
+    break;
+  case 't':
+    regex_set_add(set, '\t', '\t');
+    return '\t';
+  default:
+    if (isalnum(c))
+    {
+      ps->err = "unknown escape";
+      return -2;
+    }
+    regex_set_add(set, c, c);
+    return c;
+  }
+  int i;
+  for (i = 0; i < 32; i++)
+  {
+    set[i] |= isupper(c) ? ~cls[i] : cls[i];
+  }
+  return -1;
+}
+
+/**
+ * @brief Parse a class, from just after its [
+ */
+int regex_parse_class(EditorRegexParser *ps)
+{
+  int set = regex_new_set(ps);
+  unsigned char *bits = ps->re->sets[set];
+  int negate = *ps->p == '^';
+  if (negate)
+  {
+    ps->p++;
+  }
+  /* a ] right at the start is a byte of the class */
+  const char *start = ps->p;
+  while (*ps->p && (*ps->p != ']' || ps->p == start))
+  {
+    int lo;
+    if (*ps->p == '\\')
+    {
+      ps->p++;
+      lo = regex_parse_escape(ps, bits);
+      if (lo == -2)
+      {
+        return -1;
+      }
+    }
+    else
+    {
+      lo = (unsigned char)*ps->p++;
+      regex_set_add(bits, lo, lo);
+    }
+    if (lo < 0 || ps->p[0] != '-' || ps->p[1] == ']' || ps->p[1] == '\0')
+    {
+      continue;
+    }
+    ps->p++;
+    int hi;
+    if (*ps->p == '\\')
+    {
+      ps->p++;
+      hi = regex_parse_escape(ps, bits);
+      if (hi == -2)
+      {
+        return -1;
+      }
+    }
+    else
+    {
+      hi = (unsigned char)*ps->p++;
+    }
+    if (hi < lo)
+    {
+      ps->err = "bad range";
+      return -1;
+    }
+    regex_set_add(bits, lo, hi);
+  }
+  if (*ps->p != ']')
+  {
+    ps->err = "missing ]";
+    return -1;
+  }
+  ps->p++;
+  if (negate)
+  {
+    int i;
+    for (i = 0; i < 32; i++)
+    {
+      bits[i] = ~bits[i];
+    }
+    bits['\n' >> 3] &= ~(1 << ('\n' & 7));
+  }
+  return regex_set_node(ps, set);
+}
+
+/**
+ * @brief Read a repeat count, anything over ED9T_REGEX_REPEAT is read as
+ * one more than it
+ */
+int regex_parse_count(const char **p)
+{
+  int n = 0;
+  while (isdigit((unsigned char)**p))
+  {
+    n = n * 10 + (*(*p)++ - '0');
+    if (n > ED9T_REGEX_REPEAT)
+    {
+      n = ED9T_REGEX_REPEAT + 1;
+    }
+  }
+  return n;
+}
+
+/**
+ * @brief Parse a {m}, {m,} or {m,n} bound
+ *
+ * @return int 1 if there was one, 0 if the { is a plain byte, -1 if the
+ * bound is bad
+ */
+int regex_parse_bounds(EditorRegexParser *ps, int *min, int *max)
+{
+  const char *p = ps->p + 1;
+  if (!isdigit((unsigned char)*p))
+  {
+    return 0;
+  }
+  int lo = regex_parse_count(&p);
+  int hi = lo;
+  if (*p == ',')
+  {
+    p++;
+    hi = isdigit((unsigned char)*p) ? regex_parse_count(&p) : -1;
+  }
+  if (*p != '}')
+  {
+    return 0;
+  }
+  if (lo > ED9T_REGEX_REPEAT || hi > ED9T_REGEX_REPEAT)
+  {
+    ps->err = "repeat count too large";
+    return -1;
+  }
+  if (hi != -1 && hi < lo)
+  {
+    ps->err = "bad repeat";
+    return -1;
+  }
+  ps->p = p + 1;
+  *min = lo;
+  *max = hi;
+  return 1;
+}
+
+int regex_parse_alt(EditorRegexParser *ps);
+
+int regex_parse_atom(EditorRegexParser *ps)
+{
+  int c = (unsigned char)*ps->p++;
+  int n, set;
+  switch (c)
+  {
+  case '(':
+    if (++ps->depth > ED9T_REGEX_DEPTH)
+    {
+      ps->err = "groups nested too deep";
+      return -1;
+    }
+    n = regex_parse_alt(ps);
+    ps->depth--;
+    if (n == -1)
+    {
+      return -1;
+    }
+    if (*ps->p != ')')
+    {
+      ps->err = "missing )";
+      return -1;
+    }
+    ps->p++;
+    return n;
+  case '[':
+    return regex_parse_class(ps);
+  case '.':
+    set = regex_new_set(ps);
+    regex_set_add(ps->re->sets[set], 0, '\n' - 1);
+    regex_set_add(ps->re->sets[set], '\n' + 1, 255);
+    return regex_set_node(ps, set);
+  case '^':
+    return regex_node(ps, RE_NODE_BOL, -1, -1);
+  case '$':
+    return regex_node(ps, RE_NODE_EOL, -1, -1);
+  case '*':
+  case '+':
+  case '?':
+    ps->err = "nothing to repeat";
+    return -1;
+  case '\\':
+    set = regex_new_set(ps);
+    if (regex_parse_escape(ps, ps->re->sets[set]) == -2)
+    {
+      return -1;
+    }
+    return regex_set_node(ps, set);
+  default:
+    set = regex_new_set(ps);
+    regex_set_add(ps->re->sets[set], c, c);
+    return regex_set_node(ps, set);
+  }
+}
+
+int regex_parse_repeat(EditorRegexParser *ps)
+{
+  int n = regex_parse_atom(ps);
+  while (n != -1)
+  {
+    int min, max;
+    if (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')
+    {
+      min = *ps->p == '+';
+      max = *ps->p == '?' ? 1 : -1;
+      ps->p++;
+    }
+    else if (*ps->p == '{')
+    {
+      int bounds = regex_parse_bounds(ps, &min, &max);
+      if (bounds == -1)
+      {
+        return -1;
+      }
+      if (bounds == 0)
+      {
+        break;
+      }
+    }
+    else
+    {
+      break;
+    }
+    n = regex_node(ps, RE_NODE_REPEAT, n, -1);
+    ps->nodes[n].min = min;
+    ps->nodes[n].max = max;
+  }
+  return n;
+}
+
+int regex_parse_cat(EditorRegexParser *ps)
+{
+  int n = regex_node(ps, RE_NODE_EMPTY, -1, -1);
+  while (*ps->p && *ps->p != '|' && *ps->p != ')')
+  {
+    int m = regex_parse_repeat(ps);
+    if (m == -1)
+    {
+      return -1;
+    }
+    n = regex_node(ps, RE_NODE_CAT, n, m);
+  }
+  return n;
+}
+
+int regex_parse_alt(EditorRegexParser *ps)
+{
+  int n = regex_parse_cat(ps);
+  while (n != -1 && *ps->p == '|')
+  {
+    ps->p++;
+    int m = regex_parse_cat(ps);
+    if (m == -1)
+    {
+      return -1;
+    }
+    n = regex_node(ps, RE_NODE_ALT, n, m);
+  }
+  return n;
+}
+
+/**
+ * @brief Add an instruction to the program
+ *
+ * @return int its index, 0 once the program is too large
+ */
+int regex_emit(EditorRegexParser *ps, int op, int x, int y)
+{
+  EditorRegex *re = ps->re;
+  if (re->len == ED9T_REGEX_PROGRAM)
+  {
+    ps->err = "pattern too large";
+    return 0;
+  }
+  if (re->len == ps->progcap)
+  {
+    ps->progcap = ps->progcap ? 2 * ps->progcap : 64;
+    re->prog = realloc(re->prog, sizeof(EditorRegexInst) * ps->progcap);
+    if (re->prog == NULL)
+    {
+      die("realloc");
+    }
+  }
+  re->prog[re->len].op = op;
+  re->prog[re->len].x = x;
+  re->prog[re->len].y = y;
+  return re->len++;
+}
+
+/**
+ * @brief Compile a node into instructions, a repeated node once per copy
+ */
+void regex_compile_node(EditorRegexParser *ps, int n)
+{
+  if (ps->err)
+  {
+    return;
+  }
+  EditorRegexNode node = ps->nodes[n];
+  EditorRegex *re = ps->re;
+  int i, split, jmp;
+  switch (node.type)
+  {
+  case RE_NODE_SET:
+    regex_emit(ps, RE_SET, node.set, 0);
+    break;
+  case RE_NODE_BOL:
+    regex_emit(ps, RE_BOL, 0, 0);
+    break;
+  case RE_NODE_EOL:
+    regex_emit(ps, RE_EOL, 0, 0);
+    break;
+  case RE_NODE_CAT:
+    regex_compile_node(ps, node.a);
+    regex_compile_node(ps, node.b);
+    break;
+  case RE_NODE_ALT:
+    split = regex_emit(ps, RE_SPLIT, 0, 0);
+    regex_compile_node(ps, node.a);
+    jmp = regex_emit(ps, RE_JMP, 0, 0);
+    regex_compile_node(ps, node.b);
+    if (!ps->err)
+    {
+      re->prog[split].x = split + 1;
+      re->prog[split].y = jmp + 1;
+      re->prog[jmp].x = re->len;
+    }
+    break;
+  case RE_NODE_REPEAT:
+    for (i = 0; i < node.min; i++)
+    {
+      regex_compile_node(ps, node.a);
+    }
+    if (node.max == -1)
+    {
+      split = regex_emit(ps, RE_SPLIT, 0, 0);
+      regex_compile_node(ps, node.a);
+      regex_emit(ps, RE_JMP, split, 0);
+      if (!ps->err)
+      {
+        re->prog[split].x = split + 1;
+        re->prog[split].y = re->len;
+      }
+      break;
+    }
+    /* each optional copy can be skipped to the end of them all */
+    int chain = -1;
+    for (i = node.min; i < node.max && !ps->err; i++)
+    {
+      split = regex_emit(ps, RE_SPLIT, 0, chain);
+      re->prog[split].x = split + 1;
+      chain = split;
+      regex_compile_node(ps, node.a);
+    }
+    while (chain != -1 && !ps->err)
+    {
+      int next = re->prog[chain].y;
+      re->prog[chain].y = re->len;
+      chain = next;
+    }
+    break;
+  }
+}
+
+/**
+ * @brief Find the longest run of bytes that every match of node n holds
+ *
+ * @param run the run of bytes node n follows, of length *runlen
+ * @param best the longest run found so far, of length *bestlen
+ */
+void regex_literal(EditorRegexParser *ps, int n, char *run, int *runlen,
+                   char *best, int *bestlen)
+{
+  EditorRegexNode *node = &ps->nodes[n];
+  switch (node->type)
+  {
+  case RE_NODE_EMPTY:
+  case RE_NODE_BOL:
+  case RE_NODE_EOL:
+    return;
+  case RE_NODE_SET:
+    if (node->c != -1)
+    {
+      run[(*runlen)++] = node->c;
+      if (*runlen > *bestlen)
+      {
+        memcpy(best, run, *runlen);
+        *bestlen = *runlen;
+      }
+      return;
+    }
+    break;
+  case RE_NODE_CAT:
+    regex_literal(ps, node->a, run, runlen, best, bestlen);
+    regex_literal(ps, node->b, run, runlen, best, bestlen);
+    return;
+  case RE_NODE_REPEAT:
+    /* the first copy is there, but what follows may be another copy */
+    if (node->min > 0)
+    {
+      regex_literal(ps, node->a, run, runlen, best, bestlen);
+      if (node->min == 1 && node->max == 1)
+      {
+        return;
+      }
+    }
+    break;
+  }
+  *runlen = 0;
+}
+
+/**
+ * @brief Split the bytes into classes, so that every set holds either all
+ * of the bytes of a class or none of them
+ */
+void regex_classes(EditorRegex *re)
+{
+  unsigned char next[256];
+  int map[2][256];
+  int i, c;
+  memset(re->cls, 0, sizeof(re->cls));
+  re->ncls = 1;
+  for (i = 0; i < re->nsets; i++)
+  {
+    int n = 0;
+    memset(map, -1, sizeof(map));
+    for (c = 0; c < 256; c++)
+    {
+      int in = regex_set_has(re->sets[i], c);
+      if (map[in][re->cls[c]] == -1)
+      {
+        map[in][re->cls[c]] = n++;
+      }
+      next[c] = map[in][re->cls[c]];
+    }
+    memcpy(re->cls, next, sizeof(next));
+    re->ncls = n;
+  }
+  for (c = 255; c >= 0; c--)
+  {
+    re->rep[re->cls[c]] = c;
+  }
+}
+
+/**
+ * @brief Add the instructions that pc leads to without taking a byte to
+ * the list of the DFA, skipping those already marked with its generation
+ *
+ * @param bol set at the start of a line, where ^ holds
+ * @param eol set at the end of a line, where $ holds. otherwise RE_EOL
+ * instructions go to the list, for the end of the line to decide on
+ */
+void regex_closure(const EditorRegex *re, EditorRegexDfa *d, int pc, int bol,
+                   int eol)
+{
+  int sp = 0;
+  d->stack[sp++] = pc;
+  while (sp > 0)
+  {
+    pc = d->stack[--sp];
+    if (d->mark[pc] == d->gen)
+    {
+      continue;
+    }
+    d->mark[pc] = d->gen;
+    const EditorRegexInst *in = &re->prog[pc];
+    switch (in->op)
+    {
+    case RE_JMP:
+      d->stack[sp++] = in->x;
+      break;
+    case RE_SPLIT:
+      d->stack[sp++] = in->y;
+      d->stack[sp++] = in->x;
+      break;
+    case RE_BOL:
+      if (bol)
+      {
+        d->stack[sp++] = pc + 1;
+      }
+      break;
+    case RE_EOL:
+      if (eol)
+      {
+        d->stack[sp++] = pc + 1;
+        break;
+      }
+      d->list[d->nlist++] = pc;
+      break;
+    default:
+      d->list[d->nlist++] = pc;
+    }
+  }
+}
+
+void regex_dfa_init(EditorRegexDfa *d, const EditorRegex *re, int anchored)
+{
+  memset(d, 0, sizeof(*d));
+  d->anchored = anchored;
+  d->list = malloc(sizeof(int) * re->len);
+  d->stack = malloc(sizeof(int) * (2 * re->len + 1));
+  d->mark = calloc(re->len, sizeof(unsigned int));
+  d->tablecap = 64;
+  d->table = malloc(sizeof(int) * d->tablecap);
+  if (d->list == NULL || d->stack == NULL || d->mark == NULL ||
+      d->table == NULL)
+  {
+    die("malloc");
+  }
+  memset(d->table, -1, sizeof(int) * d->tablecap);
+  d->start[0] = -1;
+  d->start[1] = -1;
+}
+
+void regex_dfa_free(EditorRegexDfa *d)
+{
+  free(d->trans);
+  free(d->flags);
+  free(d->pcs);
+  free(d->off);
+  free(d->table);
+  free(d->list);
+  free(d->stack);
+  free(d->mark);
+}
+
+/**
+ * @brief Throw away every state of the DFA
+ */
+void regex_dfa_flush(EditorRegexDfa *d)
+{
+  d->nstates = 0;
+  d->npcs = 0;
+  d->bytes = 0;
+  d->start[0] = -1;
+  d->start[1] = -1;
+  memset(d->table, -1, sizeof(int) * d->tablecap);
+}
+
+unsigned int regex_dfa_hash(const int *pcs, int n, int bol)
+{
+  unsigned int h = 2166136261u ^ bol;
+  int i;
+  for (i = 0; i < n; i++)
+  {
+    h = (h ^ pcs[i]) * 16777619u;
+  }
+  return h;
+}
+
+int regex_cmp_pc(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief Find the state of the instructions in the list of the DFA, and
+ * add it if there is none yet
+ *
+ * @param bol set for the state at the start of a line
+ * @return int index of the state
+ */
+int regex_dfa_state(const EditorRegex *re, EditorRegexDfa *d, int bol)
+{
+  qsort(d->list, d->nlist, sizeof(int), regex_cmp_pc);
+  unsigned int mask = d->tablecap - 1;
+  unsigned int slot = regex_dfa_hash(d->list, d->nlist, bol) & mask;
+  int s, i;
+  while ((s = d->table[slot]) != -1)
+  {
+    if (!(d->flags[s] & RE_DFA_BOL) == !bol &&
+        d->off[s + 1] - d->off[s] == d->nlist &&
+        memcmp(&d->pcs[d->off[s]], d->list, sizeof(int) * d->nlist) == 0)
+    {
+      return s;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (d->nstates == d->cap)
+  {
+    d->cap = d->cap ? 2 * d->cap : 16;
+    d->trans = realloc(d->trans, sizeof(int) * d->cap * re->ncls);
+    d->flags = realloc(d->flags, d->cap);
+    d->off = realloc(d->off, sizeof(int) * (d->cap + 1));
+    if (d->trans == NULL || d->flags == NULL || d->off == NULL)
+    {
+      die("realloc");
+    }
+  }
+  if (d->npcs + d->nlist > d->pcscap)
+  {
+    d->pcscap = 2 * (d->npcs + d->nlist);
+    d->pcs = realloc(d->pcs, sizeof(int) * d->pcscap);
+    if (d->pcs == NULL)
+    {
+      die("realloc");
+    }
+  }
+  s = d->nstates++;
+  d->off[s] = d->npcs;
+  memcpy(&d->pcs[d->npcs], d->list, sizeof(int) * d->nlist);
+  d->npcs += d->nlist;
+  d->off[s + 1] = d->npcs;
+  memset(&d->trans[s * re->ncls], -1, sizeof(int) * re->ncls);
+  d->bytes += sizeof(int) * (re->ncls + d->nlist + 2) + 1;
+
+  const int *pcs = &d->pcs[d->off[s]];
+  int n = d->nlist;
+  d->flags[s] = bol ? RE_DFA_BOL : 0;
+  if (n == 0)
+  {
+    d->flags[s] |= RE_DFA_DEAD;
+  }
+  for (i = 0; i < n; i++)
+  {
+    if (re->prog[pcs[i]].op == RE_MATCH)
+    {
+      d->flags[s] |= RE_DFA_MATCH | RE_DFA_EOL;
+    }
+    else if (re->prog[pcs[i]].op == RE_EOL && !(d->flags[s] & RE_DFA_EOL))
+    {
+      /* see if the end of the line would lead on to a match */
+      int j;
+      d->gen++;
+      d->nlist = 0;
+      regex_closure(re, d, pcs[i] + 1, bol, 1);
+      for (j = 0; j < d->nlist; j++)
+      {
+        if (re->prog[d->list[j]].op == RE_MATCH)
+        {
+          d->flags[s] |= RE_DFA_EOL;
+        }
+      }
+    }
+  }
+
+  if (2 * d->nstates > d->tablecap)
+  {
+    d->tablecap *= 2;
+    d->table = realloc(d->table, sizeof(int) * d->tablecap);
+    if (d->table == NULL)
+    {
+      die("realloc");
+    }
+    memset(d->table, -1, sizeof(int) * d->tablecap);
+    mask = d->tablecap - 1;
+    for (i = 0; i < d->nstates; i++)
+    {
+      slot = regex_dfa_hash(&d->pcs[d->off[i]], d->off[i + 1] - d->off[i],
+                            (d->flags[i] & RE_DFA_BOL) != 0) &
+             mask;
+      while (d->table[slot] != -1)
+      {
+        slot = (slot + 1) & mask;
+      }
+      d->table[slot] = i;
+    }
+  }
+  else
+  {
+    d->table[slot] = s;
+  }
+  return s;
+}
+
+/**
+ * @brief Get the state a match starts from, at the start of a line or past
+ * it
+ */
+int regex_dfa_start(const EditorRegex *re, EditorRegexDfa *d, int bol)
+{
+  if (d->start[bol] == -1)
+  {
+    d->gen++;
+    d->nlist = 0;
+    regex_closure(re, d, 0, bol, 0);
+    if (d->bytes > ED9T_REGEX_DFA_BYTES)
+    {
+      regex_dfa_flush(d);
+    }
+    d->start[bol] = regex_dfa_state(re, d, bol);
+  }
+  return d->start[bol];
+}
+
+/**
+ * @brief Build the state that state s goes to on byte c, the first time
+ * the text takes that transition
+ */
+int regex_dfa_next(const EditorRegex *re, EditorRegexDfa *d, int s,
+                   unsigned char c)
+{
+  int k = re->cls[c];
+  int i;
+  d->gen++;
+  d->nlist = 0;
+  for (i = d->off[s]; i < d->off[s + 1]; i++)
+  {
+    const EditorRegexInst *in = &re->prog[d->pcs[i]];
+    if (in->op == RE_SET && regex_set_has(re->sets[in->x], re->rep[k]))
+    {
+      regex_closure(re, d, d->pcs[i] + 1, 0, 0);
+    }
+  }
+  if (!d->anchored)
+  {
+    regex_closure(re, d, 0, 0, 0);
+  }
+  /* past the memory cap the DFA starts over, from the state being built */
+  int flush = d->bytes > ED9T_REGEX_DFA_BYTES;
+  if (flush)
+  {
+    regex_dfa_flush(d);
+  }
+  int n = regex_dfa_state(re, d, 0);
+  if (!flush)
+  {
+    d->trans[s * re->ncls + k] = n;
+  }
+  return n;
+}
+
+/**
+ * @brief Run an unanchored DFA from from until a match ends
+ *
+ * @return int where the earliest match ends, or -1
+ */
+int regex_dfa_scan(const EditorRegex *re, EditorRegexDfa *d,
+                   const char *text, int len, int from)
+{
+  const unsigned char *t = (const unsigned char *)text;
+  int s = regex_dfa_start(re, d, from == 0);
+  int i;
+  if (d->flags[s] & RE_DFA_MATCH)
+  {
+    return from;
+  }
+  for (i = from; i < len; i++)
+  {
+    int n = d->trans[s * re->ncls + re->cls[t[i]]];
+    s = n != -1 ? n : regex_dfa_next(re, d, s, t[i]);
+    if (d->flags[s] & RE_DFA_MATCH)
+    {
+      return i + 1;
+    }
+  }
+  return d->flags[s] & RE_DFA_EOL ? len : -1;
+}
+
+/**
+ * @brief Run an anchored DFA from from until nothing can match any more
+ *
+ * @return int where the longest match starting at from ends, or -1
+ */
+int regex_dfa_longest(const EditorRegex *re, EditorRegexDfa *d,
+                      const char *text, int len, int from)
+{
+  const unsigned char *t = (const unsigned char *)text;
+  int s = regex_dfa_start(re, d, from == 0);
+  int end = d->flags[s] & RE_DFA_MATCH ? from : -1;
+  int i;
+  for (i = from; i < len && !(d->flags[s] & RE_DFA_DEAD); i++)
+  {
+    int n = d->trans[s * re->ncls + re->cls[t[i]]];
+    s = n != -1 ? n : regex_dfa_next(re, d, s, t[i]);
+    if (d->flags[s] & RE_DFA_MATCH)
+    {
+      end = i + 1;
+    }
+  }
+  if (i == len && d->flags[s] & RE_DFA_EOL)
+  {
+    end = len;
+  }
+  return end;
+}
+
+/**
+ * @brief Find needle in hay
+ *
+ * With SSE2, 16 positions are tried at a time by comparing the first and
+ * the last byte of the needle against the bytes at and after them, and
+ * only the positions where both agree are compared in full. Otherwise, and
+ * for the tail, memmem does the work.
+ */
+const char *regex_find_literal(const char *hay, int n, const char *needle,
+                               int m)
+{
+  if (n < m)
+  {
+    return NULL;
+  }
+  if (m == 1)
+  {
+    return memchr(hay, needle[0], n);
+  }
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  int i;
+  for (i = 0; i + m - 1 + 16 <= n; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask)
+    {
+      int at = i + __builtin_ctz(mask);
+      if (memcmp(hay + at + 1, needle + 1, m - 2) == 0)
+      {
+        return hay + at;
+      }
+      mask &= mask - 1;
+    }
+  }
+  hay += i;
+  n -= i;
+#endif
+  return memmem(hay, n, needle, m);
+}
+
+/**
+ * @brief Find the leftmost-longest match in text at or after from
+ *
+ * The unanchored DFA finds where the earliest match ends, and the anchored
+ * one then tries the bytes up to there that a match can start with, in
+ * order, for the first one a match starts at.
+ *
+ * @param dfa the unanchored and the anchored DFA of the thread
+ * @param len set to the length of the match
+ * @return int the column of the match, or -1
+ */
+int regex_find(const EditorRegex *re, EditorRegexDfa *dfa, const char *text,
+               int size, int from, int *len)
+{
+  if (from > size ||
+      (re->litlen &&
+       regex_find_literal(text + from, size - from, re->lit, re->litlen) ==
+           NULL))
+  {
+    return -1;
+  }
+  int end = regex_dfa_scan(re, &dfa[0], text, size, from);
+  if (end == -1)
+  {
+    return -1;
+  }
+  int i;
+  for (i = from; i <= end; i++)
+  {
+    if (i == size ? !re->nullable : !re->first[(unsigned char)text[i]])
+    {
+      continue;
+    }
+    int e = regex_dfa_longest(re, &dfa[1], text, size, i);
+    if (e != -1)
+    {
+      *len = e - i;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void regex_free(EditorRegex *re)
+{
+  if (re == NULL)
+  {
+    return;
+  }
+  regex_dfa_free(&re->dfa[0]);
+  regex_dfa_free(&re->dfa[1]);
+  free(re->prog);
+  free(re->sets);
+  free(re->lit);
+  free(re);
+}
+
+/**
+ * @brief Compile a pattern
+ *
+ * @param err set to what is wrong with the pattern when it is bad
+ * @return EditorRegex* the regex, or NULL if the pattern is bad
+ */
+EditorRegex *regex_compile(const char *pattern, const char **err)
+{
+  EditorRegex *re = calloc(1, sizeof(EditorRegex));
+  if (re == NULL)
+  {
+    die("calloc");
+  }
+  EditorRegexParser ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.p = pattern;
+  ps.re = re;
+  int len = strlen(pattern);
+  int root = -1;
+  if (len > ED9T_REGEX_PATTERN)
+  {
+    ps.err = "pattern too large";
+  }
+  else
+  {
+    root = regex_parse_alt(&ps);
+  }
+  if (root != -1 && *ps.p != '\0')
+  {
+    ps.err = "unmatched )";
+  }
+  if (ps.err == NULL)
+  {
+    regex_compile_node(&ps, root);
+    regex_emit(&ps, RE_MATCH, 0, 0);
+  }
+  if (ps.err == NULL)
+  {
+    char *run = malloc(len + 1);
+    int runlen = 0;
+    re->lit = malloc(len + 1);
+    if (run == NULL || re->lit == NULL)
+    {
+      die("malloc");
+    }
+    regex_literal(&ps, root, run, &runlen, re->lit, &re->litlen);
+    free(run);
+  }
+  free(ps.nodes);
+  if (ps.err)
+  {
+    *err = ps.err;
+    regex_free(re);
+    return NULL;
+  }
+
+  regex_classes(re);
+  regex_dfa_init(&re->dfa[0], re, 0);
+  regex_dfa_init(&re->dfa[1], re, 1);
+  /* the bytes a match can start with, from where the start state is at */
+  EditorRegexDfa *d = &re->dfa[1];
+  int i, c;
+  d->gen++;
+  d->nlist = 0;
+  regex_closure(re, d, 0, 1, 0);
+  for (i = 0; i < d->nlist; i++)
+  {
+    const EditorRegexInst *in = &re->prog[d->list[i]];
+    if (in->op == RE_SET)
+    {
+      for (c = 0; c < 256; c++)
+      {
+        re->first[c] |= regex_set_has(re->sets[in->x], c);
+      }
+    }
+    else
+    {
+      re->nullable = 1;
+    }
+  }
+  if (re->nullable)
+  {
+    memset(re->first, 1, sizeof(re->first));
+  }
+  return re;
+}
+
+/*** FIND ***/
+
+/**
+ * @brief Find the first match of the search in text at or after col
+ *
+ * memmem is glibc's two-way search, with a vectorised memchr/memcmp doing
+ * most of the work for short queries. A regex runs on dfa, the pair of
+ * DFAs of the thread searching.
+ *
+ * @param len set to the length of the match
+ * @return the column of the match, or -1
+ */
+int editor_search_text(EditorRegexDfa *dfa, const char *text, int size,
+                       int col, int *len)
+{
+  EditorSearch *s = &E.search;
+  if (col < 0 || col > size)
+  {
+    return -1;
+  }
+  if (s->re)
+  {
+    return regex_find(s->re, dfa, text, size, col, len);
+  }
+  if (size - col < s->querylen)
+  {
+    return -1;
+  }
+  char *match = memmem(text + col, size - col, s->query, s->querylen);
+  *len = s->querylen;
+  return match ? match - text : -1;
+}
+
+/**
+ * @brief Find the first match of the search in row at or after col
+ *
+ * Matching is done on the row's chars, so rows never need a render to be
+ * searched.
+ */
+int editor_search_row(EditorRow *row, int col, int *len)
+{
+  EditorRegexDfa *dfa = E.search.re ? E.search.re->dfa : NULL;
+  return editor_search_text(dfa, row->chars, row->size, col, len);
+}
+
+/**
+ * @brief Find the match after the one at col in text
+ *
+ * Matches of a query overlap, so that a longer query can be matched
+ * against the list. Those of a regex do not, an empty one is stepped over,
+ * and an empty match right after a match is left out, as with sed. Counting
+ * the matches, moving between them and replacing them all go by this.
+ *
+ * @param len the length of the match at col, set to that of the next one
+ * @return the column of the next match, or -1
+ */
+int editor_search_after(EditorRegexDfa *dfa, const char *text, int size,
+                        int col, int *len)
+{
+  if (E.search.re == NULL)
+  {
+    return editor_search_text(dfa, text, size, col + 1, len);
+  }
+  int end = col + *len;
+  int next = editor_search_text(dfa, text, size, end > col ? end : end + 1,
+                                len);
+  if (next == end && *len == 0 && end > col)
+  {
+    next = editor_search_text(dfa, text, size, end + 1, len);
+  }
+  return next;
+}
+
+/**
+ * @brief Find the match after the one at col in row, see
+ * editor_search_after
+ */
+int editor_search_row_after(EditorRow *row, int col, int *len)
+{
+  EditorRegexDfa *dfa = E.search.re ? E.search.re->dfa : NULL;
+  return editor_search_after(dfa, row->chars, row->size, col, len);
+}
+
+/**
+ * @brief Find the first match in the lines of a span at or after from
+ *
+ * A regex is run a line at a time, and only on the lines holding its
+ * literal when it has one.
+ *
+ * @param len set to the length of the match
+ * @return char* the match, or NULL
+ */
+char *editor_search_span(EditorRegexDfa *dfa, EditorRow *span, char *from,
+                         int *len)
+{
+  EditorSearch *s = &E.search;
+  char *text = editor_span_chars(span);
+  char *end = text + span->size;
+  if (from > end)
+  {
+    return NULL;
+  }
+  if (s->re == NULL)
+  {
+    *len = s->querylen;
+    return memmem(from, end - from, s->query, s->querylen);
+  }
+  char *line = memrchr(text, '\n', from - text);
+  line = line ? line + 1 : text;
+  while (1)
+  {
+    if (s->re->litlen)
+    {
+      const char *lit = regex_find_literal(from, end - from, s->re->lit,
+                                           s->re->litlen);
+      if (lit == NULL)
+      {
+        return NULL;
+      }
+      char *nl = memrchr(from, '\n', lit - from);
+      if (nl)
+      {
+        line = from = nl + 1;
+      }
+    }
+    char *nl = memchr(line, '\n', end - line);
+    char *eol = nl ? nl : end;
+    /* the same line a row loaded from the span gets */
+    while (eol > line && eol[-1] == '\r')
+    {
+      eol--;
+    }
+    if (from <= eol)
+    {
+      int col = regex_find(s->re, dfa, line, eol - line, from - line, len);
+      if (col != -1)
+      {
+        return line + col;
+      }
+    }
+    if (nl == NULL)
+    {
+      return NULL;
+    }
+    line = from = nl + 1;
+  }
+}
+
+/**
+ * @brief Find the match after the one at m in the lines of a span, see
+ * editor_search_after
+ */
+char *editor_search_span_after(EditorRegexDfa *dfa, EditorRow *span, char *m,
+                               int *len)
+{
+  if (E.search.re == NULL)
+  {
+    return editor_search_span(dfa, span, m + 1, len);
+  }
+  char *end = m + *len;
+  char *next = editor_search_span(dfa, span, end > m ? end : end + 1, len);
+  if (next == end && *len == 0 && end > m)
+  {
+    next = editor_search_span(dfa, span, end + 1, len);
+  }
+  return next;
+}
+
+/**
+ * @brief Add a match to the match list
+ */
+void editor_search_record(EditorRow *row, int col)
+{
+  EditorSearch *s = &E.search;
+  if (s->nmatches == s->cap)
+  {
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->matches = realloc(s->matches, sizeof(EditorMatch) * s->cap);
+    if (s->matches == NULL)
+    {
+      die("realloc");
+    }
+  }
+  s->matches[s->nmatches].row = row;
+  s->matches[s->nmatches].col = col;
+  s->nmatches++;
+}
+
+/**
+ * @brief Load the line of a span holding the match at m
+ */
+EditorRow *editor_search_take(EditorRow *span, char *m, int *found)
+{
+  int off = 0;
+  char *p = editor_span_chars(span);
+  char *nl;
+  while ((nl = memchr(p, '\n', m - p)) != NULL)
+  {
+    off++;
+    p = nl + 1;
+  }
+  *found = m - p;
+  return editor_span_take(span, off);
+}
+
+/**
+ * @brief Put back the normal highlight of the row with the current match
+ */
+void editor_search_clear_hl()
+{
+  if (E.search.hl_row)
+  {
+    /* drop the match highlight, the row is highlighted again when drawn */
+    E.search.hl_row->hl = NULL;
+    E.search.hl_row = NULL;
+  }
+}
+
+/**
+ * @brief Make a match the current one, move the cursor to it and
+ * highlight it
+ *
+ * @param current index of the match in the match list, -1 if it is past
+ * the end of the list
+ * @param ordinal number of the match counted from the start of the file
+ */
+void editor_search_select(EditorRow *row, int col, int current,
+                          long long ordinal)
+{
+  EditorSearch *s = &E.search;
+  editor_search_clear_hl();
+  s->row = row;
+  s->col = col;
+  s->current = current;
+  s->ordinal = ordinal;
+
+  editor_search_row(row, col, &s->len);
+
+  E.cy = editor_row_index(row);
+  E.cx = col;
+  E.rowoff = E.numrows;
+
+  int start = editor_row_cx_to_rx(row, col);
+  int end = editor_row_cx_to_rx(row, col + s->len);
+  /* wide enough that the columns scrolled to are covered as well */
+  int base = editor_row_prepare_hl(row, start - E.screencols,
+                                   end + E.screencols);
+  memset(&row->hl[start - base], HL_MATCH, end - start);
+  s->hl_row = row;
+}
+
+/**
+ * @brief Count the matches in a row, or in the lines of a span
+ */
+int editor_search_count(EditorRegexDfa *dfa, EditorRow *row)
+{
+  int n = 0;
+  int len;
+  if (row->flags & ROW_SPAN)
+  {
+    char *p = editor_search_span(dfa, row, editor_span_chars(row), &len);
+    while (p != NULL)
+    {
+      n++;
+      p = editor_search_span_after(dfa, row, p, &len);
+    }
+    return n;
+  }
+  int col = editor_search_text(dfa, row->chars, row->size, 0, &len);
+  while (col != -1)
+  {
+    n++;
+    col = editor_search_after(dfa, row->chars, row->size, col, &len);
+  }
+  return n;
+}
+
+/**
+ * @brief Count the matches of the rows of a chunk, on a thread of its own
+ */
+void *editor_search_count_chunk(void *arg)
+{
+  EditorSearchChunk *c = arg;
+  int i;
+  for (i = 0; i < c->nrows; i++)
+  {
+    c->hits[i] = editor_search_count(c->dfa, c->rows[i]);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Count the matches of the rows from scan_row on, about budget
+ * bytes of them
+ *
+ * The rows are split into chunks of at least ED9T_SEARCH_CHUNK bytes, one
+ * per thread as for indexing. Only the rows are read meanwhile, and a regex
+ * gets a pair of DFAs for each thread.
+ *
+ * @return int number of rows counted, which are put in E.search_rows with
+ * their counts in E.search_hits
+ */
+int editor_search_batch(long long budget)
+{
+  EditorSearch *s = &E.search;
+  EditorRow *row = s->scan_row;
+  long long bytes = 0;
+  int n = 0;
+  while (row && bytes < budget)
+  {
+    /*
+    a packed span is unpacked into the cache shared by the main thread, so
+    it is counted on that thread, in a batch of its own
+    */
+    if ((row->flags & ROW_PACKED) && n > 0)
+    {
+      break;
+    }
+    if (n == E.search_cap)
+    {
+      E.search_cap = E.search_cap ? 2 * E.search_cap : 1024;
+      E.search_rows = realloc(E.search_rows, sizeof(EditorRow *) * E.search_cap);
+      E.search_hits = realloc(E.search_hits, sizeof(int) * E.search_cap);
+      if (E.search_rows == NULL || E.search_hits == NULL)
+      {
+        die("realloc");
+      }
+    }
+    E.search_rows[n++] = row;
+    bytes += row->size + 1;
+    if (row->flags & ROW_PACKED)
+    {
+      break;
+    }
+    row = row_tree_next(row);
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long long nchunks = bytes / ED9T_SEARCH_CHUNK;
+  if (cpus > 0 && nchunks > cpus)
+  {
+    nchunks = cpus;
+  }
+  if (nchunks > ED9T_INDEX_THREADS)
+  {
+    nchunks = ED9T_INDEX_THREADS;
+  }
+  if (nchunks < 1)
+  {
+    nchunks = 1;
+  }
+
+  EditorSearchChunk chunks[ED9T_INDEX_THREADS];
+  int first = 0;
+  long long done = 0;
+  int i;
+  for (i = 0; i < nchunks; i++)
+  {
+    EditorSearchChunk *c = &chunks[i];
+    int last = first;
+    while (last < n && (i == nchunks - 1 || done < bytes * (i + 1) / nchunks))
+    {
+      done += E.search_rows[last++]->size + 1;
+    }
+    c->rows = &E.search_rows[first];
+    c->hits = &E.search_hits[first];
+    c->nrows = last - first;
+    first = last;
+    c->dfa = s->re ? s->re->dfa : NULL;
+    if (s->re && i > 0)
+    {
+      regex_dfa_init(&c->own[0], s->re, 0);
+      regex_dfa_init(&c->own[1], s->re, 1);
+      c->dfa = c->own;
+    }
+    if (i > 0 &&
+        pthread_create(&c->thread, NULL, editor_search_count_chunk, c) != 0)
+    {
+      die("pthread_create");
+    }
+  }
+  editor_search_count_chunk(&chunks[0]);
+  for (i = 1; i < nchunks; i++)
+  {
+    pthread_join(chunks[i].thread, NULL);
+    if (s->re)
+    {
+      regex_dfa_free(&chunks[i].own[0]);
+      regex_dfa_free(&chunks[i].own[1]);
+    }
+  }
+  return n;
+}
+
+/**
+ * @brief Scan rows from scan_row on, until about budget bytes are searched
+ *
+ * Every match is counted, and recorded in the match list until that
+ * reaches ED9T_SEARCH_MAX_MATCHES. The rows are counted in batches by
+ * editor_search_batch, and only those with matches are searched again here.
+ *
+ * @return 1 if there are rows left to scan
+ */
+int editor_search_step(long long budget)
+{
+  EditorSearch *s = &E.search;
+  EditorRegexDfa *dfa = s->re ? s->re->dfa : NULL;
+  while (s->scan_row && budget > 0)
+  {
+    int n = editor_search_batch(budget);
+    int i;
+    for (i = 0; i < n; i++)
+    {
+      EditorRow *row = E.search_rows[i];
+      int hits = E.search_hits[i];
+      budget -= row->size + 1;
+      s->scan_row = i + 1 < n ? E.search_rows[i + 1] : row_tree_next(row);
+      s->total += hits;
+      if (row->flags & ROW_SPAN)
+      {
+        /* spans are only counted, the list stops before the first one */
+        s->scan_idx += row->lines;
+        perf_count(PERF_FIND, row->lines);
+        if (hits && s->row == NULL)
+        {
+          int col, len;
+          char *first =
+              editor_search_span(dfa, row, editor_span_chars(row), &len);
+          EditorRow *match = editor_search_take(row, first, &col);
+          editor_search_select(match, col, -1, 1);
+          /* the rest of the batch is counted again, from scan_row */
+          break;
+        }
+        continue;
+      }
+      /*
+      a row is recorded as a whole or not at all. in large-file mode nothing
+      is, the rows could be folded back into spans under the list
+      */
+      int record = !E.large && s->list_rows == s->scan_idx &&
+                   s->nmatches < ED9T_SEARCH_MAX_MATCHES;
+      int len;
+      int col = hits ? editor_search_row(row, 0, &len) : -1;
+      if (col != -1 && E.large && s->row == NULL)
+      {
+        /* without a list the first match is selected as soon as it is found */
+        editor_search_select(row, col, -1, 1);
+      }
+      while (record && col != -1)
+      {
+        editor_search_record(row, col);
+        col = editor_search_row_after(row, col, &len);
+      }
+      s->scan_idx++;
+      perf_count(PERF_FIND, 1);
+      if (record)
+      {
+        s->list_rows = s->scan_idx;
+      }
+    }
+  }
+  return s->scan_row != NULL;
+}
+
+/**
+ * @brief Forget the search, its match list and its highlight
+ */
+void editor_search_reset()
+{
+  EditorSearch *s = &E.search;
+  editor_search_clear_hl();
+  free(s->query);
+  s->query = NULL;
+  s->querylen = 0;
+  regex_free(s->re);
+  s->re = NULL;
+  free(s->matches);
+  s->matches = NULL;
+  s->nmatches = 0;
+  s->cap = 0;
+  s->scan_row = NULL;
+  s->scan_idx = 0;
+  s->list_rows = 0;
+  s->total = 0;
+  s->row = NULL;
+  s->len = 0;
+  s->current = -1;
+  s->ordinal = 0;
+}
+
+/**
+ * @brief Start searching for query, as a regex if E.find_regex is set
+ *
+ * When query extends the previous query, only the positions in the match
+ * list can still match, so the list is filtered instead of scanning those
+ * rows again. Everything else, and every regex, starts over from the first
+ * row.
+ *
+ * @param err set to what is wrong with a bad regex
+ * @return int 0 if the regex is bad, and nothing is searched for
+ */
+int editor_search_start(char *query, const char **err)
+{
+  EditorSearch *s = &E.search;
+  int len = strlen(query);
+  EditorRegex *re = NULL;
+  if (E.find_regex && (re = regex_compile(query, err)) == NULL)
+  {
+    editor_search_reset();
+    return 0;
+  }
+  int narrow = re == NULL && s->re == NULL && s->query &&
+               len > s->querylen &&
+               strncmp(query, s->query, s->querylen) == 0;
+
+  editor_search_clear_hl();
+  free(s->query);
+  s->query = strdup(query);
+  s->querylen = len;
+  regex_free(s->re);
+  s->re = re;
+  s->row = NULL;
+  s->current = -1;
+  s->ordinal = 0;
+
+  if (narrow)
+  {
+    int i, n = 0;
+    for (i = 0; i < s->nmatches; i++)
+    {
+      EditorMatch m = s->matches[i];
+      if (m.row->size - m.col >= len &&
+          memcmp(m.row->chars + m.col, query, len) == 0)
+      {
+        s->matches[n++] = m;
+      }
+    }
+    s->nmatches = n;
+    if (s->list_rows != s->scan_idx)
+    {
+      /* rows past the list were only counted, scan them again */
+      s->scan_idx = s->list_rows;
+      s->scan_row = editor_row_at(s->list_rows);
+    }
+    s->total = n;
+  }
+  else
+  {
+    s->nmatches = 0;
+    s->scan_idx = 0;
+    s->scan_row = editor_row_at(0);
+    s->list_rows = 0;
+    s->total = 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief Check if the search has rows left to scan
+ */
+int editor_search_busy()
+{
+  return E.search.query != NULL && E.search.scan_row != NULL;
+}
+
+/**
+ * @brief Scan a step further while the editor waits for input, select the
+ * first match once it turns up
+ */
+void editor_search_idle()
+{
+  EditorSearch *s = &E.search;
+  editor_search_step(ED9T_SEARCH_STEP);
+  if (s->row == NULL && s->nmatches > 0)
+  {
+    editor_search_select(s->matches[0].row, s->matches[0].col, 0, 1);
+  }
+}
+
+/**
+ * @brief Find the first match in row at or after col, or in the rows after
+ * it
+ *
+ * Spans are searched as a whole and only the line with the match is loaded.
+ */
+EditorRow *editor_search_forward(EditorRow *row, int col, int *found)
+{
+  EditorRegexDfa *dfa = E.search.re ? E.search.re->dfa : NULL;
+  int len;
+  col = editor_search_row(row, col, &len);
+  while (col == -1 && (row = row_tree_next(row)) != NULL)
+  {
+    if (row->flags & ROW_SPAN)
+    {
+      char *m = editor_search_span(dfa, row, editor_span_chars(row), &len);
+      if (m)
+      {
+        return editor_search_take(row, m, found);
+      }
+      continue;
+    }
+    col = editor_search_row(row, 0, &len);
+  }
+  *found = col;
+  return row;
+}
+
+/**
+ * @brief Move to the match after the current one, wrapping around to the
+ * first match
+ */
+void editor_search_next()
+{
+  EditorSearch *s = &E.search;
+  if (s->current != -1)
+  {
+    /* the list must be scanned a little further to know what comes next */
+    while (s->current + 1 == s->nmatches && s->list_rows == s->scan_idx &&
+           editor_search_step(ED9T_SEARCH_STEP))
+    {
+    }
+    if (s->current + 1 < s->nmatches)
+    {
+      EditorMatch m = s->matches[s->current + 1];
+      editor_search_select(m.row, m.col, s->current + 1, s->current + 2);
+      return;
+    }
+  }
+
+  if (s->current == -1 || s->list_rows != s->scan_idx)
+  {
+    /* past the end of the list, look for the next match directly */
+    int len = s->len;
+    int col = editor_search_row_after(s->row, s->col, &len);
+    EditorRow *row = s->row;
+    if (col == -1)
+    {
+      /* none left in the row, look from past its end */
+      row = editor_search_forward(s->row, s->row->size + 1, &col);
+    }
+    if (row)
+    {
+      editor_search_select(row, col, -1, s->ordinal + 1);
+      return;
+    }
+  }
+  if (s->nmatches == 0)
+  {
+    /* large-file mode keeps no list, wrap around by searching from the top */
+    int col;
+    EditorRow *row = editor_search_forward(editor_row_at(0), 0, &col);
+    editor_search_select(row, col, -1, 1);
+    return;
+  }
+  editor_search_select(s->matches[0].row, s->matches[0].col, 0, 1);
+}
+
+/**
+ * @brief Find the last match in rows from row back to stop that starts
+ * before col
+ */
+EditorRow *editor_search_back(EditorRow *row, int col, int stop, int *found)
+{
+  EditorRegexDfa *dfa = E.search.re ? E.search.re->dfa : NULL;
+  int idx = editor_row_index(row);
+  int len;
+  while (row && idx >= stop)
+  {
+    if (row->flags & ROW_SPAN)
+    {
+      char *last = NULL;
+      char *p = editor_search_span(dfa, row, editor_span_chars(row), &len);
+      while (p != NULL)
+      {
+        last = p;
+        p = editor_search_span_after(dfa, row, p, &len);
+      }
+      if (last)
+      {
+        return editor_search_take(row, last, found);
+      }
+      row = row_tree_prev(row);
+      idx -= row ? row->lines : 0;
+      continue;
+    }
+
+    int last = -1;
+    int c = editor_search_row(row, 0, &len);
+    while (c != -1 && c < col)
+    {
+      last = c;
+      c = editor_search_row_after(row, c, &len);
+    }
+    if (last != -1)
+    {
+      *found = last;
+      return row;
+    }
+    col = INT_MAX;
+    row = row_tree_prev(row);
+    idx -= row ? row->lines : 0;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Move to the match before the current one, wrapping around to the
+ * last match
+ */
+void editor_search_prev()
+{
+  EditorSearch *s = &E.search;
+  if (s->current > 0)
+  {
+    EditorMatch m = s->matches[s->current - 1];
+    editor_search_select(m.row, m.col, s->current - 1, s->current);
+    return;
+  }
+
+  int col;
+  EditorRow *row;
+  if (s->current == -1)
+  {
+    /* past the end of the list, look back as far as the list goes */
+    row = editor_search_back(s->row, s->col, s->list_rows, &col);
+    if (row)
+    {
+      editor_search_select(row, col, -1, s->ordinal - 1);
+      return;
+    }
+    if (s->nmatches > 0)
+    {
+      EditorMatch m = s->matches[s->nmatches - 1];
+      editor_search_select(m.row, m.col, s->nmatches - 1, s->nmatches);
+      return;
+    }
+    /* large-file mode keeps no list, wrap around to the last match */
+  }
+
+  /* wrap around, which needs the total count */
+  while (editor_search_step(ED9T_SEARCH_STEP))
+  {
+  }
+  row = NULL;
+  if (s->list_rows != s->scan_idx)
+  {
+    row = editor_search_back(editor_row_at(E.numrows - 1), INT_MAX,
+                             s->list_rows, &col);
+  }
+  if (row)
+  {
+    editor_search_select(row, col, -1, s->total);
+  }
+  else
+  {
+    EditorMatch m = s->matches[s->nmatches - 1];
+    editor_search_select(m.row, m.col, s->nmatches - 1, s->nmatches);
+  }
+}
+
+/**
+ * @brief Set the text of the find prompt, for the search mode and the
+ * error of a bad regex if there is one
+ */
+void editor_find_prompt(const char *err)
+{
+  snprintf(E.find_prompt, sizeof(E.find_prompt), "%s: %%s (%s)",
+           E.find_regex ? "Regex" : "Search",
+           err ? err : "Use ESC/Arrows/Enter, Ctrl-R regex");
+}
+
+/**
+ * @brief Follow a change to the search prompt, for editor_find_callback
+ */
+void editor_find_update(char *query, int key)
+{
+  EditorSearch *s = &E.search;
+  if (key == '\r' || key == '\x1b')
+  {
+    editor_search_reset();
+    return;
+  }
+  if (key == CTRL_KEY('r'))
+  {
+    /* switch between query and regex, and search again */
+    E.find_regex = !E.find_regex;
+    editor_search_reset();
+  }
+  editor_find_prompt(NULL);
+  if (query[0] == '\0')
+  {
+    editor_search_reset();
+    return;
+  }
+
+  if (s->query && strcmp(query, s->query) == 0)
+  {
+    if (s->row == NULL)
+    {
+      /* nothing found so far, the idle scan selects the first match */
+      return;
+    }
+    if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    {
+      editor_search_next();
+    }
+    else if (key == ARROW_LEFT || key == ARROW_UP)
+    {
+      editor_search_prev();
+    }
+    return;
+  }
+
+  /*
+  scan for the first match, but only up to ED9T_SEARCH_BUDGET bytes, the
+  rest of the file is scanned while waiting for the next key
+  */
+  const char *err;
+  if (!editor_search_start(query, &err))
+  {
+    editor_find_prompt(err);
+    return;
+  }
+  long long budget = ED9T_SEARCH_BUDGET;
+  while (s->nmatches == 0 && s->row == NULL && budget > 0 &&
+         editor_search_step(ED9T_SEARCH_STEP))
+  {
+    budget -= ED9T_SEARCH_STEP;
+  }
+  if (s->nmatches > 0)
+  {
+    editor_search_select(s->matches[0].row, s->matches[0].col, 0, 1);
+  }
+}
+
+void editor_find_callback(char *query, int key)
+{
+  long long start = perf_start();
+  editor_find_update(query, key);
+  perf_stop(PERF_FIND, start, 0);
+}
+
+void editor_find()
+{
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  editor_find_prompt(NULL);
+  char *query = editor_prompt(E.find_prompt, 0, editor_find_callback);
+  if (query)
+  {
+    free(query);
+  }
+  else
+  {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/**
+ * @brief Replace every match of the search in a row, building its new
+ * chars once in out
+ *
+ * The change is recorded for undo as the deletion of the text from the
+ * first match to the end of the last one, and the insertion of what took
+ * its place. The matches of a regex are those editor_search_after steps
+ * through.
+ *
+ * @param idx index of the row
+ * @return int number of matches replaced
+ */
+int editor_replace_row(EditorRow *row, int idx, const char *with,
+                       int withlen, AppendBuffer *out)
+{
+  int len;
+  int col = editor_search_row(row, 0, &len);
+  if (col == -1)
+  {
+    return 0;
+  }
+  int first = col;
+  int from = 0;
+  int n = 0;
+  ab_reset(out);
+  while (col != -1)
+  {
+    ab_append(out, row->chars + from, col - from);
+    ab_append(out, with, withlen);
+    n++;
+    from = col + len;
+    /* the matches of a query overlap, the next one replaced starts after */
+    col = E.search.re ? editor_search_row_after(row, col, &len)
+                      : editor_search_row(row, from, &len);
+  }
+  int last = from;
+  int end = out->len;
+  ab_append(out, row->chars + from, row->size - from);
+
+  editor_undo_record(UNDO_DELETE, idx, first, row->chars + first,
+                     last - first);
+  editor_undo_record(UNDO_INSERT, idx, first, out->b + first, end - first);
+  int oldsize = row->size;
+  int cap;
+  char *chars = slab_alloc(out->len + 1, &cap);
+  memcpy(chars, out->b, out->len);
+  chars[out->len] = '\0';
+  if (!(row->flags & ROW_MAPPED))
+  {
+    slab_free(row->chars, row->ccap);
+  }
+  row->chars = chars;
+  row->ccap = cap;
+  row->size = out->len;
+  row->flags &= ~ROW_MAPPED;
+  editor_row_segments_edit(row, first, oldsize - first, row->size - first);
+  editor_row_drop_render(row);
+  if (E.syntax)
+  {
+    editor_syntax_rescan(row, idx);
+  }
+  E.dirty++;
+  return n;
+}
+
+/**
+ * @brief Replace every match of query, a regex if E.find_regex is set,
+ * with the text with
+ *
+ * One pass goes over the rows, and only those with matches are rebuilt and
+ * highlighted again. In large-file mode the lines of a span with matches
+ * are loaded one at a time, the others stay in the span, and a file still
+ * being loaded is read to its end first. The whole replacement is one undo
+ * group.
+ */
+void editor_replace_all(char *query, char *with)
+{
+  editor_load_finish();
+  const char *err;
+  if (!editor_search_start(query, &err))
+  {
+    editor_set_status_message("Bad regex: %s", err);
+    return;
+  }
+  long long start = editor_now_ns();
+  EditorRegexDfa *dfa = E.search.re ? E.search.re->dfa : NULL;
+  int withlen = strlen(with);
+  AppendBuffer out = ABUF_INIT;
+  long long total = 0;
+  int rows = 0;
+  editor_undo_boundary();
+
+  EditorRow *row = E.numrows ? editor_row_at(0) : NULL;
+  int idx = 0;
+  while (row)
+  {
+    if (row->flags & ROW_SPAN)
+    {
+      int len, col;
+      char *m = editor_search_span(dfa, row, editor_span_chars(row), &len);
+      if (m == NULL)
+      {
+        idx += row->lines;
+        row = row_tree_next(row);
+        continue;
+      }
+      /* the lines after the match stay in a span, looked at next */
+      row = editor_search_take(row, m, &col);
+      idx = editor_row_index(row);
+    }
+    int n = editor_replace_row(row, idx, with, withlen, &out);
+    total += n;
+    rows += n > 0;
+    if (E.large && E.span_rows > E.span_limit)
+    {
+      /* pack the rows replaced so far, a large file is never loaded whole */
+      editor_pack_reclaim(E.rowoff - ED9T_LARGE_ROWS / 4,
+                          E.rowoff + E.screenrows + ED9T_LARGE_ROWS / 4, idx);
+    }
+    idx++;
+    row = row_tree_next(row);
+  }
+
+  editor_undo_boundary();
+  ab_free(&out);
+  editor_search_reset();
+  if (E.cy < E.numrows)
+  {
+    EditorRow *cur = editor_row_at(E.cy);
+    if (E.cx > cur->size)
+    {
+      E.cx = cur->size;
+    }
+  }
+  editor_set_status_message("Replaced %lld matches in %d rows (%.2f s)",
+                            total, rows, (editor_now_ns() - start) / 1e9);
+}
+
+/**
+ * @brief Prompt for what to replace, searching for it as for find, and
+ * then for its replacement
+ */
+void editor_replace()
+{
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  editor_find_prompt(NULL);
+  char *query = editor_prompt(E.find_prompt, 0, editor_find_callback);
+  char *with = NULL;
+  const char *err = NULL;
+  EditorRegex *re;
+  if (query && E.find_regex && (re = regex_compile(query, &err)) != NULL)
+  {
+    regex_free(re);
+  }
+  if (query && err == NULL)
+  {
+    with = editor_prompt("Replace with: %s (ESC to cancel)", 1, NULL);
+  }
+  if (with)
+  {
+    editor_replace_all(query, with);
+  }
+  else
+  {
+    if (err)
+    {
+      editor_set_status_message("Bad regex: %s", err);
+    }
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+  free(query);
+  free(with);
+}
+
+/*** APPEND BUFFER ***/
+
+/**
+ * @brief Append a string to the append buffer
+ *
+ * @param ab pointer to the append buffer
+ * @param s string to append
+ * @param len length of the string
+ */
+void ab_append(AppendBuffer *ab, const char *s, int len)
+{
+  /* an empty buffer has no b to copy to */
+  if (len == 0)
+  {
+    return;
+  }
+  if (ab->len + len > ab->cap)
+  {
+    /* grow geometrically so that appending is amortized O(1) */
+    int cap = ab->cap ? ab->cap : 64;
+    while (cap < ab->len + len)
+    {
+      cap *= 2;
+    }
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+    {
+      return;
+    }
+    ab->b = new;
+    ab->cap = cap;
+  }
+
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+  perf_count(PERF_REFRESH, len);
+}
+
+/**
+ * @brief Empty the append buffer, keeping its memory for reuse
+ *
+ * @param ab pointer to the append buffer
+ */
+void ab_reset(AppendBuffer *ab)
+{
+  ab->len = 0;
+}
+
+/**
+ * @brief Free the memory used by the append buffer
+ *
+ * @param ab pointer to the append buffer
+ */
+void ab_free(AppendBuffer *ab)
+{
+  free(ab->b);
+  ab->b = NULL;
+  ab->len = 0;
+  ab->cap = 0;
+}
+
+/*** UNDO ***/
+
+/*
+the undo log is an append-only byte buffer of records, one per primitive
+edit. a record is
+
+  kind | y | x | len | text | size
+
+kind is a byte (an EditorUndoKind, plus UNDO_GROUP on the first record of a
+group). y is the line number as a zigzag varint delta from the record
+before it, x the column (the row count for row records) and len the length
+of text, both varints. size is the length of everything before it, as a
+varint stored backwards so that the log can be walked in both directions.
+Typing into a row extends the last record instead of adding one.
+*/
+
+void undo_put_varint(AppendBuffer *ab, unsigned int v)
+{
+  char buf[5];
+  int n = 0;
+  while (v >= 0x80)
+  {
+    buf[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[n++] = v;
+  ab_append(ab, buf, n);
+}
+
+unsigned int undo_get_varint(const unsigned char **p)
+{
+  unsigned int v = 0;
+  int shift = 0;
+  while (**p & 0x80)
+  {
+    v |= (unsigned int)(*(*p)++ & 0x7f) << shift;
+    shift += 7;
+  }
+  v |= (unsigned int)*(*p)++ << shift;
+  return v;
+}
+
+/**
+ * @brief Write a varint that is read backwards, starting from its last
+ * byte, by undo_get_varint_back
+ */
+void undo_put_varint_back(AppendBuffer *ab, unsigned int v)
+{
+  char buf[5];
+  int n = 0;
+  do
+  {
+    buf[n++] = v & 0x7f;
+    v >>= 7;
+  } while (v);
+  /* the byte read last, which comes first, has no continuation bit */
+  int i;
+  for (i = n - 1; i >= 0; i--)
+  {
+    char c = buf[i] | (i < n - 1 ? 0x80 : 0);
+    ab_append(ab, &c, 1);
+  }
+}
+
+unsigned int undo_get_varint_back(const unsigned char **p)
+{
+  unsigned int v = 0;
+  int shift = 0;
+  unsigned char c;
+  do
+  {
+    c = *--(*p);
+    v |= (unsigned int)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return v;
+}
+
+/**
+ * @brief Decode the record starting at offset start of the log
+ *
+ * @param start offset of the record
+ * @param r filled in, except for y
+ * @return the y delta of the record
+ */
+int editor_undo_parse(int start, EditorUndoRecord *r)
+{
+  const unsigned char *p = (const unsigned char *)E.undo.log.b + start;
+  int kind = *p++;
+  r->kind = kind & ~UNDO_GROUP;
+  r->group = (kind & UNDO_GROUP) != 0;
+  unsigned int dy = undo_get_varint(&p);
+  r->x = undo_get_varint(&p);
+  r->len = undo_get_varint(&p);
+  r->text = (const char *)p;
+  r->start = start;
+  p += r->len;
+  unsigned int size = p - ((const unsigned char *)E.undo.log.b + start);
+  r->end = start + size + 1;
+  while (size >= 0x80)
+  {
+    size >>= 7;
+    r->end++;
+  }
+  /* zigzag decoding */
+  return (int)(dy >> 1) ^ -(int)(dy & 1);
+}
+
+/**
+ * @brief Decode the record ending at offset end of the log
+ */
+int editor_undo_parse_back(int end, EditorUndoRecord *r)
+{
+  const unsigned char *p = (const unsigned char *)E.undo.log.b + end;
+  unsigned int size = undo_get_varint_back(&p);
+  return editor_undo_parse(p - (const unsigned char *)E.undo.log.b - size, r);
+}
+
+/**
+ * @brief Drop the oldest groups while the log is larger than
+ * ED9T_UNDO_LIMIT, down to half of it
+ *
+ * The group being recorded is always kept, however large it is.
+ */
+void editor_undo_trim()
+{
+  EditorUndo *u = &E.undo;
+  if (u->log.len <= ED9T_UNDO_LIMIT)
+  {
+    return;
+  }
+  int cut = 0;
+  int at = 0;
+  EditorUndoRecord r;
+  while (at < u->log.len && u->log.len - cut > ED9T_UNDO_LIMIT / 2)
+  {
+    editor_undo_parse(at, &r);
+    at = r.end;
+    if (at < u->log.len)
+    {
+      editor_undo_parse(at, &r);
+      if (r.group)
+      {
+        cut = at;
+      }
+    }
+  }
+  if (cut == 0)
+  {
+    return;
+  }
+  memmove(u->log.b, u->log.b + cut, u->log.len - cut);
+  u->log.len -= cut;
+  u->pos -= cut;
+}
+
+/**
+ * @brief Write the header of a record, the text is appended after it by
+ * the caller and the record finished by editor_undo_end
+ *
+ * Anything that could have been redone is dropped first.
+ *
+ * @return offset of the record
+ */
+int editor_undo_begin(int kind, int y, int x, int len)
+{
+  EditorUndo *u = &E.undo;
+  u->log.len = u->pos;
+  int start = u->log.len;
+  char k = kind | (u->open ? 0 : UNDO_GROUP);
+  ab_append(&u->log, &k, 1);
+  int dy = y - u->pos_y;
+  undo_put_varint(&u->log, ((unsigned int)dy << 1) ^ (unsigned int)(dy >> 31));
+  undo_put_varint(&u->log, x);
+  undo_put_varint(&u->log, len);
+  u->pos_y = y;
+  u->open = 1;
+  return start;
+}
+
+void editor_undo_end(int start)
+{
+  EditorUndo *u = &E.undo;
+  undo_put_varint_back(&u->log, u->log.len - start);
+  u->pos = u->log.len;
+  editor_undo_trim();
+}
+
+/**
+ * @brief Record an edit of the text of row y, or the insertion of a single
+ * row with text s
+ *
+ * @param kind UNDO_INSERT, UNDO_DELETE or UNDO_INSERT_ROWS
+ * @param y line number of the row
+ * @param x column of the edit, or the number of rows
+ * @param s the text inserted or deleted
+ * @param len length of the text
+ */
+void editor_undo_record(int kind, int y, int x, const char *s, int len)
+{
+  EditorUndo *u = &E.undo;
+  /* undoing is an edit like any other to the journal */
+  editor_journal_record(kind, y, x, s, len);
+  if (u->replaying)
+  {
+    return;
+  }
+
+  EditorUndoRecord r;
+  if (kind == UNDO_INSERT && u->open && u->pos > 0 && u->pos == u->log.len)
+  {
+    /* typing on from the last insert, grow that record instead */
+    int dy = editor_undo_parse_back(u->pos, &r);
+    if (r.kind == UNDO_INSERT && u->pos_y == y && r.x + r.len == x &&
+        r.len + len <= ED9T_UNDO_MERGE)
+    {
+      char text[ED9T_UNDO_MERGE];
+      int rx = r.x;
+      int rlen = r.len;
+      memcpy(text, r.text, rlen);
+      memcpy(text + rlen, s, len);
+      u->pos = r.start;
+      u->pos_y = y - dy;
+      u->open = !r.group;
+      int start = editor_undo_begin(UNDO_INSERT, y, rx, rlen + len);
+      ab_append(&u->log, text, rlen + len);
+      editor_undo_end(start);
+      return;
+    }
+  }
+
+  int start = editor_undo_begin(kind, y, x, len);
+  ab_append(&u->log, s, len);
+  editor_undo_end(start);
+}
+
+/**
+ * @brief Record the insertion or deletion of the n rows from y, with their
+ * text joined by newlines
+ */
+void editor_undo_record_rows(int kind, int y, int n)
+{
+  EditorUndo *u = &E.undo;
+  editor_journal_record_rows(kind, y, n);
+  if (u->replaying)
+  {
+    return;
+  }
+  EditorRow *first = editor_row_at(y);
+  EditorRow *row = first;
+  int len = n - 1;
+  int i;
+  for (i = 0; i < n; i++, row = editor_row_next(row))
+  {
+    len += row->size;
+  }
+  int start = editor_undo_begin(kind, y, n, len);
+  for (i = 0, row = first; i < n; i++, row = editor_row_next(row))
+  {
+    if (i > 0)
+    {
+      ab_append(&u->log, "\n", 1);
+    }
+    ab_append(&u->log, row->chars, row->size);
+  }
+  editor_undo_end(start);
+}
+
+/**
+ * @brief End the current group, the next edit starts a new one
+ */
+void editor_undo_boundary()
+{
+  E.undo.open = 0;
+}
+
+/**
+ * @brief Forget the whole history, used after loading a file
+ */
+void editor_undo_reset()
+{
+  ab_reset(&E.undo.log);
+  E.undo.pos = 0;
+  E.undo.pos_y = 0;
+  E.undo.open = 0;
+}
+
+/**
+ * @brief Apply a record, or its inverse when undoing
+ *
+ * The cursor goes to where a change to the text of a row happened, the
+ * records of a group are applied in turn so this ends up at the edit
+ * applied last. Row records only move it if no such change did.
+ *
+ * @param r the record, with its y filled in
+ * @param forward 1 to redo the edit, 0 to undo it
+ * @param placed set once the cursor has been placed by a text change
+ */
+void editor_undo_apply(EditorUndoRecord *r, int forward, int *placed)
+{
+  int insert = (r->kind == UNDO_INSERT || r->kind == UNDO_INSERT_ROWS) == forward;
+  if (r->kind == UNDO_INSERT || r->kind == UNDO_DELETE)
+  {
+    EditorRow *row = editor_row_at(r->y);
+    if (insert)
+    {
+      editor_row_insert_string(row, r->x, r->text, r->len);
+    }
+    else
+    {
+      editor_row_del_chars(row, r->x, r->len);
+    }
+    E.cy = r->y;
+    E.cx = (insert && forward) ? r->x + r->len : r->x;
+    *placed = 1;
+    return;
+  }
+
+  if (insert)
+  {
+    int n;
+    EditorRow *rows = editor_rows_from_text(r->text, r->len, &n);
+    editor_insert_rows(r->y, rows, n);
+    editor_syntax_rows_changed(r->y, n, n);
+  }
+  else
+  {
+    editor_del_rows(r->y, r->x);
+  }
+  if (!*placed)
+  {
+    E.cy = r->y;
+    E.cx = 0;
+  }
+}
+
+/**
+ * @brief Undo the last group of edits
+ *
+ * Only the rows the edits touched are changed, a paste is taken out again
+ * with a single editor_del_rows.
+ */
+void editor_undo()
+{
+  EditorUndo *u = &E.undo;
+  if (u->pos == 0)
+  {
+    editor_set_status_message("Nothing to undo");
+    return;
+  }
+  u->replaying = 1;
+  EditorUndoRecord r;
+  int placed = 0;
+  do
+  {
+    int dy = editor_undo_parse_back(u->pos, &r);
+    r.y = u->pos_y;
+    editor_undo_apply(&r, 0, &placed);
+    u->pos = r.start;
+    u->pos_y -= dy;
+  } while (!r.group && u->pos > 0);
+  u->replaying = 0;
+  u->open = 0;
+}
+
+/**
+ * @brief Redo the group of edits undone last
+ */
+void editor_redo()
+{
+  EditorUndo *u = &E.undo;
+  if (u->pos == u->log.len)
+  {
+    editor_set_status_message("Nothing to redo");
+    return;
+  }
+  u->replaying = 1;
+  EditorUndoRecord r;
+  int placed = 0;
+  do
+  {
+    int dy = editor_undo_parse(u->pos, &r);
+    u->pos_y += dy;
+    r.y = u->pos_y;
+    editor_undo_apply(&r, 1, &placed);
+    u->pos = r.end;
+  } while (u->pos < u->log.len && !(u->log.b[u->pos] & UNDO_GROUP));
+  u->replaying = 0;
+  u->open = 0;
+}
+
+/*** JOURNAL ***/
+
+/*
+the edits to a file are journaled next to it, in .NAME.ed9j, so that they
+can be recovered after a crash or a lost terminal. the journal starts with
+a header naming the version of the file it applies to, and a journal of
+another version is moved aside to .NAME.ed9j.old when the file is opened
+
+  magic | size | mtime | inode
+
+and goes on with frames of records, each frame being
+
+  len | checksum | records
+
+with len and checksum 32-bit and the checksum FNV-1a over the records. a
+record is an edit primitive as it was applied, in the format of the undo
+log without the size at its end and with y absolute. row deletions carry
+no text, as replaying them doesn't need it. undo and redo are journaled as
+the edits they make.
+
+records are buffered and written out as a frame once ED9T_JOURNAL_BATCH
+bytes of them are, and whatever was added is synced with fdatasync at most
+ED9T_JOURNAL_MS after it, so a journal costs in proportion to the edits
+and not to the size of the file. a frame torn by a crash fails its
+checksum and is dropped when the journal is replayed. the journal is
+created by the first edit and removed by saving or quitting.
+*/
+
+#define JOURNAL_MAGIC "ED9TJNL1"
+/* magic, then size, mtime and inode as 8 bytes each */
+#define JOURNAL_HEADER 32
+
+unsigned int journal_checksum(const char *s, int len)
+{
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < len; i++)
+  {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @brief Get the path of the journal of a file, in the directory of the
+ * file a symlink points to as for editor_save
+ *
+ * @return char* the path, to be freed
+ */
+char *editor_journal_path(const char *filename)
+{
+  char target[PATH_MAX];
+  if (realpath(filename, target) == NULL)
+  {
+    snprintf(target, sizeof(target), "%s", filename);
+  }
+  char dir[PATH_MAX];
+  char base[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", target);
+  snprintf(base, sizeof(base), "%s", target);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/.%s.ed9j", dirname(dir), basename(base));
+  return strdup(path);
+}
+
+/**
+ * @brief Take the version of the file the journal applies to from st
+ */
+void editor_journal_identify(struct stat *st)
+{
+  E.journal.size = st->st_size;
+  E.journal.mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+  E.journal.ino = st->st_ino;
+}
+
+/**
+ * @brief Fill in the header of a journal for the version of the file it
+ * applies to
+ */
+void editor_journal_header(char *header)
+{
+  EditorJournal *j = &E.journal;
+  memcpy(header, JOURNAL_MAGIC, 8);
+  memcpy(header + 8, &j->size, 8);
+  memcpy(header + 16, &j->mtime, 8);
+  memcpy(header + 24, &j->ino, 8);
+}
+
+/**
+ * @brief Stop journaling the buffer shown after an error, leaving whatever
+ * reached the journal in place
+ */
+void editor_journal_fail(int err)
+{
+  EditorJournal *j = &E.journal;
+  editor_set_status_message("Journal off, can't write %.30s: %s", j->path,
+                            strerror(err));
+  if (j->fd != -1)
+  {
+    close(j->fd);
+  }
+  j->fd = -1;
+  free(j->path);
+  j->path = NULL;
+  ab_free(&j->pending);
+  j->since = 0;
+}
+
+/**
+ * @brief Write the buffered records out as a frame, creating the journal
+ * with its header if this is the first
+ *
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int editor_journal_write()
+{
+  EditorJournal *j = &E.journal;
+  if (j->pending.len == 0)
+  {
+    return 0;
+  }
+  if (j->fd == -1)
+  {
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (j->fd == -1)
+    {
+      return -1;
+    }
+    char header[JOURNAL_HEADER];
+    editor_journal_header(header);
+    struct iovec iov = {header, JOURNAL_HEADER};
+    if (editor_write_iov(j->fd, &iov, 1) == -1)
+    {
+      return -1;
+    }
+    /* the name must survive a crash as well as what is written to it */
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", j->path);
+    int dirfd = open(dirname(dir), O_RDONLY);
+    if (dirfd != -1)
+    {
+      fsync(dirfd);
+      close(dirfd);
+    }
+  }
+  unsigned int frame[2] = {j->pending.len,
+                           journal_checksum(j->pending.b, j->pending.len)};
+  struct iovec iov[2] = {{frame, sizeof(frame)}, {j->pending.b, j->pending.len}};
+  if (editor_write_iov(j->fd, iov, 2) == -1)
+  {
+    return -1;
+  }
+  ab_reset(&j->pending);
+  return 0;
+}
+
+/**
+ * @brief Write out the buffered records of the buffer shown and sync the
+ * journal, if anything was added since it was last synced
+ */
+void editor_journal_sync()
+{
+  EditorJournal *j = &E.journal;
+  if (j->path == NULL || j->since == 0)
+  {
+    return;
+  }
+  long long start = perf_start();
+  long long bytes = j->pending.len;
+  if (editor_journal_write() == -1 || fdatasync(j->fd) == -1)
+  {
+    editor_journal_fail(errno);
+    return;
+  }
+  j->since = 0;
+  perf_stop(PERF_JOURNAL, start, bytes);
+}
+
+/**
+ * @brief Note a record added to the buffer, writing a frame out once
+ * enough of them are
+ */
+void editor_journal_added()
+{
+  EditorJournal *j = &E.journal;
+  if (j->since == 0)
+  {
+    j->since = editor_now_ms();
+  }
+  if (j->pending.len >= ED9T_JOURNAL_BATCH)
+  {
+    long long start = perf_start();
+    long long bytes = j->pending.len;
+    if (editor_journal_write() == -1)
+    {
+      editor_journal_fail(errno);
+      return;
+    }
+    perf_stop(PERF_JOURNAL, start, bytes);
+  }
+}
+
+/**
+ * @brief Start a record in the buffer, its text is appended by the caller
+ */
+void editor_journal_begin(int kind, int y, int x, int len)
+{
+  AppendBuffer *ab = &E.journal.pending;
+  char k = kind;
+  ab_append(ab, &k, 1);
+  undo_put_varint(ab, y);
+  undo_put_varint(ab, x);
+  undo_put_varint(ab, len);
+}
+
+/**
+ * @brief Journal an edit of the text of row y, or the insertion of a single
+ * row with text s, as editor_undo_record records it
+ */
+void editor_journal_record(int kind, int y, int x, const char *s, int len)
+{
+  EditorJournal *j = &E.journal;
+  if (j->path == NULL || j->replaying)
+  {
+    return;
+  }
+  editor_journal_begin(kind, y, x, len);
+  ab_append(&j->pending, s, len);
+  editor_journal_added();
+}
+
+/**
+ * @brief Journal the insertion of the n rows from y, with their text joined
+ * by newlines, or their deletion
+ */
+void editor_journal_record_rows(int kind, int y, int n)
+{
+  EditorJournal *j = &E.journal;
+  if (j->path == NULL || j->replaying)
+  {
+    return;
+  }
+  if (kind == UNDO_DELETE_ROWS)
+  {
+    editor_journal_begin(kind, y, n, 0);
+    editor_journal_added();
+    return;
+  }
+  EditorRow *first = editor_row_at(y);
+  EditorRow *row = first;
+  int len = n - 1;
+  int i;
+  for (i = 0; i < n; i++, row = editor_row_next(row))
+  {
+    len += row->size;
+  }
+  editor_journal_begin(kind, y, n, len);
+  for (i = 0, row = first; i < n; i++, row = editor_row_next(row))
+  {
+    if (i > 0)
+    {
+      ab_append(&j->pending, "\n", 1);
+    }
+    ab_append(&j->pending, row->chars, row->size);
+  }
+  editor_journal_added();
+}
+
+/**
+ * @brief Get the time left before the journal is due to be synced
+ *
+ * @return ms to wait, -1 if there is nothing to sync
+ */
+int editor_journal_wait()
+{
+  EditorJournal *j = &E.journal;
+  if (j->path == NULL || j->since == 0)
+  {
+    return -1;
+  }
+  long long left = j->since + ED9T_JOURNAL_MS - editor_now_ms();
+  return left > 0 ? left : 0;
+}
+
+/**
+ * @brief Sync the journal if it is due
+ */
+void editor_journal_tick()
+{
+  if (editor_journal_wait() == 0)
+  {
+    editor_journal_sync();
+  }
+}
+
+/**
+ * @brief Apply the journal record at *p, moving *p past it
+ *
+ * @param end end of the frame the record is in
+ * @return 0 if the record doesn't fit the rows, and wasn't applied
+ */
+int editor_journal_apply(const unsigned char **p, const unsigned char *end)
+{
+  int kind = *(*p)++;
+  int y = undo_get_varint(p);
+  int x = undo_get_varint(p);
+  int len = undo_get_varint(p);
+  const char *text = (const char *)*p;
+  if (*p > end || len < 0 || len > end - *p || y < 0 || x < 0)
+  {
+    return 0;
+  }
+  *p += len;
+
+  if (kind == UNDO_INSERT || kind == UNDO_DELETE)
+  {
+    if (y >= E.numrows)
+    {
+      return 0;
+    }
+    EditorRow *row = editor_row_at(y);
+    if (kind == UNDO_INSERT)
+    {
+      if (x > row->size)
+      {
+        return 0;
+      }
+      editor_row_insert_string(row, x, text, len);
+    }
+    else
+    {
+      if (len > row->size - x)
+      {
+        return 0;
+      }
+      editor_row_del_chars(row, x, len);
+    }
+  }
+  else if (kind == UNDO_INSERT_ROWS)
+  {
+    if (y > E.numrows)
+    {
+      return 0;
+    }
+    int n;
+    EditorRow *rows = editor_rows_from_text(text, len, &n);
+    editor_insert_rows(y, rows, n);
+    editor_syntax_rows_changed(y, n, n);
+  }
+  else if (kind == UNDO_DELETE_ROWS)
+  {
+    if (x == 0 || x > E.numrows - y)
+    {
+      return 0;
+    }
+    editor_del_rows(y, x);
+  }
+  else
+  {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief Start journaling the file just opened, replaying the journal a
+ * crash left behind first if it is of this version of the file
+ *
+ * The replayed edits are one undo group, and the buffer is left modified.
+ * Journaling goes on at the end of the last intact frame.
+ *
+ * @param st the file as it was opened
+ */
+void editor_journal_open(struct stat *st)
+{
+  EditorJournal *j = &E.journal;
+  if (!ED9T_JOURNAL || !S_ISREG(st->st_mode))
+  {
+    return;
+  }
+  j->path = editor_journal_path(E.filename);
+  editor_journal_identify(st);
+  int fd = open(j->path, O_RDWR | O_CLOEXEC);
+  if (fd == -1)
+  {
+    return;
+  }
+  struct stat jst;
+  char *log = NULL;
+  ssize_t len = 0;
+  if (fstat(fd, &jst) == 0 && jst.st_size >= JOURNAL_HEADER)
+  {
+    log = malloc(jst.st_size);
+    if (log == NULL)
+    {
+      die("malloc");
+    }
+    ssize_t n;
+    while (len < jst.st_size &&
+           (n = read(fd, log + len, jst.st_size - len)) > 0)
+    {
+      len += n;
+    }
+  }
+  char header[JOURNAL_HEADER];
+  editor_journal_header(header);
+  if (len < JOURNAL_HEADER || memcmp(log, header, JOURNAL_HEADER) != 0)
+  {
+    /*
+    the first edit starts the journal over, so the edits in it are moved
+    aside first, to be recovered by hand
+    */
+    free(log);
+    close(fd);
+    if (len == 0)
+    {
+      return;
+    }
+    char old[PATH_MAX];
+    snprintf(old, sizeof(old), "%s.old", j->path);
+    if (rename(j->path, old) == -1)
+    {
+      /* journaling would write over it */
+      editor_set_status_message("Journal off, %.30s is of another version "
+                                "and can't be moved aside: %s", j->path,
+                                strerror(errno));
+      free(j->path);
+      j->path = NULL;
+      return;
+    }
+    editor_set_status_message("Journal %.30s is of another version, moved "
+                              "to .old", j->path);
+    return;
+  }
+
+  /* the edits are of lines anywhere in the file */
+  editor_load_finish();
+  long long start = editor_now_ns();
+  long long edits = 0;
+  int applies = 1;
+  int written = 1;
+  ssize_t off = JOURNAL_HEADER;
+  editor_undo_boundary();
+  j->replaying = 1;
+  while (applies && len - off >= 8)
+  {
+    unsigned int frame[2];
+    memcpy(frame, log + off, sizeof(frame));
+    if (frame[0] > len - off - 8 ||
+        journal_checksum(log + off + 8, frame[0]) != frame[1])
+    {
+      break;
+    }
+    const unsigned char *rec = (const unsigned char *)log + off + 8;
+    const unsigned char *end = rec + frame[0];
+    const unsigned char *p = rec;
+    while (p < end && (applies = editor_journal_apply(&p, end)))
+    {
+      rec = p;
+      edits++;
+    }
+    if (!applies)
+    {
+      /* the frame is cut down to the records that were applied */
+      frame[0] = rec - (const unsigned char *)log - off - 8;
+      frame[1] = journal_checksum(log + off + 8, frame[0]);
+      if (pwrite(fd, frame, sizeof(frame), off) != sizeof(frame))
+      {
+        written = 0;
+      }
+    }
+    off += 8 + frame[0];
+  }
+  j->replaying = 0;
+  editor_undo_boundary();
+  free(log);
+
+  /* what follows is torn, or of rows other than these */
+  if (!written || ftruncate(fd, off) == -1 || lseek(fd, off, SEEK_SET) == -1)
+  {
+    close(fd);
+    editor_journal_fail(errno);
+    return;
+  }
+  j->fd = fd;
+  editor_set_status_message("Recovered %lld edits from %.30s (%.2f s)%s",
+                            edits, j->path, (editor_now_ns() - start) / 1e9,
+                            applies ? "" : ", the rest doesn't apply");
+}
+
+/**
+ * @brief Stop journaling a buffer and remove its journal
+ */
+void editor_journal_remove(EditorJournal *j)
+{
+  if (j->fd != -1)
+  {
+    close(j->fd);
+    j->fd = -1;
+  }
+  if (j->path)
+  {
+    unlink(j->path);
+    free(j->path);
+    j->path = NULL;
+  }
+  ab_free(&j->pending);
+  j->since = 0;
+}
+
+/**
+ * @brief Start the journal over once the buffer was saved, the file being
+ * now at the version st
+ */
+void editor_journal_saved(struct stat *st)
+{
+  EditorJournal *j = &E.journal;
+  if (!ED9T_JOURNAL)
+  {
+    return;
+  }
+  if (j->path)
+  {
+    editor_journal_remove(j);
+  }
+  j->path = editor_journal_path(E.filename);
+  editor_journal_identify(st);
+}
+
+/*** WATCH ***/
+
+/*
+other programs change the files that are open, logs grow and generated
+code gets written again. the directory of the file of every buffer is
+watched with inotify, and once an event names the file of a buffer without
+unsaved changes, the file is read again as cheaply as its change allows:
+a file that grew in place, as a log does, has only its new bytes read and
+added as rows, once the bytes it had are found alike at both ends. a file
+replaced by another, as most programs write one, keeps the rows it starts
+and ends with alike, with their renders, highlighting and line numbers,
+and only the rows between them are swapped.
+anything else, and a replacement that changed most of the file, is loaded
+again in full. the rows of a replaced file keep pointing into its mapping,
+which the descriptor kept for editor_save holds on to, but a file rewritten
+in place changes under its mapping, so it is loaded again.
+*/
+
+/**
+ * @brief Hash the first and last ED9T_WATCH_PROBE bytes of the first size
+ * bytes of a file
+ *
+ * @return unsigned long long the hash, 0 if the bytes can't be read
+ */
+unsigned long long editor_watch_probe(int fd, long long size)
+{
+  char buf[2 * ED9T_WATCH_PROBE];
+  long long head = size < ED9T_WATCH_PROBE ? size : ED9T_WATCH_PROBE;
+  long long tail = size - head < ED9T_WATCH_PROBE ? size - head
+                                                  : ED9T_WATCH_PROBE;
+  if (pread(fd, buf, head, 0) != head ||
+      pread(fd, buf + head, tail, size - tail) != tail)
+  {
+    return 0;
+  }
+  /* FNV-1a */
+  unsigned long long h = 14695981039346656037ULL;
+  int i;
+  for (i = 0; i < head + tail; i++)
+  {
+    h = (h ^ (unsigned char)buf[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/**
+ * @brief Note the version of the file that the rows of the buffer match
+ */
+void editor_watch_identify(struct stat *st)
+{
+  E.watch.size = st->st_size;
+  E.watch.mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+  E.watch.ino = st->st_ino;
+  E.watch.probe = 0;
+  int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  if (fd != -1)
+  {
+    /* the ends of a file that grew since st are still those of st */
+    struct stat now;
+    if (fstat(fd, &now) == 0 && now.st_ino == st->st_ino &&
+        now.st_size >= st->st_size)
+    {
+      E.watch.probe = editor_watch_probe(fd, st->st_size);
+    }
+    close(fd);
+  }
+}
+
+/**
+ * @brief Watch the file of the buffer, once it was opened or saved as the
+ * version st
+ */
+void editor_watch_open(struct stat *st)
+{
+  EditorWatch *w = &E.watch;
+  if (!ED9T_WATCH || !S_ISREG(st->st_mode))
+  {
+    return;
+  }
+  editor_watch_identify(st);
+  char target[PATH_MAX];
+  if (realpath(E.filename, target) == NULL)
+  {
+    return;
+  }
+  if (E.watchfd == -1 &&
+      (E.watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+  {
+    return;
+  }
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", target);
+  /* the buffers of the files of a directory share its watch */
+  int wd = inotify_add_watch(E.watchfd, dirname(dir),
+                             IN_MODIFY | IN_CREATE | IN_MOVED_TO);
+  if (wd == -1)
+  {
+    return;
+  }
+  free(w->name);
+  w->name = strdup(basename(target));
+  w->wd = wd;
+  w->changed = 0;
+}
+
+/**
+ * @brief Mark the buffers whose file an event named, every buffer if wd is
+ * -1
+ */
+void editor_watch_mark(int wd, const char *name)
+{
+  int i;
+  for (i = 0; i < E.nbuffers; i++)
+  {
+    EditorWatch *w = i == E.curbuf ? &E.watch : &E.buffers[i].watch;
+    if (w->name && (wd == -1 || (w->wd == wd && strcmp(w->name, name) == 0)))
+    {
+      w->changed = 1;
+    }
+  }
+}
+
+/**
+ * @brief Read the events that arrived, marking the buffers they name
+ */
+void editor_watch_poll()
+{
+  if (E.watchfd == -1)
+  {
+    return;
+  }
+  union
+  {
+    struct inotify_event ev;
+    char b[4096];
+  } buf;
+  ssize_t n;
+  while ((n = read(E.watchfd, buf.b, sizeof(buf.b))) > 0)
+  {
+    char *p = buf.b;
+    while (p < buf.b + n)
+    {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+        editor_watch_mark(-1, NULL);
+      }
+      else if (ev->len)
+      {
+        editor_watch_mark(ev->wd, ev->name);
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
+
+/**
+ * @brief Drop the \r of the lines of rows made out of a file's text
+ */
+void editor_watch_strip_cr(EditorRow *rows, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+  {
+    while (rows[i].size > 0 && rows[i].chars[rows[i].size - 1] == '\r')
+    {
+      rows[i].size--;
+    }
+    rows[i].chars[rows[i].size] = '\0';
+  }
+}
+
+/**
+ * @brief Add the lines of the file from byte size on, where it ended when
+ * it was read, as rows
+ *
+ * If the file didn't end with a newline the first of them goes to the end
+ * of the last row.
+ *
+ * @return int 0 if done, -1 if the bytes could not be read
+ */
+int editor_watch_append(int fd, long long size, long long newsize)
+{
+  char last = '\n';
+  if (size > 0 && pread(fd, &last, 1, size - 1) != 1)
+  {
+    return -1;
+  }
+  size_t len = newsize - size;
+  char *text = malloc(len);
+  if (text == NULL)
+  {
+    die("malloc");
+  }
+  size_t got = 0;
+  ssize_t n;
+  while (got < len && (n = pread(fd, text + got, len - got, size + got)) > 0)
+  {
+    got += n;
+  }
+  if (got < len)
+  {
+    free(text);
+    return -1;
+  }
+
+  /* the rows before keep their undo records, their positions stay */
+  char *p = text;
+  char *end = text + len;
+  if (last != '\n' && E.numrows > 0)
+  {
+    char *nl = memchr(p, '\n', end - p);
+    char *eol = nl ? nl : end;
+    while (eol > p && eol[-1] == '\r')
+    {
+      eol--;
+    }
+    editor_row_append_string(editor_row_at(E.numrows - 1), p, eol - p);
+    p = nl ? nl + 1 : end;
+  }
+  if (p < end)
+  {
+    int at = E.numrows;
+    int rows;
+    EditorRow *added = editor_rows_from_text(p, end - p - (end[-1] == '\n'),
+                                             &rows);
+    editor_watch_strip_cr(added, rows);
+    editor_insert_rows(at, added, rows);
+    editor_syntax_rows_changed(at, rows, rows);
+  }
+  free(text);
+  return 0;
+}
+
+/**
+ * @brief Swap the rows between those that the rows and the text of a file
+ * that replaced theirs start and end with alike
+ *
+ * The cursor and the first row shown keep to their rows.
+ *
+ * @return int 0 if done, -1 if most rows would be swapped, leaving nothing
+ * to gain over loading the file again
+ */
+int editor_watch_diff(const char *text, size_t len)
+{
+  const char *p = text;
+  const char *end = text + len;
+  int head = 0;
+  EditorRow *row = E.numrows ? editor_row_at(0) : NULL;
+  while (row && p < end)
+  {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *eol = nl ? nl : end;
+    while (eol > p && eol[-1] == '\r')
+    {
+      eol--;
+    }
+    if (row->size != eol - p || memcmp(row->chars, p, eol - p) != 0)
+    {
+      break;
+    }
+    head++;
+    p = nl ? nl + 1 : end;
+    row = editor_row_next(row);
+  }
+
+  /* q is the start of the lines the text ends with alike */
+  const char *q = end;
+  int tail = 0;
+  row = E.numrows > head ? editor_row_at(E.numrows - 1) : NULL;
+  while (row && q > p && head + tail < E.numrows)
+  {
+    const char *eol = q[-1] == '\n' ? q - 1 : q;
+    const char *s = eol > p ? memrchr(p, '\n', eol - p) : NULL;
+    s = s ? s + 1 : p;
+    const char *e = eol;
+    while (e > s && e[-1] == '\r')
+    {
+      e--;
+    }
+    if (row->size != e - s || memcmp(row->chars, s, e - s) != 0)
+    {
+      break;
+    }
+    tail++;
+    q = s;
+    row = editor_row_prev(row);
+  }
+
+  int removed = E.numrows - head - tail;
+  if (2 * removed > E.numrows)
+  {
+    return -1;
+  }
+  int added = 0;
+  int oldrows = E.numrows;
+  editor_del_rows(head, removed);
+  if (q > p)
+  {
+    EditorRow *rows = editor_rows_from_text(p, q - p - (q[-1] == '\n'),
+                                            &added);
+    editor_watch_strip_cr(rows, added);
+    editor_insert_rows(head, rows, added);
+    editor_syntax_rows_changed(head, added, added);
+  }
+
+  if (E.cy >= oldrows - tail)
+  {
+    E.cy += added - removed;
+  }
+  else if (E.cy >= head + added)
+  {
+    E.cy = head + added;
+  }
+  if (E.rowoff >= oldrows - tail)
+  {
+    E.rowoff += added - removed;
+  }
+  return 0;
+}
+
+/**
+ * @brief Free every row node of the subtree t
+ */
+void editor_watch_free_rows(EditorRow *t)
+{
+  if (t == NULL)
+  {
+    return;
+  }
+  editor_watch_free_rows(t->left);
+  editor_watch_free_rows(t->right);
+  editor_free_row(t);
+  row_tree_free(t);
+}
+
+/**
+ * @brief Throw the rows away and load the file again from fd, keeping the
+ * cursor where it was as far as the file still goes
+ */
+void editor_watch_reload(int fd, struct stat *st)
+{
+  /* the reader is still looking at the old mapping */
+  editor_load_finish();
+  editor_search_reset();
+  editor_watch_free_rows(E.rowroot);
+  if (E.map)
+  {
+    munmap(E.map, E.maplen);
+  }
+  if (E.mapfd != -1)
+  {
+    close(E.mapfd);
+  }
+  E.rowroot = NULL;
+  E.numrows = 0;
+  E.map = NULL;
+  E.maplen = 0;
+  E.mapfd = -1;
+  E.large = 0;
+  E.span_rows = 0;
+  E.syntax_rows = 0;
+  E.syntax_resume = 0;
+  E.syntax_gen++;
+  editor_select_syntax_highlight();
+  editor_open_fd(fd, st);
+}
+
+/**
+ * @brief Read the file of the buffer shown again if an event named it and
+ * it is not the version the rows match
+ *
+ * A buffer with unsaved changes is left as it is, the change is only
+ * pointed out. With the cursor on the last row, it stays on the last row
+ * as lines are added, like tail -f.
+ *
+ * @return int 1 if the rows were changed
+ */
+int editor_watch_check()
+{
+  EditorWatch *w = &E.watch;
+  editor_watch_poll();
+  if (!w->changed)
+  {
+    return 0;
+  }
+  w->changed = 0;
+  int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+  {
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      (st.st_ino == (ino_t)w->ino && st.st_size == w->size &&
+       st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == w->mtime))
+  {
+    close(fd);
+    return 0;
+  }
+  if (E.dirty)
+  {
+    editor_watch_identify(&st);
+    editor_set_status_message("%.30s changed on disk, not reloaded over "
+                              "unsaved changes", E.filename);
+    close(fd);
+    return 0;
+  }
+
+  long long start = editor_now_ns();
+  int oldrows = E.numrows;
+  int follow = E.cy >= E.numrows - 1;
+  const char *how = "reloaded";
+  int appended = 0;
+  /* the rows match the file again, none of this is an edit */
+  E.undo.replaying = 1;
+  E.journal.replaying = 1;
+  int done = 0;
+  /* a file rewritten in place to something longer is no append */
+  if (st.st_ino == (ino_t)w->ino && st.st_size > w->size &&
+      editor_watch_probe(fd, w->size) == w->probe)
+  {
+    editor_load_finish();
+    if (editor_watch_append(fd, w->size, st.st_size) == 0)
+    {
+      how = "appended";
+      appended = done = 1;
+      if (follow && E.numrows > 0)
+      {
+        E.cy = E.numrows - 1;
+      }
+    }
+  }
+  else if (st.st_ino != (ino_t)w->ino && !E.large)
+  {
+    const char *text = "";
+    if (st.st_size > 0)
+    {
+      text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (text != MAP_FAILED)
+    {
+      editor_search_reset();
+      done = editor_watch_diff(text, st.st_size) == 0;
+      how = "changed";
+      if (st.st_size > 0)
+      {
+        munmap((void *)text, st.st_size);
+      }
+    }
+  }
+  if (done)
+  {
+    close(fd);
+  }
+  else
+  {
+    editor_watch_reload(fd, &st);
+  }
+  E.undo.replaying = 0;
+  E.journal.replaying = 0;
+  if (!appended)
+  {
+    editor_undo_reset();
+  }
+
+  E.dirty = 0;
+  if (E.cy > E.numrows)
+  {
+    E.cy = E.numrows;
+  }
+  if (E.rowoff > E.cy)
+  {
+    E.rowoff = E.cy;
+  }
+  int size = E.cy < E.numrows ? editor_row_at(E.cy)->size : 0;
+  if (E.cx > size)
+  {
+    E.cx = size;
+  }
+  editor_watch_identify(&st);
+  editor_journal_saved(&st);
+  editor_set_status_message("%.30s %s on disk, %+d lines (%.2f ms)",
+                            E.filename, how, E.numrows - oldrows,
+                            (editor_now_ns() - start) / 1e6);
+  return 1;
+}
+
+/*** BUFFERS ***/
+
+/*
+every open file is a buffer. the fields of E that belong to a buffer (see
+EditorBuffer) always hold the buffer that is shown, and switching stores
+them into its slot of E.buffers and loads those of the other buffer. the
+row storage, the render cache, the compiled syntax tables and the screen
+are shared by all buffers. the render cache keeps the rows of a buffer
+that was switched away from until the budget needs the room, so switching
+back usually finds the screen's rows still rendered, and the comment
+states of the rest are carried on lazily as they were before.
+*/
+
+/**
+ * @brief Copy the buffer fields of E into a buffer slot
+ */
+void editor_buffer_store(EditorBuffer *b)
+{
+  b->cx = E.cx;
+  b->cy = E.cy;
+  b->rowoff = E.rowoff;
+  b->coloff = E.coloff;
+  b->numrows = E.numrows;
+  b->rowroot = E.rowroot;
+  b->map = E.map;
+  b->maplen = E.maplen;
+  b->mapfd = E.mapfd;
+  b->large = E.large;
+  b->span_rows = E.span_rows;
+  b->span_limit = E.span_limit;
+  b->load = E.load;
+  b->syntax_rows = E.syntax_rows;
+  b->syntax_resume = E.syntax_resume;
+  b->dirty = E.dirty;
+  b->filename = E.filename;
+  b->syntax = E.syntax;
+  b->search = E.search;
+  b->undo = E.undo;
+  b->journal = E.journal;
+  b->watch = E.watch;
+}
+
+/**
+ * @brief Copy a buffer slot into the buffer fields of E
+ */
+void editor_buffer_load(EditorBuffer *b)
+{
+  E.cx = b->cx;
+  E.cy = b->cy;
+  E.rowoff = b->rowoff;
+  E.coloff = b->coloff;
+  E.numrows = b->numrows;
+  E.rowroot = b->rowroot;
+  E.map = b->map;
+  E.maplen = b->maplen;
+  E.mapfd = b->mapfd;
+  E.large = b->large;
+  E.span_rows = b->span_rows;
+  E.span_limit = b->span_limit;
+  E.load = b->load;
+  E.syntax_rows = b->syntax_rows;
+  E.syntax_resume = b->syntax_resume;
+  E.dirty = b->dirty;
+  E.filename = b->filename;
+  E.syntax = b->syntax;
+  E.search = b->search;
+  E.undo = b->undo;
+  E.journal = b->journal;
+  E.watch = b->watch;
+}
+
+/**
+ * @brief Set the buffer fields of E to those of an empty buffer
+ *
+ * The fields are overwritten, not freed, they must have been stored first.
+ */
+void editor_buffer_reset()
+{
+  E.cx = 0;
+  E.cy = 0;
+  E.rx = 0;
+  E.rowoff = 0;
+  E.coloff = 0;
+  E.numrows = 0;
+  E.rowroot = NULL;
+  E.map = NULL;
+  E.maplen = 0;
+  E.mapfd = -1;
+  E.large = 0;
+  E.span_rows = 0;
+  E.span_limit = ED9T_LARGE_ROWS;
+  E.load = NULL;
+  E.syntax_rows = 0;
+  E.syntax_resume = 0;
+  E.dirty = 0;
+  E.filename = NULL;
+  E.syntax = NULL;
+  E.undo.log.b = NULL;
+  E.undo.log.len = 0;
+  E.undo.log.cap = 0;
+  E.undo.pos = 0;
+  E.undo.pos_y = 0;
+  E.undo.open = 0;
+  E.undo.replaying = 0;
+  E.journal.path = NULL;
+  E.journal.fd = -1;
+  E.journal.pending.b = NULL;
+  E.journal.pending.len = 0;
+  E.journal.pending.cap = 0;
+  E.journal.since = 0;
+  E.journal.replaying = 0;
+  E.watch.wd = -1;
+  E.watch.name = NULL;
+  E.watch.changed = 0;
+  E.watch.probe = 0;
+  E.search.query = NULL;
+  E.search.re = NULL;
+  E.search.matches = NULL;
+  E.search.cap = 0;
+  E.search.hl_row = NULL;
+  editor_search_reset();
+}
+
+/**
+ * @brief Show the buffer in slot i
+ */
+void editor_buffer_switch(int i)
+{
+  if (i == E.curbuf)
+  {
+    return;
+  }
+  /* only the journal of the buffer shown is synced on time */
+  editor_journal_sync();
+  editor_buffer_store(&E.buffers[E.curbuf]);
+  E.curbuf = i;
+  editor_buffer_load(&E.buffers[i]);
+  /* a slice the worker copied from the other buffer must not be stored */
+  E.syntax_gen++;
+  editor_invalidate_screen();
+  editor_set_status_message("Buffer %d/%d: %.40s", i + 1, E.nbuffers,
+                            E.filename ? E.filename : "[No Name]");
+}
+
+/**
+ * @brief Add an empty buffer and show it
+ */
+void editor_buffer_new()
+{
+  E.buffers = realloc(E.buffers, sizeof(EditorBuffer) * (E.nbuffers + 1));
+  if (E.buffers == NULL)
+  {
+    die("realloc");
+  }
+  editor_journal_sync();
+  editor_buffer_store(&E.buffers[E.curbuf]);
+  E.curbuf = E.nbuffers++;
+  editor_buffer_reset();
+  E.syntax_gen++;
+  editor_invalidate_screen();
+}
+
+/**
+ * @brief Show the buffer after the one shown, wrapping around
+ */
+void editor_buffer_next()
+{
+  if (E.nbuffers == 1)
+  {
+    editor_set_status_message("No other buffers, Ctrl-O opens one");
+    return;
+  }
+  editor_buffer_switch((E.curbuf + 1) % E.nbuffers);
+}
+
+/**
+ * @brief Check if any buffer has unsaved changes
+ */
+int editor_buffers_dirty()
+{
+  int i;
+  for (i = 0; i < E.nbuffers; i++)
+  {
+    if (i == E.curbuf ? E.dirty : E.buffers[i].dirty)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Remove the journals of every buffer, when quitting
+ */
+void editor_buffers_remove_journals()
+{
+  int i;
+  for (i = 0; i < E.nbuffers; i++)
+  {
+    editor_journal_remove(i == E.curbuf ? &E.journal : &E.buffers[i].journal);
+  }
+}
+
+/**
+ * @brief Prompt for a file and open it in a new buffer, or in the one shown
+ * if that is still empty
+ */
+void editor_buffer_open()
+{
+  char *name = editor_prompt("Open: %s (ESC to cancel)", 0, NULL);
+  if (name == NULL)
+  {
+    editor_set_status_message("Open aborted");
+    return;
+  }
+  if (access(name, R_OK) == -1)
+  {
+    editor_set_status_message("Can't open %.40s: %s", name, strerror(errno));
+    free(name);
+    return;
+  }
+  if (E.filename || E.numrows || E.dirty)
+  {
+    editor_buffer_new();
+  }
+  /* set first, so that a recovery from the journal is what shows */
+  editor_set_status_message("Buffer %d/%d: %.40s", E.curbuf + 1, E.nbuffers,
+                            name);
+  editor_open(name);
+  free(name);
+}
+
+/*** INPUT ***/
+
+/**
+ * @brief Collect the text of a bracketed paste into E.paste
+ *
+ * Called once editor_read_key has seen ESC[200~, reads everything up to the
+ * closing ESC[201~ in as few reads as the terminal allows. Line breaks are
+ * sent as \r by most terminals, they are turned into \n here.
+ */
+void editor_read_paste()
+{
+  static const char endseq[] = "\x1b[201~";
+  const int endlen = sizeof(endseq) - 1;
+  ab_reset(&E.paste);
+  while (E.inpos < E.inlen || editor_fill_input(ED9T_PASTE_TIMEOUT_MS) > 0)
+  {
+    int start = E.paste.len;
+    ab_append(&E.paste, E.inbuf + E.inpos, E.inlen - E.inpos);
+    E.inpos = E.inlen;
+
+    /* the end marker may have been split between two reads */
+    int from = start > endlen ? start - endlen : 0;
+    char *found = memmem(E.paste.b + from, E.paste.len - from, endseq, endlen);
+    if (found)
+    {
+      /* anything after the marker is typed input, give it back */
+      int keep = found - E.paste.b;
+      E.inpos = E.inlen - (E.paste.len - keep - endlen);
+      E.paste.len = keep;
+      break;
+    }
+  }
+
+  int i, n = 0;
+  for (i = 0; i < E.paste.len; i++)
+  {
+    char c = E.paste.b[i];
+    if (c == '\r')
+    {
+      if (i + 1 < E.paste.len && E.paste.b[i + 1] == '\n')
+      {
+        continue;
+      }
+      c = '\n';
+    }
+    E.paste.b[n++] = c;
+  }
+  E.paste.len = n;
+}
+
+/**
+ * @brief Wait until there is input to decode
+ *
+ * While background work is pending it is run in small steps between
+ * non-blocking polls, with the screen redrawn every ED9T_IDLE_REFRESH_MS so
+ * its progress shows. Otherwise this blocks in poll until input arrives,
+ * until the journal is due to be synced, or until a watched file changes.
+ */
+void editor_wait_input()
+{
+  long long last = editor_now_ms();
+  int worked = 0;
+  while (E.inpos == E.inlen)
+  {
+    editor_journal_tick();
+    if (editor_watch_check())
+    {
+      worked = 1;
+    }
+    int searching = editor_search_busy();
+    int loading = E.load != NULL;
+    if (!searching && !loading && !editor_hl_worker_pending())
+    {
+      if (worked)
+      {
+        editor_refresh_screen();
+        worked = 0;
+      }
+      /* wake up to sync the journal when it is due */
+      editor_fill_input(editor_journal_wait());
+      continue;
+    }
+    /* the worker runs while this waits, so there is nothing to step */
+    if (editor_fill_input(searching ? 0 : ED9T_IDLE_REFRESH_MS) > 0)
+    {
+      break;
+    }
+    if (searching)
+    {
+      editor_search_idle();
+    }
+    if (loading)
+    {
+      editor_load_step();
+    }
+    worked = 1;
+    if (editor_now_ms() - last >= ED9T_IDLE_REFRESH_MS)
+    {
+      editor_refresh_screen();
+      last = editor_now_ms();
+      worked = 0;
+    }
+  }
+}
+
+char *editor_prompt(char *prompt, int empty, void (*callback)(char *, int))
+{
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
+  size_t buflen = 0;
+  buf[0] = '\0';
+  while (1)
+  {
+    editor_set_status_message(prompt, buf);
+    /* keys typed or pasted together are drawn as one frame */
+    if (!editor_input_pending(editor_frame_wait()))
+    {
+      editor_refresh_screen();
+    }
+    int c = editor_read_key();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+    {
+      if (buflen != 0)
+        buf[--buflen] = '\0';
+    }
+    else if (c == '\x1b')
+    {
+      editor_set_status_message("");
+      if (callback)
+      {
+        callback(buf, c);
+      }
+      free(buf);
+      return NULL;
+    }
+    else if (c == '\r')
+    {
+      if (buflen != 0 || empty)
+      {
+        editor_set_status_message("");
+        if (callback)
+        {
+          callback(buf, c);
+        }
+        return buf;
+      }
+    }
+    else if (c == PASTE_KEY)
+    {
+      /* take the first line of the pasted text */
+      int i;
+      for (i = 0; i < E.paste.len && E.paste.b[i] != '\n'; i++)
+      {
+        if (iscntrl((unsigned char)E.paste.b[i]) || E.paste.b[i] & 0x80)
+        {
+          continue;
+        }
+        if (buflen == bufsize - 1)
+        {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = E.paste.b[i];
+      }
+      buf[buflen] = '\0';
+    }
+    else if (!iscntrl(c) && c < 128)
+    {
+      if (buflen == bufsize - 1)
+      {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+    if (callback)
+    {
+      callback(buf, c);
+    }
+  }
+}
+
+/**
+ * @brief Prompt for a line number and move the cursor to the start of that
+ * line, which is shown at the top of the screen
+ */
+void editor_goto_line()
+{
+  char *line = editor_prompt("Go to line: %s (ESC to cancel)", 0, NULL);
+  if (line == NULL)
+  {
+    return;
+  }
+  int n = atoi(line);
+  free(line);
+  if (n > E.numrows)
+  {
+    n = E.numrows;
+  }
+  E.cy = n > 0 ? n - 1 : 0;
+  E.cx = 0;
+  E.rowoff = E.cy;
+}
+
+/**
+ * @brief Move the cursor based on which key is pressed
+ *
+ * @param
+ */
+void editor_move_cursor(int key)
+{
+  EditorRow *row = editor_row_at(E.cy);
+
+  switch (key)
+  {
+  case ARROW_UP:
+    if (E.cy != 0)
+    {
+      E.cy--;
+    }
+    break;
+  case ARROW_DOWN:
+    if (E.cy < E.numrows)
+    {
+      E.cy++;
+    }
+    break;
+  case ARROW_LEFT:
+    if (E.cx != 0)
+    {
+      E.cx--;
+    }
+    else if (E.cy > 0)
+    {
+      E.cy--;
+      E.cx = editor_row_at(E.cy)->size;
+    }
+    break;
+  case ARROW_RIGHT:
+    if (row && E.cx < row->size)
+    {
+      E.cx++;
+    }
+    else if (row && E.cx == row->size)
+    {
+      E.cy++;
+      E.cx = 0;
+    }
+    break;
+  }
+
+  row = editor_row_at(E.cy);
+  int rowlen = row ? row->size : 0;
+  if (E.cx > rowlen)
+  {
+    E.cx = rowlen;
+  }
+}
+
+/**
+ * @brief Apply a key that edits the text or moves the cursor, any key
+ * without a meaning of its own is inserted as a character
+ *
+ * These are the keys that the library takes as well, see ed9_key.
+ */
+void editor_edit_key(int c)
+{
+  switch (c)
+  {
+  case '\r':
+    editor_insert_newline();
+    break;
+
+  case CTRL_KEY('z'):
+    editor_undo();
+    break;
+  case CTRL_KEY('y'):
+    editor_redo();
+    break;
+
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    /*
+    if it is the DEL key, then move forward one char
+    and then delete the previous character
+    */
+    if (c == DEL_KEY)
+    {
+      editor_move_cursor(ARROW_RIGHT);
+    }
+    editor_del_char();
+    break;
+
+    /*
+    pageup and pagedown move the cursor to top and bottom
+    of the screen
+    */
+  case PAGE_UP:
+  case PAGE_DOWN:
+  {
+    if (c == PAGE_UP)
+    {
+      E.cy = E.rowoff;
+    }
+    else if (c == PAGE_DOWN)
+    {
+      E.cy = E.rowoff + E.screenrows - 1;
+      if (E.cy > E.numrows)
+      {
+        E.cy = E.numrows;
+      }
+    }
+
+    int times = E.screenrows;
+    while (times--)
+    {
+      editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+    }
+  }
+  break;
+
+  case HOME_KEY:
+    E.cx = 0;
+    break;
+  case END_KEY:
+    if (E.cy < E.numrows)
+    {
+      E.cx = editor_row_at(E.cy)->size;
+    }
+    break;
+
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+    editor_move_cursor(c);
+    break;
+
+  default:
+    editor_insert_char(c);
+    break;
+  }
+}
+
+/**
+ * @brief read the editor keypress and process it
+ * to convert it to editor commands
+ */
+void editor_process_keypress()
+{
+  static int quit_times = ED9T_QUIT_TIMES;
+  int c = editor_read_key();
+  perf_count(PERF_KEYS, 1);
+
+  /* characters typed one after another are undone together */
+  int typing = (c >= 32 && c < 127) || c == '\t';
+  if (!typing)
+  {
+    editor_undo_boundary();
+  }
+
+  switch (c)
+  {
+  case CTRL_KEY('q'):
+    if (editor_buffers_dirty() && quit_times > 0)
+    {
+      editor_set_status_message("WARNING!!! File has unsaved changes. "
+                                "Press Ctrl-Q %d more times to quit.",
+                                quit_times);
+      quit_times--;
+      return;
+    }
+
+    /* changes given up on are not recovered either */
+    editor_buffers_remove_journals();
+
+    /* clear the screen with the J command and argument 2 */
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    /* reposition the cursor to the top left with the H command */
+    write(STDOUT_FILENO, "\x1b[H", 3);
+
+    exit(0);
+    break;
+
+  case PASTE_KEY:
+    editor_insert_text(E.paste.b, E.paste.len);
+    break;
+
+  case CTRL_KEY('s'):
+    editor_save();
+    break;
+
+  case CTRL_KEY('f'):
+    editor_find();
+    break;
+  case CTRL_KEY('r'):
+    editor_replace();
+    break;
+
+  case CTRL_KEY('g'):
+    editor_goto_line();
+    break;
+
+  case CTRL_KEY('l'):
+    /* repaint the whole screen */
+    editor_invalidate_screen();
+    break;
+
+  case CTRL_KEY('o'):
+    editor_buffer_open();
+    break;
+  case CTRL_KEY('n'):
+    editor_buffer_next();
+    break;
+
+  case CTRL_KEY('p'):
+    /* show or hide the perf counters in the status bar */
+    E.perf.hud = ED9T_PERF && !E.perf.hud;
+    break;
+
+  case '\x1b':
+    break;
+
+  default:
+    editor_edit_key(c);
+    break;
+  }
+
+  if (!typing)
+  {
+    editor_undo_boundary();
+  }
+  quit_times = ED9T_QUIT_TIMES;
+}
+
+/*** OUTPUT ***/
+
+void editor_scroll()
+{
+  E.rx = 0;
+  if (E.cy < E.numrows)
+  {
+    /* the row is about to be drawn, its render brings the column map */
+    EditorRow *row = editor_row_at(E.cy);
+    editor_row_prepare_render(row);
+    E.rx = editor_row_cx_to_rx(row, E.cx);
+  }
+
+  if (E.cy < E.rowoff)
+  {
+    E.rowoff = E.cy;
+  }
+  if (E.cy >= E.rowoff + E.screenrows)
+  {
+    E.rowoff = E.cy - E.screenrows + 1;
+  }
+  if (E.rx < E.coloff)
+  {
+    E.coloff = E.rx;
+  }
+  if (E.rx >= E.coloff + E.screencols)
+  {
+    E.coloff = E.rx - E.screencols + 1;
+  }
+}
+
+/* the SGR sequence that selects the color of every highlight class */
+struct
+{
+  char seq[8];
+  int len;
+  int color;
+} hl_sgr[256];
+
+/**
+ * @brief Format the SGR sequences of the highlight classes once, so drawing
+ * a row never has to format a color
+ */
+void editor_init_sgr_table()
+{
+  for (int hl = 0; hl < 256; hl++)
+  {
+    if (hl == HL_NORMAL)
+    {
+      /* normal text uses the default foreground color */
+      hl_sgr[hl].color = -1;
+      hl_sgr[hl].len = snprintf(hl_sgr[hl].seq, sizeof(hl_sgr[hl].seq), "\x1b[39m");
+    }
+    else
+    {
+      hl_sgr[hl].color = editor_syntax_to_color(hl);
+      hl_sgr[hl].len = snprintf(hl_sgr[hl].seq, sizeof(hl_sgr[hl].seq), "\x1b[%dm",
+                                hl_sgr[hl].color);
+    }
+  }
+}
+
+/**
+ * @brief Draw the rows of the editor, each screen row into its own buffer
+ *
+ * @param lines array of E.screenrows empty append buffers
+ */
+void editor_draw_rows(AppendBuffer *lines)
+{
+  EditorRow *row = editor_row_at(E.rowoff);
+  for (int y = 0; y < E.screenrows; y++)
+  {
+    AppendBuffer *ab = &lines[y];
+    int filerow = y + E.rowoff;
+    if (filerow >= E.numrows)
+    {
+      if (E.numrows == 0 && y == E.screenrows / 3)
+      {
+        char welcome[80];
+        int welcomelen = snprintf(welcome, sizeof(welcome), ED9T_WELCOME_MESSAGE, ED9T_VERSION);
+        if (welcomelen > E.screencols)
+        {
+          welcomelen = E.screencols;
+        }
+        int padding = (E.screencols - welcomelen) / 2;
+        if (padding)
+        {
+          ab_append(ab, "~", 1);
+          padding--;
+        }
+        while (padding--)
+        {
+          ab_append(ab, " ", 1);
+        }
+        ab_append(ab, welcome, welcomelen);
+      }
+      else
+      {
+        ab_append(ab, "~", 1);
+      }
+    }
+    else
+    {
+      int base = editor_row_prepare_hl(row, E.coloff,
+                                       E.coloff + E.screencols);
+      int len = base + row->rsize - E.coloff;
+      if (len < 0)
+      {
+        len = 0;
+      }
+      if (len > E.screencols)
+      {
+        len = E.screencols;
+      }
+      unsigned char current_hl = HL_NORMAL;
+      char *c = &row->render[E.coloff - base];
+      unsigned char *hl = &row->hl[E.coloff - base];
+      int current_color = -1;
+      int j = 0;
+      while (j < len)
+      {
+        if (iscntrl((unsigned char)c[j]))
+        {
+          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+          ab_append(ab, "\x1b[7m", 4);
+          ab_append(ab, &sym, 1);
+          ab_append(ab, "\x1b[m", 3);
+          if (current_color != -1)
+          {
+            ab_append(ab, hl_sgr[current_hl].seq, hl_sgr[current_hl].len);
+          }
+          j++;
+          continue;
+        }
+
+        /* write the whole run of characters with the same color at once */
+        int color = hl_sgr[hl[j]].color;
+        int k = j + 1;
+        while (k < len && hl_sgr[hl[k]].color == color && !iscntrl((unsigned char)c[k]))
+        {
+          k++;
+        }
+        if (color != current_color)
+        {
+          ab_append(ab, hl_sgr[hl[j]].seq, hl_sgr[hl[j]].len);
+          current_color = color;
+          current_hl = hl[j];
+        }
+        ab_append(ab, &c[j], k - j);
+        j = k;
+      }
+      ab_append(ab, "\x1b[39m", 5);
+      row = editor_row_next(row);
+    }
+  }
+}
+
+void editor_draw_status_bar(AppendBuffer *ab)
+{
+  /*
+  set the properties of the terminal such that
+  the status bar appears different from the rest of the text
+  */
+  ab_append(ab, "\x1b[7m", 4);
+
+  /* create the status bar text */
+  char status[160], rstatus[104];
+  char match[48] = "";
+  if (E.search.query)
+  {
+    /* a + marks a count that is still going up */
+    snprintf(match, sizeof(match), "match %lld/%lld%s | ", E.search.ordinal,
+             E.search.total, E.search.scan_row ? "+" : "");
+  }
+  char loading[24] = "";
+  if (E.load)
+  {
+    snprintf(loading, sizeof(loading), "loading %d%% | ",
+             (int)(E.load->loaded * 100 / E.maplen));
+  }
+  int len;
+  if (E.perf.hud)
+  {
+    len = perf_hud(status, sizeof(status));
+  }
+  else
+  {
+    char buf[32] = "";
+    if (E.nbuffers > 1)
+    {
+      snprintf(buf, sizeof(buf), "[%d/%d] ", E.curbuf + 1, E.nbuffers);
+    }
+    len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s", buf,
+                   E.filename ? E.filename : "[No Name]", E.numrows,
+                   E.dirty ? "(modified)" : "");
+  }
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s | %d/%d", loading,
+                      match,
+                      E.syntax ? E.syntax->filetype : (E.large ? "large file" : "no ft"),
+                      E.cy + 1, E.numrows);
+  if (len > E.screencols)
+  {
+    len = E.screencols;
+  }
+  ab_append(ab, status, len);
+
+  while (len < E.screencols)
+  {
+    if (E.screencols - len == rlen)
+    {
+      ab_append(ab, rstatus, rlen);
+      break;
+    }
+    else
+    {
+      ab_append(ab, " ", 1);
+      len++;
+    }
+  }
+  ab_append(ab, "\x1b[m", 3);
+}
+
+void editor_draw_message_bar(AppendBuffer *ab)
+{
+  int msglen = strlen(E.statusmsg);
+  if (msglen > E.screencols)
+  {
+    msglen = E.screencols;
+  }
+  if (msglen && time(NULL) - E.statusmsg_time < 5)
+  {
+    ab_append(ab, E.statusmsg, msglen);
+  }
+}
+
+/**
+ * @brief Forget what the terminal shows, the next refresh redraws every line
+ */
+void editor_invalidate_screen()
+{
+  for (int y = 0; y < E.shadow_lines; y++)
+  {
+    ab_free(&E.shadow[y]);
+    ab_free(&E.lines[y]);
+  }
+  free(E.shadow);
+  free(E.lines);
+  E.shadow = NULL;
+  E.lines = NULL;
+  E.shadow_lines = 0;
+}
+
+/**
+ * @brief Reverse the order of an array of append buffers in place
+ *
+ * @param lines the buffers
+ * @param n number of buffers
+ */
+void ab_reverse(AppendBuffer *lines, int n)
+{
+  for (int i = 0, j = n - 1; i < j; i++, j--)
+  {
+    AppendBuffer tmp = lines[i];
+    lines[i] = lines[j];
+    lines[j] = tmp;
+  }
+}
+
+/**
+ * @brief Scroll the text rows of the terminal when the view has moved by a
+ * few rows, so that only the rows that came into view have to be sent
+ *
+ * The scroll region is limited to the text rows and the rows are moved
+ * with linefeeds at the bottom margin (or reverse index at the top margin),
+ * then the shadow lines are shifted to match.
+ *
+ * @param ab pointer to the append buffer
+ */
+void editor_scroll_screen(AppendBuffer *ab)
+{
+  int d = E.rowoff - E.shadow_rowoff;
+  if (E.shadow == NULL || d == 0 || E.coloff != E.shadow_coloff ||
+      d > E.screenrows / 2 || -d > E.screenrows / 2)
+  {
+    return;
+  }
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screenrows);
+  ab_append(ab, buf, len);
+  int y;
+  if (d > 0)
+  {
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows);
+    ab_append(ab, buf, len);
+    for (y = 0; y < d; y++)
+    {
+      ab_append(ab, "\n", 1);
+    }
+  }
+  else
+  {
+    ab_append(ab, "\x1b[H", 3);
+    for (y = 0; y < -d; y++)
+    {
+      ab_append(ab, "\x1bM", 2);
+    }
+  }
+
+  /*
+  rotate the shadow lines the same way, the buffers that scrolled out are
+  reused as the blank lines that scrolled in
+  */
+  int n = E.screenrows;
+  int shift = (d > 0) ? d : n + d;
+  ab_reverse(E.shadow, shift);
+  ab_reverse(&E.shadow[shift], n - shift);
+  ab_reverse(E.shadow, n);
+  for (y = 0; y < n; y++)
+  {
+    int blank = (d > 0) ? (y >= n - d) : (y < -d);
+    if (blank)
+    {
+      ab_reset(&E.shadow[y]);
+    }
+  }
+  /* reset the scroll region */
+  ab_append(ab, "\x1b[r", 3);
+}
+
+/**
+ * @brief Redraw the screen, sending only the lines that differ from what
+ * the terminal already shows
+ */
+void editor_refresh_screen()
+{
+  long long start = perf_start();
+  /* initialize the editor scroll */
+  editor_scroll();
+
+  int nlines = E.screenrows + 2;
+  if (E.shadow_lines != nlines)
+  {
+    editor_invalidate_screen();
+    E.shadow = calloc(nlines, sizeof(AppendBuffer));
+    E.lines = calloc(nlines, sizeof(AppendBuffer));
+    if (E.shadow == NULL || E.lines == NULL)
+    {
+      die("calloc");
+    }
+    for (int y = 0; y < nlines; y++)
+    {
+      /* a length no line can have, so every line gets written */
+      E.shadow[y].len = -1;
+    }
+    E.shadow_lines = nlines;
+    E.shadow_rowoff = E.rowoff;
+    E.shadow_coloff = E.coloff;
+  }
+
+  AppendBuffer *ab = &E.frame;
+  ab_reset(ab);
+
+  /* hide the cursor using ?25l */
+  ab_append(ab, "\x1b[?25l", 6);
+
+  editor_scroll_screen(ab);
+  E.shadow_rowoff = E.rowoff;
+  E.shadow_coloff = E.coloff;
+
+  AppendBuffer *lines = E.lines;
+  for (int y = 0; y < nlines; y++)
+  {
+    ab_reset(&lines[y]);
+  }
+  editor_draw_rows(lines);
+
+  /* draw the status bar */
+  editor_draw_status_bar(&lines[E.screenrows]);
+
+  /* draw the message bar */
+  editor_draw_message_bar(&lines[E.screenrows + 1]);
+
+  for (int y = 0; y < nlines; y++)
+  {
+    AppendBuffer *line = &lines[y];
+    AppendBuffer *shown = &E.shadow[y];
+    if (line->len == shown->len &&
+        (line->len == 0 || !memcmp(line->b, shown->b, line->len)))
+    {
+      continue;
+    }
+
+    /* move to the start of the line, write it and clear the rest of it */
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+    ab_append(ab, buf, len);
+    ab_append(ab, line->b, line->len);
+    ab_append(ab, "\x1b[K", 3);
+
+    /* the drawn line becomes the shadow, the old shadow is drawn into next */
+    AppendBuffer tmp = *shown;
+    *shown = *line;
+    *line = tmp;
+  }
+
+  /*
+  move the cursor to position given by the editor config
+  we use the H command with the column and row as arguments
+  */
+  char buf[32];
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+  ab_append(ab, buf, strlen(buf));
+
+  /* show the cursor using ?25h */
+  ab_append(ab, "\x1b[?25h", 6);
+
+  /* write the buffer to the terminal */
+  write(E.outfd, ab->b, ab->len);
+  E.last_frame = editor_now_ms();
+  perf_stop(PERF_REFRESH, start, 0);
+  perf_frame();
+}
+
+void editor_set_status_message(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+}
+
+/*** BENCH ***/
+
+/*
+ed9t --bench [--capture FILE] [LINES...] runs the editor headless: the
+screen has a fixed size, frames go to /dev/null or the capture file, and
+keys come from scripts rather than the terminal. For each corpus size a C
+file of that many lines is generated, and opening it up to its first frame,
+typing, pasting, searching, replacing, scrolling and saving are replayed
+against it in a child process, one frame drawn per key as in the main loop. The highlighter is
+also run alone over the whole corpus, and every match of a query and of a
+regex is counted, for their throughput. The p50 and p99
+latency of every operation is printed with its throughput.
+*/
+
+void bench_record(BenchStat *s, long long ns, long long bytes)
+{
+  if (s->n == s->cap)
+  {
+    s->cap = s->cap ? 2 * s->cap : 64;
+    s->ns = realloc(s->ns, sizeof(long long) * s->cap);
+    if (s->ns == NULL)
+    {
+      die("realloc");
+    }
+  }
+  s->ns[s->n++] = ns;
+  s->bytes += bytes;
+}
+
+int bench_cmp_ns(const void *a, const void *b)
+{
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print the latency percentiles and throughput of an operation
+ *
+ * @param lines size of the corpus
+ * @param s the latencies
+ */
+void bench_report(int lines, BenchStat *s)
+{
+  if (s->n == 0)
+  {
+    return;
+  }
+  long long total = 0;
+  int i;
+  for (i = 0; i < s->n; i++)
+  {
+    total += s->ns[i];
+  }
+  qsort(s->ns, s->n, sizeof(long long), bench_cmp_ns);
+  double p50 = s->ns[(s->n - 1) * 50 / 100] / 1e3;
+  double p99 = s->ns[(s->n - 1) * 99 / 100] / 1e3;
+  double secs = total > 0 ? total / 1e9 : 1e-9;
+  char rate[32];
+  if (s->bytes && s->bytes / secs >= 1e9)
+  {
+    snprintf(rate, sizeof(rate), "%.2f GB/s", s->bytes / secs / 1e9);
+  }
+  else if (s->bytes)
+  {
+    snprintf(rate, sizeof(rate), "%.1f MB/s", s->bytes / secs / 1e6);
+  }
+  else
+  {
+    snprintf(rate, sizeof(rate), "%.0f ops/s", s->n / secs);
+  }
+  printf("%9d  %-8s %6d %11.1f %11.1f %15s\n", lines, s->name, s->n, p50,
+         p99, rate);
+  free(s->ns);
+}
+
+/**
+ * @brief Replay keys the way the main loop handles them, and draw a frame
+ *
+ * @param keys the key bytes, as a terminal would send them
+ * @param len number of bytes
+ * @return long long ns taken
+ */
+long long bench_keys(const char *keys, int len)
+{
+  long long start = editor_now_ns();
+  E.feed = keys;
+  E.feedpos = 0;
+  E.feedlen = len;
+  while (editor_input_pending(0))
+  {
+    editor_process_keypress();
+    editor_scroll();
+  }
+  editor_span_reclaim();
+  editor_refresh_screen();
+  return editor_now_ns() - start;
+}
+
+/**
+ * @brief Replay a key the given number of times, timing each
+ */
+void bench_repeat(BenchStat *s, const char *key, int times)
+{
+  int i;
+  for (i = 0; i < times; i++)
+  {
+    bench_record(s, bench_keys(key, strlen(key)), 0);
+  }
+}
+
+/**
+ * @brief Count every match of query in the file, as a regex if regex is set
+ *
+ * @return long long ns taken
+ */
+long long bench_count(char *query, int regex)
+{
+  const char *err;
+  long long start = editor_now_ns();
+  E.find_regex = regex;
+  if (editor_search_start(query, &err))
+  {
+    while (editor_search_step(ED9T_SEARCH_STEP))
+    {
+    }
+  }
+  long long ns = editor_now_ns() - start;
+  editor_search_reset();
+  E.find_regex = 0;
+  return ns;
+}
+
+/**
+ * @brief Write a C file of the given number of lines
+ *
+ * The lines mix keywords, numbers, strings, comments and tab indents, and
+ * every ED9T_BENCH_NEEDLE lines one holds the word the search looks for.
+ *
+ * @param path the file to write
+ * @param lines number of lines
+ */
+void bench_corpus(const char *path, int lines)
+{
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+  {
+    die("fopen");
+  }
+  int i;
+  for (i = 0; i < lines; i++)
+  {
+    switch (i % 8)
+    {
+    case 0:
+      fprintf(fp, "/* block %d of the generated corpus */\n", i / 8);
+      break;
+    case 1:
+      fprintf(fp, "static int f%d(int x, char *s)\n", i);
+      break;
+    case 2:
+      fprintf(fp, "{\n");
+      break;
+    case 3:
+      fprintf(fp, "\tif (x > %d && s[0] != '\\0')\n", i % 977);
+      break;
+    case 4:
+      fprintf(fp, "\t\treturn printf(\"%%s:%%d\\n\", s, x * %d);\n", i);
+      break;
+    case 5:
+      fprintf(fp, "\t// %s\n", i % ED9T_BENCH_NEEDLE < 8 ? "needle" : "hay");
+      break;
+    case 6:
+      fprintf(fp, "\treturn x + 0x%x; /* %d */\n", i, i % 31);
+      break;
+    default:
+      fprintf(fp, "}\n");
+    }
+  }
+  if (fclose(fp) != 0)
+  {
+    die("fclose");
+  }
+}
+
+/**
+ * @brief Benchmark the editor against a corpus of the given size, in the
+ * process it is called in
+ *
+ * @param lines number of lines of the corpus
+ */
+void bench_run(int lines)
+{
+  char path[] = "/tmp/ed9t-bench-XXXXXX.c";
+  int fd = mkstemps(path, 2);
+  if (fd == -1)
+  {
+    die("mkstemps");
+  }
+  close(fd);
+  bench_corpus(path, lines);
+  struct stat st;
+  if (stat(path, &st) == -1)
+  {
+    die("stat");
+  }
+
+  BenchStat open = {"open", NULL, 0, 0, 0};
+  BenchStat hl = {"hl", NULL, 0, 0, 0};
+  BenchStat type = {"type", NULL, 0, 0, 0};
+  BenchStat paste = {"paste", NULL, 0, 0, 0};
+  BenchStat search = {"search", NULL, 0, 0, 0};
+  BenchStat count = {"count", NULL, 0, 0, 0};
+  BenchStat regex = {"regex", NULL, 0, 0, 0};
+  BenchStat replace = {"replace", NULL, 0, 0, 0};
+  BenchStat undo = {"undo", NULL, 0, 0, 0};
+  BenchStat scroll = {"scroll", NULL, 0, 0, 0};
+  BenchStat save = {"save", NULL, 0, 0, 0};
+
+  init_editor();
+  long long start = editor_now_ns();
+  editor_open(path);
+  editor_hl_worker_start();
+  editor_refresh_screen();
+  bench_record(&open, editor_now_ns() - start, st.st_size);
+  editor_load_finish();
+
+  /* the highlighter alone over every row, in slices of about 1 MB */
+  EditorRow *row = E.syntax ? editor_row_at(0) : NULL;
+  int in_comment = 0;
+  while (row)
+  {
+    long long bytes = 0;
+    start = editor_now_ns();
+    while (row && bytes < (1 << 20))
+    {
+      in_comment = editor_syntax_highlight(E.syntax, row->chars, row->size,
+                                           editor_syntax_scratch(row->size),
+                                           in_comment);
+      bytes += row->size;
+      row = editor_row_next(row);
+    }
+    bench_record(&hl, editor_now_ns() - start, bytes);
+  }
+
+  /* type in the middle of the file, a line at a time */
+  E.cy = E.numrows / 2;
+  E.cx = 0;
+  bench_keys("", 0);
+  static const char typed[] = "int value = compute(42, \"text\"); /* ok */\r";
+  int i;
+  for (i = 0; i < 2000; i++)
+  {
+    bench_record(&type, bench_keys(&typed[i % (sizeof(typed) - 1)], 1), 0);
+  }
+
+  /* bracketed pastes of 200 lines */
+  static const char pasted[] = "\tpasted = pasted * 31 + 7; // filler\r\n";
+  AppendBuffer text = ABUF_INIT;
+  ab_append(&text, "\x1b[200~", 6);
+  for (i = 0; i < 200; i++)
+  {
+    ab_append(&text, pasted, sizeof(pasted) - 1);
+  }
+  ab_append(&text, "\x1b[201~", 6);
+  for (i = 0; i < 20; i++)
+  {
+    bench_record(&paste, bench_keys(text.b, text.len), text.len - 12);
+  }
+  ab_free(&text);
+
+  /* from the top, for the term and then to its next matches */
+  E.cy = 0;
+  E.cx = 0;
+  bench_keys("", 0);
+  static const char find[] = "\x06needle\r";
+  bench_repeat(&search, find, 20);
+  static const char next[] = "\x06needle\x1b[B\x1b[B\x1b[B\r";
+  bench_repeat(&search, next, 20);
+
+  /* every match in the file, the regex has "x * " as its literal */
+  for (i = 0; i < 3; i++)
+  {
+    bench_record(&count, bench_count("needle", 0), st.st_size);
+    bench_record(&regex, bench_count("x \\* [0-9]+7\\)", 1), st.st_size);
+  }
+
+  /* the word of most comments replaced, and put back */
+  static const char replaced[] = "\x12hay\rstraw\r";
+  bench_record(&replace, bench_keys(replaced, sizeof(replaced) - 1),
+               st.st_size);
+  bench_record(&undo, bench_keys("\x1a", 1), st.st_size);
+
+  static const char pagedown[] = "\x1b[6~";
+  static const char down[] = "\x1b[B";
+  static const char pageup[] = "\x1b[5~";
+  bench_repeat(&scroll, pagedown, 200);
+  bench_repeat(&scroll, down, 200);
+  bench_repeat(&scroll, pageup, 200);
+
+  int saves = lines >= 1000000 ? 1 : 3;
+  for (i = 0; i < saves; i++)
+  {
+    long long ns = bench_keys("\x13", 1);
+    struct stat saved;
+    bench_record(&save, ns, stat(path, &saved) == 0 ? saved.st_size : 0);
+  }
+
+  editor_journal_remove(&E.journal);
+  unlink(path);
+  bench_report(lines, &open);
+  bench_report(lines, &hl);
+  bench_report(lines, &type);
+  bench_report(lines, &paste);
+  bench_report(lines, &search);
+  bench_report(lines, &count);
+  bench_report(lines, &regex);
+  bench_report(lines, &replace);
+  bench_report(lines, &undo);
+  bench_report(lines, &scroll);
+  bench_report(lines, &save);
+}
+
+/**
+ * @brief Run the benchmark for each corpus size, each in a process of its
+ * own so that every run starts from a fresh editor
+ *
+ * @param argc number of arguments after --bench
+ * @param argv the arguments, --capture FILE and the corpus sizes
+ * @return int exit status
+ */
+int bench_main(int argc, char *argv[])
+{
+  const char *capture = "/dev/null";
+  static char *sizes[] = {"1000", "100000", "1000000"};
+  char **lines = sizes;
+  int nlines = sizeof(sizes) / sizeof(sizes[0]);
+  if (argc >= 2 && strcmp(argv[0], "--capture") == 0)
+  {
+    capture = argv[1];
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc > 0)
+  {
+    lines = argv;
+    nlines = argc;
+  }
+
+  E.headless = 1;
+  E.outfd = open(capture, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (E.outfd == -1)
+  {
+    die("open");
+  }
+
+  printf("%9s  %-8s %6s %11s %11s %15s\n", "lines", "op", "count", "p50 us",
+         "p99 us", "throughput");
+  int status = 0;
+  int i;
+  for (i = 0; i < nlines; i++)
+  {
+    int n = atoi(lines[i]);
+    if (n <= 0)
+    {
+      fprintf(stderr, "ed9t: bad corpus size %s\n", lines[i]);
+      return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+      die("fork");
+    }
+    if (pid == 0)
+    {
+      bench_run(n);
+      fflush(stdout);
+      _exit(0);
+    }
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) == -1 || !WIFEXITED(wstatus) ||
+        WEXITSTATUS(wstatus) != 0)
+    {
+      fprintf(stderr, "ed9t: benchmark of %d lines failed\n", n);
+      status = 1;
+    }
+  }
+  close(E.outfd);
+  return status;
+}
+
+/*** LIBRARY ***/
+
+/*
+built with ED9T_LIBRARY this file is libed9core (make libed9core.so), the
+editor without its terminal and main, for the LÖVE frontend. the API of
+ed9core.h runs the same code as the keys of the terminal editor, headless,
+and hands lines out as pointers into the render and hl of their rows rather
+than copies of them. the highlight worker runs while the frontend is
+outside of the API, as it does while the terminal editor waits for input.
+*/
+
+ED9_API int ed9_init(int rows, int cols)
+{
+  if (E.buffers || E.nbuffers)
+  {
+    return -1;
   }
-
-  quit_times = ED9T_QUIT_TIMES;
+  E.headless = 1;
+  E.outfd = -1;
+  init_editor();
+  ed9_resize(rows, cols);
+  editor_hl_worker_start();
+  editor_hl_worker_release();
+  return 0;
 }
 
-/*** OUTPUT ***/
+ED9_API void ed9_resize(int rows, int cols)
+{
+  E.screenrows = rows > 1 ? rows : 1;
+  E.screencols = cols > 1 ? cols : 1;
+}
 
-void editor_scroll()
+ED9_API int ed9_open(const char *path)
 {
-  E.rx = 0;
-  if (E.cy < E.numrows)
+  if (access(path, R_OK) == -1)
   {
-    E.rx = editor_row_cx_to_rx(&E.row[E.cy], E.cx);
+    return -1;
+  }
+  editor_hl_worker_acquire();
+  if (E.filename || E.numrows || E.dirty)
+  {
+    editor_buffer_new();
   }
+  editor_set_status_message("Buffer %d/%d: %.40s", E.curbuf + 1, E.nbuffers,
+                            path);
+  editor_open((char *)path);
+  editor_hl_worker_release();
+  return 0;
+}
 
-  if (E.cy < E.rowoff)
+ED9_API int ed9_switch(int buffer)
+{
+  if (buffer < 0 || buffer >= E.nbuffers)
   {
-    E.rowoff = E.cy;
+    return -1;
   }
-  if (E.cy >= E.rowoff + E.screenrows)
+  editor_hl_worker_acquire();
+  editor_buffer_switch(buffer);
+  editor_hl_worker_release();
+  return 0;
+}
+
+/**
+ * @brief Save the buffer shown, which must have a file as there is no
+ * prompt to ask for one
+ */
+ED9_API int ed9_save(void)
+{
+  if (E.filename == NULL)
   {
-    E.rowoff = E.cy - E.screenrows + 1;
+    return -1;
   }
-  if (E.rx < E.coloff)
+  editor_hl_worker_acquire();
+  editor_save();
+  editor_hl_worker_release();
+  return E.dirty ? -1 : 0;
+}
+
+/**
+ * @brief Do what the terminal editor does while it waits for input: scan a
+ * step further for the search, sync the journal when it is due, read the
+ * file again if another program changed it, join the lines read of a file
+ * still being loaded and fold rows far from the screen back into spans
+ *
+ * Meant to be called once a frame.
+ */
+ED9_API int ed9_update(void)
+{
+  editor_hl_worker_acquire();
+  int busy = editor_search_busy();
+  if (busy)
   {
-    E.coloff = E.rx;
+    editor_search_idle();
   }
-  if (E.rx >= E.coloff + E.screencols)
+  editor_journal_tick();
+  editor_watch_check();
+  int loading = editor_load_step();
+  editor_span_reclaim();
+  busy = loading || editor_search_busy() || editor_hl_worker_pending();
+  editor_hl_worker_release();
+  return busy;
+}
+
+/**
+ * @brief Check whether ed9_key edits the text for a key, rather than only
+ * moving the cursor
+ */
+int ed9_key_edits(int key)
+{
+  switch (key)
   {
-    E.coloff = E.rx - E.screencols + 1;
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case HOME_KEY:
+  case END_KEY:
+  case PAGE_UP:
+  case PAGE_DOWN:
+    return 0;
   }
+  return 1;
 }
 
 /**
- * @brief Draw the rows of the editor
+ * @brief Apply a key as the terminal editor does, for the keys that edit
+ * the text or move the cursor
  *
- * @param ab pointer to the append buffer
+ * The terminal only searches inside the find prompt, here the search lives
+ * on between calls, so it is forgotten before an edit: its match list and
+ * the rows it points at do not follow edits.
  */
-void editor_draw_rows(AppendBuffer *ab)
+ED9_API void ed9_key(int key)
 {
-  for (int y = 0; y < E.screenrows; y++)
+  editor_hl_worker_acquire();
+  if (ed9_key_edits(key))
   {
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows)
-    {
-      if (E.numrows == 0 && y == E.screenrows / 3)
-      {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome), ED9T_WELCOME_MESSAGE, ED9T_VERSION);
-        if (welcomelen > E.screencols)
-        {
-          welcomelen = E.screencols;
-        }
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding)
-        {
-          ab_append(ab, "~", 1);
-          padding--;
-        }
-        while (padding--)
-        {
-          ab_append(ab, " ", 1);
-        }
-        ab_append(ab, welcome, welcomelen);
-      }
-      else
-      {
-        ab_append(ab, "~", 1);
-      }
-    }
-    else
-    {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-      {
-        len = 0;
-      }
-      if (len > E.screencols)
-      {
-        len = E.screencols;
-      }
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++)
-      {
-        if (iscntrl((unsigned char)c[j]))
-        {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          ab_append(ab, "\x1b[7m", 4);
-          ab_append(ab, &sym, 1);
-          ab_append(ab, "\x1b[m", 3);
-          if (current_color != -1)
-          {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            ab_append(ab, buf, clen);
-          }
-        }
-        else if (hl[j] == HL_NORMAL)
-        {
-          if (current_color != -1)
-          {
-            ab_append(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          ab_append(ab, &c[j], 1);
-        }
-        else
-        {
-          int color = editor_syntax_to_color(hl[j]);
-          if (color != current_color)
-          {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            ab_append(ab, buf, clen);
-            current_color = color;
-          }
-          ab_append(ab, &c[j], 1);
-        }
-      }
-      ab_append(ab, "\x1b[39m", 5);
-    }
-
-    /* clear the line with the K command and argument 0 */
-    ab_append(ab, "\x1b[K", 3);
-
-    /* move the cursor to the next line */
-    ab_append(ab, "\r\n", 2);
+    editor_search_reset();
+  }
+  perf_count(PERF_KEYS, 1);
+  int typing = (key >= 32 && key < 127) || key == '\t';
+  if (!typing)
+  {
+    editor_undo_boundary();
+  }
+  editor_edit_key(key);
+  if (!typing)
+  {
+    editor_undo_boundary();
   }
+  editor_hl_worker_release();
 }
 
-void editor_draw_status_bar(AppendBuffer *ab)
+/**
+ * @brief Insert text at the cursor, typed text when it is a line at most
+ * and undone with the text typed around it, else pasted text
+ */
+ED9_API void ed9_insert(const char *text, int len)
 {
-  /*
-  set the properties of the terminal such that
-  the status bar appears different from the rest of the text
-  */
-  ab_append(ab, "\x1b[7m", 4);
-
-  /* create the status bar text */
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-  if (len > E.screencols)
+  editor_hl_worker_acquire();
+  /* as for ed9_key, the search does not follow edits */
+  editor_search_reset();
+  int paste = memchr(text, '\n', len) != NULL;
+  if (paste)
   {
-    len = E.screencols;
+    editor_undo_boundary();
   }
-  ab_append(ab, status, len);
+  editor_insert_text(text, len);
+  if (paste)
+  {
+    editor_undo_boundary();
+  }
+  editor_hl_worker_release();
+}
 
-  while (len < E.screencols)
+ED9_API void ed9_click(int rx, int y)
+{
+  editor_hl_worker_acquire();
+  editor_undo_boundary();
+  E.cy = y < 0 ? 0 : y > E.numrows ? E.numrows : y;
+  E.cx = 0;
+  if (E.cy < E.numrows)
   {
-    if (E.screencols - len == rlen)
-    {
-      ab_append(ab, rstatus, rlen);
-      break;
-    }
-    else
-    {
-      ab_append(ab, " ", 1);
-      len++;
-    }
+    EditorRow *row = editor_row_at(E.cy);
+    editor_row_prepare_render(row);
+    E.cx = editor_row_rx_to_cx(row, rx < 0 ? 0 : rx);
   }
-  ab_append(ab, "\x1b[m", 3);
-  ab_append(ab, "\r\n", 2);
+  editor_hl_worker_release();
 }
 
-void editor_draw_message_bar(AppendBuffer *ab)
+/**
+ * @brief Search as the find prompt does on each key, see
+ * editor_find_update
+ */
+ED9_API long long ed9_find(const char *query, int regex, int key)
 {
-  ab_append(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols)
+  editor_hl_worker_acquire();
+  if (regex != E.find_regex)
   {
-    msglen = E.screencols;
+    E.find_regex = regex;
+    editor_search_reset();
   }
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
+  editor_find_update((char *)query, key);
+  long long total = E.search.total;
+  if (key == 0 && query[0] && E.search.query == NULL)
   {
-    ab_append(ab, E.statusmsg, msglen);
+    total = -1;
   }
+  editor_hl_worker_release();
+  return total;
+}
+
+ED9_API void ed9_replace(const char *query, const char *with, int regex)
+{
+  editor_hl_worker_acquire();
+  editor_search_reset();
+  E.find_regex = regex;
+  editor_replace_all((char *)query, (char *)with);
+  editor_hl_worker_release();
 }
 
 /**
- * @brief Clear the screen so that the editor can be displayed
+ * @brief Get the cursor and what is shown, scrolling first as the terminal
+ * editor does before every frame to keep the cursor on screen
  */
-void editor_refresh_screen()
+ED9_API void ed9_get_view(ed9_view *view)
 {
-  /* initialize the editor scroll */
+  editor_hl_worker_acquire();
   editor_scroll();
+  view->cx = E.cx;
+  view->cy = E.cy;
+  view->rx = E.rx;
+  view->rowoff = E.rowoff;
+  view->coloff = E.coloff;
+  view->numrows = E.numrows;
+  view->dirty = E.dirty;
+  view->loaded = E.load ? (int)(E.load->loaded * 100 / E.maplen) : 100;
+  view->buffer = E.curbuf;
+  view->nbuffers = E.nbuffers;
+  editor_hl_worker_release();
+}
 
-  AppendBuffer ab = ABUF_INIT;
-
-  /* hide the cursor using ?25l */
-  ab_append(&ab, "\x1b[?25l", 6);
-  /* clear the screen with the J command and argument 2 */
-  // ab_append(&ab, "\x1b[2J", 4);
-  /* reposition the cursor to the top left with the H command */
-  ab_append(&ab, "\x1b[H", 3);
-
-  editor_draw_rows(&ab);
-
-  /* draw the status bar */
-  editor_draw_status_bar(&ab);
-
-  /* draw the message bar */
-  editor_draw_message_bar(&ab);
-
-  /*
-  move the cursor to position given by the editor config
-  we use the H command with the column and row as arguments
-  */
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  ab_append(&ab, buf, strlen(buf));
+/**
+ * @brief Hash the text and classes of a span, FNV-1a over both
+ */
+unsigned int ed9_span_hash(ed9_span *span)
+{
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < span->len; i++)
+  {
+    h = (h ^ (unsigned char)span->text[i]) * 16777619u;
+    h = (h ^ span->hl[i]) * 16777619u;
+  }
+  return h;
+}
 
-  /* reposition the cursor to the top left with the H command */
-  // ab_append(&ab, "\x1b[H", 3);
-  /* show the cursor using ?25h */
-  ab_append(&ab, "\x1b[?25h", 6);
+/**
+ * @brief Point spans at the lines from first, over their columns from col
+ * on, as editor_draw_rows draws them
+ *
+ * Every line is given its render and hl over those columns. The rows
+ * prepared so far are the most recent of the render cache, and are pinned
+ * there until the call returns, so a long line can't push out the lines
+ * before it when the rows pass ED9T_RENDER_CACHE_BYTES. At most
+ * ED9T_LIBRARY_LINES rows are filled, which the row count always keeps.
+ */
+ED9_API int ed9_lines(int first, int n, int col, int width, ed9_span *out)
+{
+  if (first < 0 || col < 0 || width < 0)
+  {
+    return 0;
+  }
+  if (n > ED9T_LIBRARY_LINES)
+  {
+    n = ED9T_LIBRARY_LINES;
+  }
+  editor_hl_worker_acquire();
+  if (n > E.numrows - first)
+  {
+    n = E.numrows - first;
+  }
+  EditorRow *row = n > 0 ? editor_row_at(first) : NULL;
+  int i;
+  for (i = 0; i < n; i++, row = editor_row_next(row))
+  {
+    int base = editor_row_prepare_hl(row, col, col + width);
+    int len = base + row->rsize - col;
+    if (len < 0)
+    {
+      len = 0;
+    }
+    if (len > width)
+    {
+      len = width;
+    }
+    out[i].text = len ? &row->render[col - base] : "";
+    out[i].hl = len ? &row->hl[col - base] : NULL;
+    out[i].len = len;
+    out[i].hash = ed9_span_hash(&out[i]);
+    E.cache_pinned = i + 1;
+  }
+  E.cache_pinned = 0;
+  editor_hl_worker_release();
+  return n > 0 ? n : 0;
+}
 
-  /* write the buffer to the terminal */
-  write(STDOUT_FILENO, ab.b, ab.len);
-  ab_free(&ab);
+ED9_API const char *ed9_status(void)
+{
+  return E.statusmsg;
 }
 
-void editor_set_status_message(const char *fmt, ...)
+/**
+ * @brief End the session as Ctrl-Q does, changes that weren't saved are
+ * given up on and their journals removed
+ */
+ED9_API void ed9_quit(void)
 {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
-  E.statusmsg_time = time(NULL);
+  editor_hl_worker_acquire();
+  editor_buffers_remove_journals();
+  editor_hl_worker_release();
 }
 
 /*** INIT ***/
@@ -1514,48 +11573,126 @@ void editor_set_status_message(const char *fmt, ...)
  */
 void init_editor()
 {
-  E.cx = 0;
-  E.cy = 0;
-  E.rx = 0;
-  E.rowoff = 0;
-  E.coloff = 0;
-  E.numrows = 0;
-  E.row = NULL;
-  E.dirty = 0;
-  E.filename = NULL;
+  E.freerows = NULL;
+  memset(E.slab_free, 0, sizeof(E.slab_free));
+  memset(E.pack_cache, 0, sizeof(E.pack_cache));
+  E.pack_clock = 0;
+  E.pack_text = NULL;
+  E.pack_text_size = 0;
+  E.pack_block = NULL;
+  E.cache_head = NULL;
+  E.cache_tail = NULL;
+  E.cache_rows = 0;
+  E.cache_bytes = 0;
+  E.cache_pinned = 0;
+  E.syntax_gen = 0;
+  E.hlscratch = NULL;
+  E.hlscratch_size = 0;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
-  E.syntax = NULL;
-
-  if (get_window_size(&E.screenrows, &E.screencols) == -1)
+  E.shadow = NULL;
+  E.shadow_lines = 0;
+  E.shadow_rowoff = 0;
+  E.shadow_coloff = 0;
+  E.lines = NULL;
+  E.frame.b = NULL;
+  E.frame.len = 0;
+  E.frame.cap = 0;
+  E.last_frame = 0;
+  E.inpos = 0;
+  E.inlen = 0;
+  E.paste.b = NULL;
+  E.paste.len = 0;
+  E.paste.cap = 0;
+  E.hlworker.running = 0;
+  E.hlworker.text = NULL;
+  E.hlworker.text_size = 0;
+  E.hlworker.hl = NULL;
+  E.hlworker.hl_size = 0;
+  memset(&E.perf, 0, sizeof(E.perf));
+  E.perf.start = editor_now_ns();
+  E.find_regex = 0;
+  E.search_rows = NULL;
+  E.search_hits = NULL;
+  E.search_cap = 0;
+  E.buffers = NULL;
+  E.nbuffers = 1;
+  E.curbuf = 0;
+  E.watchfd = -1;
+  editor_buffer_reset();
+  editor_init_sgr_table();
+
+  if (E.headless)
+  {
+    E.screenrows = ED9T_BENCH_ROWS;
+    E.screencols = ED9T_BENCH_COLS;
+  }
+  else
   {
-    die("get_window_size");
+    E.outfd = STDOUT_FILENO;
+    if (get_window_size(&E.screenrows, &E.screencols) == -1)
+    {
+      die("get_window_size");
+    }
   }
 
   /* make space for the status bar */
   E.screenrows -= 2;
 }
 
+#ifndef ED9T_LIBRARY
 int main(int argc, char *argv[])
 {
+  if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+  {
+    return bench_main(argc - 2, argv + 2);
+  }
   /* enable the raw mode */
   enable_raw_mode();
   /* initialize the editor */
   init_editor();
-  /* open a file */
-  if (argc >= 2)
+  /* set first, so that a recovery from a journal is what shows */
+  editor_set_status_message(
+      "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo");
+  int arg = 1;
+  if (argc >= 3 && strcmp(argv[1], "--perf-trace") == 0)
   {
-    editor_open(argv[1]);
+    perf_trace_open(argv[2]);
+    arg = 3;
   }
-
-  editor_set_status_message(
-      "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  /* open the files, each in a buffer of its own */
+  if (argc > arg)
+  {
+    editor_open(argv[arg]);
+    int i;
+    for (i = arg + 1; i < argc; i++)
+    {
+      editor_buffer_new();
+      editor_open(argv[i]);
+    }
+    editor_buffer_switch(0);
+  }
+  editor_hl_worker_start();
 
   while (1)
   {
+    editor_load_step();
+    editor_watch_check();
+    editor_span_reclaim();
+    editor_journal_tick();
     editor_refresh_screen();
-    editor_process_keypress();
+    /*
+    apply every key that is already waiting, and those arriving before the
+    next frame is due, then draw them all in one frame
+    */
+    do
+    {
+      editor_process_keypress();
+      /* keys such as PAGE_UP work from the viewport of the previous key */
+      editor_scroll();
+    } while (editor_input_pending(editor_frame_wait()));
   }
 
   return 0;
 }
+#endif
@@ -4,20 +4,122 @@
 -- date: 02/09/2024
 
 local Class = require'middleclass'
+local core = require'ed9core'
+local TextRenderer = require'textrenderer'
 
 local cw, ch
 local titleText = "ED9: Programmer's Editor"
 local titleWidth, titleHeight
 
--- love.load - main entry point for Love2d
-function love.load()
+-- size of a character cell, and of the text area in cells
+local cellWidth, cellHeight
+local rows, cols
+local renderer
+-- the status line, set again only when its text changes
+local statusText, statusString
+
+-- colors of the highlight classes, as the terminal editor shows them
+local palette = {
+    [core.lib.ED9_HL_NORMAL] = {0.9, 0.9, 0.9},
+    [core.lib.ED9_HL_COMMENT] = {0.4, 0.8, 0.8},
+    [core.lib.ED9_HL_MLCOMMENT] = {0.4, 0.8, 0.8},
+    [core.lib.ED9_HL_KEYWORD1] = {0.9, 0.8, 0.3},
+    [core.lib.ED9_HL_KEYWORD2] = {0.4, 0.8, 0.4},
+    [core.lib.ED9_HL_STRING] = {0.8, 0.4, 0.8},
+    [core.lib.ED9_HL_NUMBER] = {0.9, 0.4, 0.4},
+    [core.lib.ED9_HL_MATCH] = {0.4, 0.5, 1.0},
+}
+
+-- layout - fit the text area to the window, leaving a line for the status
+local function layout()
     cw, ch = love.graphics.getDimensions()
-    titleWidth = love.graphics.getFont():getWidth(titleText)
-    titleHeight = love.graphics.getFont():getHeight(titleText)
+    rows = math.max(1, math.floor(ch / cellHeight) - 1)
+    cols = math.max(1, math.floor(cw / cellWidth))
+end
+
+-- love.load - main entry point for Love2d
+function love.load(args)
+    local font = love.graphics.getFont()
+    titleWidth = font:getWidth(titleText)
+    titleHeight = font:getHeight(titleText)
+    renderer = TextRenderer(font, palette)
+    cellWidth = renderer.cellWidth
+    cellHeight = renderer.cellHeight
+    statusText = love.graphics.newText(font)
+    layout()
     love.graphics.setBackgroundColor(0.1, 0.1, 0.1)
+    love.keyboard.setKeyRepeat(true)
+
+    core.init(rows, cols)
+    for _, path in ipairs(args) do
+        core.open(path)
+    end
+end
+
+-- love.update - run the background work of the core once a frame
+function love.update(dt)
+    core.update()
 end
 
 -- love.draw - called every frame to draw the screen
 function love.draw()
-    love.graphics.print(titleText, cw/2 - titleWidth/2, ch/2 - titleHeight/2)
+    local view = core.view()
+    if view.numrows == 0 then
+        love.graphics.print(titleText, cw/2 - titleWidth/2, ch/2 - titleHeight/2)
+    end
+
+    local n = core.lines(view.rowoff, rows, view.coloff, cols)
+    renderer:draw(core.spans, n, 0, 0)
+
+    love.graphics.setColor(0.9, 0.9, 0.9)
+    love.graphics.rectangle('fill', (view.rx - view.coloff) * cellWidth,
+        (view.cy - view.rowoff) * cellHeight, 2, cellHeight)
+    local status = string.format('%d/%d %s%s %s', view.cy + 1, view.numrows,
+        view.loaded < 100 and string.format('loading %d%% ', view.loaded) or '',
+        view.dirty ~= 0 and '(modified)' or '', core.status())
+    if status ~= statusString then
+        statusString = status
+        statusText:set(status)
+    end
+    love.graphics.draw(statusText, 0, rows * cellHeight)
+end
+
+-- love.textinput - insert what is typed at the cursor
+function love.textinput(text)
+    core.insert(text)
+end
+
+-- love.keypressed - Ctrl-S saves, Ctrl-Z/Y undo and redo, Ctrl-N shows
+-- the next buffer, the other keys go to the core
+function love.keypressed(key)
+    if love.keyboard.isDown('lctrl', 'rctrl') then
+        if key == 's' then
+            core.save()
+        elseif key == 'z' or key == 'y' then
+            core.key(key:byte() - 96)
+        elseif key == 'n' then
+            local view = core.view()
+            core.lib.ed9_switch((view.buffer + 1) % view.nbuffers)
+        end
+    elseif core.keys[key] then
+        core.key(core.keys[key])
+    end
+end
+
+-- love.mousepressed - move the cursor to the cell clicked
+function love.mousepressed(x, y, button)
+    local view = core.view()
+    core.click(view.coloff + math.floor(x / cellWidth),
+        view.rowoff + math.floor(y / cellHeight))
+end
+
+-- love.resize - give the core the new size of the text area
+function love.resize(w, h)
+    layout()
+    core.resize(rows, cols)
+end
+
+-- love.quit - drop the journals of the changes that weren't saved
+function love.quit()
+    core.quit()
 end
@@ -0,0 +1,133 @@
+--- textrenderer.lua - draws the lines of the editor core through a glyph atlas
+--
+-- Every printable ASCII character is drawn once into an atlas canvas, on a
+-- grid of cells as wide as the widest of them. A line is a SpriteBatch of
+-- quads of the atlas, one per character, tinted with the color of its
+-- highlight class. The batches are kept by the hash the core gives each
+-- span, so a line is only built again when the core hands out a span of a
+-- new hash for it: lines that scroll keep their batch and are drawn one
+-- cell higher or lower, and only the lines that came into view are built.
+--
+-- author: Abhishek Mishra
+-- date: 15/10/2026
+
+local Class = require'middleclass'
+
+-- first and last character in the atlas, the others are drawn as '?'
+local FIRST_GLYPH, LAST_GLYPH = 32, 126
+local ATLAS_COLUMNS = 16
+
+-- batches kept besides those on screen, for lines that scroll back in
+local SPARE_LINES = 256
+
+local TextRenderer = Class('TextRenderer')
+
+--- TextRenderer:initialize - build the atlas of font
+-- @param font the font to draw with
+-- @param palette color of each highlight class, the class 0 color for the rest
+function TextRenderer:initialize(font, palette)
+    self.palette = palette
+    self.cellWidth = 0
+    for c = FIRST_GLYPH, LAST_GLYPH do
+        self.cellWidth = math.max(self.cellWidth, font:getWidth(string.char(c)))
+    end
+    self.cellHeight = font:getHeight()
+
+    local count = LAST_GLYPH - FIRST_GLYPH + 1
+    local atlasRows = math.ceil(count / ATLAS_COLUMNS)
+    self.atlas = love.graphics.newCanvas(ATLAS_COLUMNS * self.cellWidth,
+        atlasRows * self.cellHeight)
+    self.quads = {}
+    love.graphics.push('all')
+    love.graphics.setCanvas(self.atlas)
+    love.graphics.clear(0, 0, 0, 0)
+    love.graphics.setFont(font)
+    love.graphics.setColor(1, 1, 1)
+    for c = FIRST_GLYPH, LAST_GLYPH do
+        local x = (c - FIRST_GLYPH) % ATLAS_COLUMNS * self.cellWidth
+        local y = math.floor((c - FIRST_GLYPH) / ATLAS_COLUMNS) * self.cellHeight
+        love.graphics.print(string.char(c), x, y)
+        self.quads[c] = love.graphics.newQuad(x, y, self.cellWidth,
+            self.cellHeight, self.atlas:getDimensions())
+    end
+    love.graphics.pop()
+    -- bytes of the spans come as signed or unsigned chars depending on the ABI
+    for c = -128, 255 do
+        self.quads[c] = self.quads[c] or self.quads[string.byte('?')]
+    end
+
+    -- batches by key, and the frame each was last drawn in
+    self.lines = {}
+    self.count = 0
+    self.frame = 0
+    -- batches of lines dropped, to be filled again
+    self.free = {}
+end
+
+--- TextRenderer:build - fill a batch with the glyphs of a span
+function TextRenderer:build(span)
+    local batch = table.remove(self.free)
+    if batch then
+        batch:clear()
+    else
+        batch = love.graphics.newSpriteBatch(self.atlas, math.max(span.len, 1),
+            'static')
+    end
+    local text, hl, palette = span.text, span.hl, self.palette
+    local quads, cellWidth = self.quads, self.cellWidth
+    local current
+    for j = 0, span.len - 1 do
+        local class = hl[j]
+        if class ~= current then
+            current = class
+            local color = palette[class] or palette[0]
+            batch:setColor(color[1], color[2], color[3])
+        end
+        batch:add(quads[text[j]], j * cellWidth, 0)
+    end
+    return batch
+end
+
+--- TextRenderer:evict - drop the batches not drawn in the last frame, once
+-- there are more than the screen needs with SPARE_LINES to spare
+function TextRenderer:evict(onScreen)
+    if self.count <= onScreen + SPARE_LINES then
+        return
+    end
+    for key, line in pairs(self.lines) do
+        if line.frame ~= self.frame then
+            self.lines[key] = nil
+            self.count = self.count - 1
+            table.insert(self.free, line.batch)
+        end
+    end
+end
+
+--- TextRenderer:draw - draw n spans of the core, one line of cells each
+-- @param spans the spans, from 0
+-- @param n number of spans
+-- @param x left of the first cell
+-- @param y top of the first line
+function TextRenderer:draw(spans, n, x, y)
+    self.frame = self.frame + 1
+    -- the atlas holds white glyphs on clear cells, already multiplied by alpha
+    love.graphics.setBlendMode('alpha', 'premultiplied')
+    love.graphics.setColor(1, 1, 1)
+    for i = 0, n - 1 do
+        local span = spans[i]
+        -- the length tells apart most spans whose hashes collide
+        local key = span.len * 4294967296 + span.hash
+        local line = self.lines[key]
+        if line == nil then
+            line = {batch = self:build(span)}
+            self.lines[key] = line
+            self.count = self.count + 1
+        end
+        line.frame = self.frame
+        love.graphics.draw(line.batch, x, y + i * self.cellHeight)
+    end
+    love.graphics.setBlendMode('alpha')
+    self:evict(n)
+end
+
+return TextRenderer